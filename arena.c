@@ -0,0 +1,163 @@
+#include "arena.h"
+
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_HUGE_2M (21 << MAP_HUGE_SHIFT)
+
+static void *heap_alloc(size_t size) {
+    void *p;
+
+    if (posix_memalign(&p, sysconf(_SC_PAGESIZE), size) != 0)
+        return NULL;
+    memset(p, 0, size);
+    return p;
+}
+
+// Maps size bytes (a multiple of ARENA_CHUNK) from the huge page pool, or
+// else 2 MB aligned so that THP can back it with huge pages
+static unsigned char *map_chunk(size_t size, int *hugetlb) {
+    unsigned char *p, *raw, *aligned;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2M, -1, 0);
+    if (p != MAP_FAILED) {
+        *hugetlb = 1;
+        return p;
+    }
+
+    raw = mmap(NULL, size + ARENA_CHUNK, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    aligned = (unsigned char *)(((uintptr_t)raw + ARENA_CHUNK - 1) &
+                                ~(uintptr_t)(ARENA_CHUNK - 1));
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    if (raw + ARENA_CHUNK > aligned)
+        munmap(aligned + size, raw + ARENA_CHUNK - aligned);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    *hugetlb = 0;
+    return aligned;
+}
+
+// Prefers the node rather than insisting on it, so a full node still
+// gives memory. Fails quietly where mbind is not allowed.
+static void bind_node(void *p, size_t size, int node) {
+    unsigned long mask;
+
+    if (node < 0 || node >= (int)(8 * sizeof(mask)))
+        return;
+    mask = 1UL << node;
+    syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+}
+
+void arena_init(struct arena *a, int node) {
+    memset(a, 0, sizeof(*a));
+    a->node = node;
+}
+
+void arena_destroy(struct arena *a) {
+    struct arena_chunk *c = a->chunks;
+
+    while (c != NULL) {
+        struct arena_chunk *next = c->next;
+        munmap(c->base, c->size);
+        free(c);
+        c = next;
+    }
+    memset(a, 0, sizeof(*a));
+    a->node = -1;
+}
+
+int arena_reserve(struct arena *a, size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct arena_chunk *c = calloc(1, sizeof(*c));
+    int hugetlb;
+
+    if (c == NULL)
+        return -1;
+    c->size = (size + ARENA_CHUNK - 1) & ~(size_t)(ARENA_CHUNK - 1);
+    c->base = map_chunk(c->size, &hugetlb);
+    if (c->base == NULL) {
+        free(c);
+        return -1;
+    }
+    bind_node(c->base, c->size, a->node);
+    // Fault every page in now, then keep them
+    for (size_t off = 0; off < c->size; off += page)
+        c->base[off] = 0;
+    if (mlock(c->base, c->size) != 0)
+        a->unlocked++;
+
+    if (hugetlb)
+        a->hugetlb += c->size;
+    a->bytes += c->size;
+    // Newest first, so reserved space is used by the allocations after it
+    c->next = a->chunks;
+    a->chunks = c;
+    return 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t align = size >= page ? page : 64;
+
+    if (a == NULL)
+        return heap_alloc(size);
+    for (int tries = 0; tries < 2; tries++) {
+        for (struct arena_chunk *c = a->chunks; c != NULL; c = c->next) {
+            size_t off = (c->used + align - 1) & ~(align - 1);
+
+            if (off + size <= c->size) {
+                c->used = off + size;
+                a->used += size;
+                return c->base + off;
+            }
+        }
+        if (tries == 0 && arena_reserve(a, size) != 0)
+            break;
+    }
+    a->heap++;
+    return heap_alloc(size);
+}
+
+void arena_free(struct arena *a, void *p) {
+    unsigned char *b = p;
+
+    if (p == NULL)
+        return;
+    if (a != NULL) {
+        for (struct arena_chunk *c = a->chunks; c != NULL; c = c->next) {
+            if (b >= c->base && b < c->base + c->size)
+                return;
+        }
+    }
+    free(p);
+}
+
+int arena_usb_node(unsigned int bus) {
+    char path[64];
+    FILE *f;
+    int node = -1;
+
+    // The root hub's parent is the host controller's PCI device
+    snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%u/../numa_node",
+             bus);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+    return node;
+}
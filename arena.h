@@ -0,0 +1,55 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Memory for the streaming buffers: transfer and ring buffers when they
+ * are not usbfs memory, and the DSP block buffers. It is mapped in 2 MB
+ * aligned chunks, from the huge page pool when there are pages reserved
+ * (vm.nr_hugepages) and as transparent huge pages otherwise, bound to the
+ * NUMA node of the USB controller, faulted in and locked up front so that
+ * the first pass at the stream rate takes no page faults.
+ *
+ * Allocations are carved out of the chunks and only returned when the
+ * arena is destroyed; arena_free of arena memory does nothing. The arena is
+ * not thread safe, all allocation happens during setup.
+ */
+
+#define ARENA_CHUNK (2u << 20)
+
+struct arena_chunk {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    struct arena_chunk *next;
+};
+
+struct arena {
+    int node; // NUMA node to bind to, -1 for any
+    struct arena_chunk *chunks;
+    size_t bytes;           // mapped in chunks
+    size_t used;            // handed out
+    size_t hugetlb;         // bytes of chunks from the huge page pool
+    unsigned int unlocked;  // chunks mlock failed on
+    unsigned int heap;      // allocations that fell back to malloc
+};
+
+void arena_init(struct arena *a, int node);
+void arena_destroy(struct arena *a);
+
+// Maps a chunk of at least size bytes ahead of allocations that will need
+// it, so that they share huge pages. Returns 0 on success.
+int arena_reserve(struct arena *a, size_t size);
+
+// Returns size zeroed bytes, page aligned from a page up and cache line
+// aligned below. Falls back to the heap if no chunk can be mapped, and
+// with a NULL arena. NULL if that fails too.
+void *arena_alloc(struct arena *a, size_t size);
+// Frees heap memory; arena memory stays until arena_destroy. p may be NULL.
+void arena_free(struct arena *a, void *p);
+
+// The NUMA node of the host controller of USB bus bus, -1 if unknown.
+int arena_usb_node(unsigned int bus);
+
+#endif
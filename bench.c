@@ -0,0 +1,199 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "dsp.h"
+#include "fft.h"
+#include "stats.h"
+
+/*
+ * Microbenchmarks of the hot kernels, for every SIMD variant the CPU
+ * supports. Each kernel is run over a block of a transfer's worth of
+ * samples until the time per kernel is used up, and reported as input
+ * samples and input bytes per second. The end-to-end numbers come from
+ * rx888_stream itself with a simulated device, see make bench.
+ */
+
+#define BENCH_DEFAULT_SAMPLES 65536 // 8 SuperSpeed bursts, the default transfer
+
+struct bench {
+    const struct convert_impl *impl;
+    size_t n; // samples per call
+    uint16_t *in;
+    void *out;
+    float *aux; // Q output, and the FFT input
+    struct decimator dec;
+    struct iq_converter iq;
+    const struct fft *fft;
+};
+
+static uint64_t bench_ns = 250000000ULL;
+
+static void run_derand(struct bench *b) {
+    b->impl->derand(b->in, b->n);
+}
+
+static void run_to_f32(struct bench *b) {
+    b->impl->to_f32(b->in, b->n, 1, b->out);
+}
+
+static void run_pack12(struct bench *b) {
+    b->impl->pack12(b->in, b->n, 1, b->out);
+}
+
+static void run_to_s8(struct bench *b) {
+    b->impl->to_s8(b->in, b->n, 1, 8, b->out);
+}
+
+static volatile uint64_t bench_sink; // keeps power from being optimized out
+
+static void run_power(struct bench *b) {
+    bench_sink = b->impl->power(b->in, b->n, 1);
+}
+
+static void run_iq(struct bench *b) {
+    iq_process(&b->iq, b->in, b->n, 1, b->out, b->aux);
+}
+
+static void run_decimate(struct bench *b) {
+    decimator_process(&b->dec, (const int16_t *)b->in, b->n, b->out);
+}
+
+// Transforms are in place and unscaled, so each starts from a fresh copy
+// of the input, as they would from the window in the spectrum stage
+static void run_fft(struct bench *b) {
+    float complex *v = b->out;
+
+    memcpy(v, b->aux, b->n * sizeof(float complex));
+    for (size_t i = 0; i < b->n; i += b->fft->n)
+        fft_forward(b->fft, v + i);
+}
+
+// Runs fn until bench_ns have passed and prints the rate. bytes is the
+// input size of one call.
+static void measure(const char *kernel, const char *variant,
+                    void (*fn)(struct bench *), struct bench *b, size_t bytes) {
+    uint64_t start, elapsed, calls = 0;
+
+    fn(b); // warm the caches and fault in the output
+    start = stats_now_ns();
+    do {
+        fn(b);
+        calls++;
+        elapsed = stats_now_ns() - start;
+    } while (elapsed < bench_ns);
+    printf("%-12s %-8s %10.1f %8.2f\n", kernel, variant,
+           (double)calls * b->n * 1e3 / elapsed,
+           (double)calls * bytes / elapsed);
+}
+
+static void printhelp(void) {
+    fprintf(stderr, "Usage: rx888_bench [options]\n");
+    fprintf(stderr, " --simd, -k         Only this SIMD variant\n");
+    fprintf(stderr, " --samples, -n      Samples per call, default %d\n",
+            BENCH_DEFAULT_SAMPLES);
+    fprintf(stderr, " --time, -T         Milliseconds per kernel, default 250\n");
+    fprintf(stderr, " --help, -h         This help\n");
+}
+
+int main(int argc, char **argv) {
+    static const unsigned int fft_sizes[] = {64, 1024, 16384};
+    static struct option long_options[] = {
+        {"simd", required_argument, 0, 'k'},
+        {"samples", required_argument, 0, 'n'},
+        {"time", required_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+    const char *simd = NULL;
+    struct bench b = {0};
+    size_t n = BENCH_DEFAULT_SAMPLES;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "k:n:T:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'k':
+            simd = optarg;
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            bench_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+            break;
+        default:
+            printhelp();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    // Whole FFT blocks and whole groups of 4 for the IQ mixer
+    if (n < fft_sizes[2] || n % fft_sizes[2] != 0 || bench_ns == 0) {
+        fprintf(stderr, "Samples must be a multiple of %u, time above 0\n",
+                fft_sizes[2]);
+        return 1;
+    }
+    if (simd != NULL && convert_select(simd) == NULL) {
+        fprintf(stderr, "SIMD variant %s is not available on this CPU\n", simd);
+        return 1;
+    }
+
+    b.n = n;
+    b.in = malloc(n * sizeof(uint16_t));
+    b.out = malloc(n * sizeof(float complex));
+    b.aux = malloc(n * sizeof(float complex));
+    if (b.in == NULL || b.out == NULL || b.aux == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    srand(0x2208);
+    for (size_t i = 0; i < n; i++)
+        b.in[i] = (uint16_t)rand();
+
+    printf("%-12s %-8s %10s %8s\n", "kernel", "variant", "Msamples/s",
+           "GB/s");
+    for (const struct convert_impl *impl = convert_impls; impl->name; impl++) {
+        if (!impl->supported() ||
+            (simd != NULL && strcmp(simd, impl->name) != 0))
+            continue;
+        b.impl = impl;
+        measure("derand", impl->name, run_derand, &b, n * sizeof(uint16_t));
+        measure("to_f32", impl->name, run_to_f32, &b, n * sizeof(uint16_t));
+        measure("pack12", impl->name, run_pack12, &b, n * sizeof(uint16_t));
+        measure("to_s8", impl->name, run_to_s8, &b, n * sizeof(uint16_t));
+        measure("power", impl->name, run_power, &b, n * sizeof(uint16_t));
+        if (iq_init(&b.iq, n, impl, NULL) == 0) {
+            measure("iq", impl->name, run_iq, &b, n * sizeof(uint16_t));
+            iq_free(&b.iq);
+        }
+        for (unsigned int factor = 2; factor <= 32; factor *= 4) {
+            char name[16];
+
+            if (decimator_init(&b.dec, factor, n, impl, NULL) != 0)
+                continue;
+            snprintf(name, sizeof(name), "decimate/%u", factor);
+            measure(name, impl->name, run_decimate, &b, n * sizeof(int16_t));
+            decimator_free(&b.dec);
+        }
+    }
+
+    // The FFT has no SIMD variants of its own
+    for (size_t i = 0; i < 2 * n; i++)
+        b.aux[i] = (float)rand() / RAND_MAX - 0.5f;
+    for (size_t i = 0; i < sizeof(fft_sizes) / sizeof(fft_sizes[0]); i++) {
+        struct fft f;
+        char name[16];
+
+        if (fft_init(&f, fft_sizes[i]) != 0)
+            continue;
+        b.fft = &f;
+        snprintf(name, sizeof(name), "fft/%u", fft_sizes[i]);
+        measure(name, "-", run_fft, &b, n * sizeof(float complex));
+        fft_free(&f);
+    }
+
+    free(b.in);
+    free(b.out);
+    free(b.aux);
+    return 0;
+}
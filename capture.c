@@ -0,0 +1,203 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *capture_datatype(enum sample_format format, int iq) {
+    switch (format) {
+    case FORMAT_S16:
+        return iq ? "ci16_le" : "ri16_le";
+    case FORMAT_F32:
+        return iq ? "cf32_le" : "rf32_le";
+    case FORMAT_S8:
+        return iq ? "ci8" : "ri8";
+    default:
+        return NULL;
+    }
+}
+
+// ISO 8601 in UTC with nanoseconds, as SigMF core:datetime wants
+static void capture_datetime(uint64_t ns, char *buf, size_t len) {
+    time_t secs = ns / 1000000000ULL;
+    struct tm tm;
+    size_t n;
+
+    gmtime_r(&secs, &tm);
+    n = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, len - n, ".%09lluZ",
+             (unsigned long long)(ns % 1000000000ULL));
+}
+
+// Writes the meta file next to itself and renames it into place, so that
+// readers never see half of one
+static int capture_write_meta(struct capture *c) {
+    size_t len = strlen(c->meta_path) + 5;
+    char *tmp = malloc(len);
+    char when[64];
+    FILE *f;
+    int ret;
+
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len, "%s.tmp", c->meta_path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(tmp);
+        return -1;
+    }
+    fprintf(f,
+            "{\n"
+            "  \"global\": {\n"
+            "    \"core:version\": \"1.0.0\",\n"
+            "    \"core:datatype\": \"%s\",\n"
+            "    \"core:sample_rate\": %.17g,\n"
+            "    \"core:hw\": \"RX888\",\n"
+            "    \"core:recorder\": \"rx888_stream\",\n"
+            "    \"core:extensions\": [{\"name\": \"rx888\", \"version\": "
+            "\"1.0.0\", \"optional\": true}]%s\n"
+            "  },\n"
+            "  \"captures\": [",
+            c->datatype, c->sample_rate, c->hw);
+    for (size_t i = 0; i < c->nsegs; i++) {
+        const struct capture_segment *s = &c->segs[i];
+
+        capture_datetime(s->timestamp_ns, when, sizeof(when));
+        fprintf(f,
+                "%s\n    {\"core:sample_start\": %llu, "
+                "\"core:global_index\": %llu, \"core:datetime\": \"%s\", "
+                "\"rx888:lost\": %llu}",
+                i > 0 ? "," : "", (unsigned long long)s->sample_start,
+                (unsigned long long)s->global_index, when,
+                (unsigned long long)s->lost);
+    }
+    fprintf(f, "%s],\n  \"annotations\": []\n}\n", c->nsegs > 0 ? "\n  " : "");
+    ret = fclose(f);
+    if (ret == 0)
+        ret = rename(tmp, c->meta_path);
+    free(tmp);
+    return ret;
+}
+
+static void capture_entry(struct capture *c, const struct block_info *info,
+                          uint64_t offset) {
+    struct capture_index_entry e = {
+        .sample_index = info->sample_index,
+        .offset = offset,
+        .timestamp_ns = info->timestamp_ns,
+        .lost = info->lost,
+    };
+
+    if (write_all(c->index_fd, &e, sizeof(e)) != 0)
+        fprintf(stderr, "capture: index write failed: %s\n", strerror(errno));
+}
+
+int capture_open(struct capture *c, const char *base,
+                 const struct capture_config *cfg, unsigned int interval_ms) {
+    struct capture_index_header h = {
+        .magic = CAPTURE_INDEX_MAGIC,
+        .version = 1,
+        .header_len = sizeof(h),
+        .entry_len = sizeof(struct capture_index_entry),
+        .ratio = cfg->ratio,
+        .samplerate = cfg->samplerate,
+    };
+    size_t len = strlen(base) + 16;
+    char *idx_path;
+
+    memset(c, 0, sizeof(*c));
+    c->index_fd = -1;
+    c->datatype = capture_datatype(cfg->format, cfg->iq);
+    if (c->datatype == NULL) {
+        fprintf(stderr, "capture: SigMF has no type for %s samples\n",
+                format_name(cfg->format));
+        return -1;
+    }
+    c->ratio = cfg->ratio;
+    c->sample_bytes = format_bytes(cfg->format, cfg->iq ? 2 : 1);
+    c->sample_rate = (double)cfg->samplerate / cfg->ratio;
+    c->interval_ns = (uint64_t)interval_ms * 1000000;
+    h.sample_bytes = c->sample_bytes;
+
+    c->meta_path = malloc(len);
+    idx_path = malloc(len);
+    c->hw = strdup(cfg->hw != NULL ? cfg->hw : "");
+    if (c->meta_path == NULL || idx_path == NULL || c->hw == NULL) {
+        fprintf(stderr, "capture: out of memory\n");
+        free(idx_path);
+        return -1;
+    }
+    snprintf(c->meta_path, len, "%s.sigmf-meta", base);
+    snprintf(idx_path, len, "%s.sigmf-idx", base);
+
+    c->index_fd = open(idx_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c->index_fd < 0 || write_all(c->index_fd, &h, sizeof(h)) != 0 ||
+        capture_write_meta(c) != 0) {
+        fprintf(stderr, "capture: could not create %s: %s\n", base,
+                strerror(errno));
+        free(idx_path);
+        return -1;
+    }
+    free(idx_path);
+    return 0;
+}
+
+void capture_block(struct capture *c, const struct block_info *info,
+                   uint64_t offset) {
+    if (c->meta_path == NULL || c->index_fd < 0)
+        return;
+    // Each stretch without losses is a capture segment of its own
+    if (c->nsegs == 0 || info->lost > 0 || info->restarted) {
+        if (c->nsegs == c->segs_size) {
+            size_t size = c->segs_size > 0 ? 2 * c->segs_size : 16;
+            struct capture_segment *segs =
+                realloc(c->segs, size * sizeof(*segs));
+            if (segs == NULL)
+                return;
+            c->segs = segs;
+            c->segs_size = size;
+        }
+        c->segs[c->nsegs++] = (struct capture_segment){
+            .sample_start = offset / c->sample_bytes,
+            .global_index = info->sample_index / c->ratio,
+            .timestamp_ns = info->timestamp_ns,
+            .lost = info->lost,
+        };
+        c->meta_dirty = 1;
+        capture_entry(c, info, offset);
+        c->next_time = info->timestamp_ns + c->interval_ns;
+    } else if (info->timestamp_ns >= c->next_time) {
+        capture_entry(c, info, offset);
+        c->next_time = info->timestamp_ns + c->interval_ns;
+    }
+    // A run of gaps would otherwise rewrite it for every block
+    if (c->meta_dirty && info->timestamp_ns >= c->next_meta) {
+        if (capture_write_meta(c) != 0)
+            fprintf(stderr, "capture: could not write %s: %s\n",
+                    c->meta_path, strerror(errno));
+        c->meta_dirty = 0;
+        c->next_meta = info->timestamp_ns + c->interval_ns;
+    }
+}
+
+void capture_close(struct capture *c) {
+    if (c->meta_path == NULL)
+        return;
+    if (c->index_fd >= 0) {
+        if (capture_write_meta(c) != 0)
+            fprintf(stderr, "capture: could not write %s: %s\n",
+                    c->meta_path, strerror(errno));
+        close(c->index_fd);
+    }
+    free(c->meta_path);
+    free(c->hw);
+    free(c->segs);
+    c->index_fd = -1;
+    c->meta_path = NULL;
+    c->hw = NULL;
+    c->segs = NULL;
+}
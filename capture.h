@@ -0,0 +1,93 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+#include "sink.h"
+
+/*
+ * SigMF capture: the output stream goes to BASE.sigmf-data, which is
+ * plain samples, and is described by BASE.sigmf-meta. The meta file lists
+ * a capture segment for each stretch without lost samples. It is
+ * rewritten after a discontinuity (at most once per interval) and on
+ * close. Next to them,
+ * BASE.sigmf-idx is appended to as the data is written. It holds a
+ * capture_index_header and then fixed-size capture_index_entry records,
+ * one per interval and one at every gap, in stream order. That way a
+ * reader can mmap it and binary search by sample index, byte offset or
+ * time while the capture is still running. Between two entries, offset
+ * grows by sample_bytes per output sample, and an output sample is ratio
+ * ADC samples. Fields are native endian.
+ */
+
+#define CAPTURE_INDEX_MAGIC 0x49435852 // "RXCI"
+struct capture_index_header {
+    uint32_t magic;
+    uint16_t version;      // 1
+    uint16_t header_len;   // sizeof(struct capture_index_header)
+    uint32_t entry_len;    // sizeof(struct capture_index_entry)
+    uint32_t ratio;        // ADC samples per output sample
+    uint32_t sample_bytes; // bytes per output sample, all of I and Q
+    uint32_t reserved;
+    uint64_t samplerate;   // of the ADC
+};
+
+struct capture_index_entry {
+    uint64_t sample_index; // ADC sample counter
+    uint64_t offset;       // where its output starts in BASE.sigmf-data
+    uint64_t timestamp_ns; // CLOCK_REALTIME when it was received
+    uint64_t lost;         // samples lost just before, 0 for a time entry
+};
+
+struct capture_config {
+    unsigned int samplerate; // ADC rate
+    unsigned int ratio;      // ADC samples per output sample
+    enum sample_format format;
+    int iq;                  // complex, I and Q interleaved
+    const char *hw;          // rx888 extension members for .global,
+                             // ",\"rx888:key\":value" each
+};
+
+struct capture_segment {
+    uint64_t sample_start; // output samples into the data file
+    uint64_t global_index; // ADC sample counter / ratio
+    uint64_t timestamp_ns;
+    uint64_t lost;
+};
+
+struct capture {
+    char *meta_path;
+    int index_fd;
+    const char *datatype;
+    double sample_rate; // of the output
+    unsigned int ratio;
+    unsigned int sample_bytes;
+    char *hw;
+    uint64_t interval_ns; // between time entries and meta rewrites
+    uint64_t next_time;
+    uint64_t next_meta;
+    int meta_dirty; // segments not in the meta file yet
+    struct capture_segment *segs;
+    size_t nsegs, segs_size;
+};
+
+// SigMF datatype of an output format, NULL if SigMF has none.
+const char *capture_datatype(enum sample_format format, int iq);
+
+// Creates BASE.sigmf-meta and BASE.sigmf-idx; the caller writes the data
+// to BASE.sigmf-data. interval_ms is the spacing of time entries. Returns
+// 0 on success, -1 on failure (reported on stderr).
+int capture_open(struct capture *c, const char *base,
+                 const struct capture_config *cfg, unsigned int interval_ms);
+
+// Called for every block before its output is written at offset. Does
+// nothing on a capture that is zeroed or failed to open.
+void capture_block(struct capture *c, const struct block_info *info,
+                   uint64_t offset);
+
+// Writes the final meta file.
+void capture_close(struct capture *c);
+
+#endif
@@ -0,0 +1,245 @@
+#include "channelizer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#define CHANNELIZER_BETA 8.0
+
+static void channelizer_work(struct channel_worker *w) {
+    struct channelizer *c = w->c;
+    unsigned int m = c->nchan;
+    size_t per = (c->nsteps + c->nthreads - 1) / c->nthreads;
+    size_t first = w->id * per;
+    size_t last = first + per < c->nsteps ? first + per : c->nsteps;
+
+    // Weight the window for each step by the prototype, fold it to nchan
+    // points and transform
+    for (size_t n = first; n < last; n++) {
+        const float complex *x = c->in + n * m;
+        float complex *v = c->out + n * m;
+
+        for (unsigned int p = 0; p < m; p++)
+            v[p] = c->proto[p] * x[p];
+        for (unsigned int t = 1; t < CHANNELIZER_TAPS; t++) {
+            const float *h = c->proto + t * m;
+            const float complex *xt = x + t * m;
+            for (unsigned int p = 0; p < m; p++)
+                v[p] += h[p] * xt[p];
+        }
+        fft_forward(&c->fft, v);
+    }
+
+    pthread_barrier_wait(&c->filtered);
+
+    for (unsigned int k = w->id; k < m; k += c->nthreads) {
+        size_t n = c->nsteps;
+
+        if (c->format == FORMAT_S16) {
+            int16_t *o = (int16_t *)w->obuf;
+            for (size_t s = 0; s < n; s++) {
+                float iq[2] = {crealf(c->out[s * m + k]),
+                               cimagf(c->out[s * m + k])};
+                dsp_f32_to_s16(iq, o + 2 * s, 2);
+            }
+        } else {
+            float *o = (float *)w->obuf;
+            for (size_t s = 0; s < n; s++) {
+                o[2 * s] = crealf(c->out[s * m + k]);
+                o[2 * s + 1] = cimagf(c->out[s * m + k]);
+            }
+        }
+        sink_write(c->sinks[k], w->obuf, format_bytes(c->format, 2 * n),
+                   c->info);
+    }
+}
+
+static void *channelizer_thread(void *arg) {
+    struct channel_worker *w = arg;
+    struct channelizer *c = w->c;
+    unsigned int seen = 0;
+
+    while (1) {
+        int stop;
+
+        pthread_mutex_lock(&c->lock);
+        while (c->gen == seen && !c->stop)
+            pthread_cond_wait(&c->wake, &c->lock);
+        seen = c->gen;
+        stop = c->stop;
+        pthread_mutex_unlock(&c->lock);
+        if (stop)
+            break;
+
+        channelizer_work(w);
+
+        pthread_mutex_lock(&c->lock);
+        if (--c->running == 0)
+            pthread_cond_signal(&c->idle);
+        pthread_mutex_unlock(&c->lock);
+    }
+    return NULL;
+}
+
+// Accepts a spec with exactly one %d conversion, optionally zero padded
+// with a width, e.g. "ch%d.raw" or "ch%02d.raw".
+static int template_valid(const char *tmpl) {
+    const char *p = strchr(tmpl, '%');
+
+    if (p == NULL || strchr(p + 1, '%') != NULL)
+        return 0;
+    p++;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    return *p == 'd';
+}
+
+int channelizer_init(struct channelizer *c, unsigned int nchan,
+                     unsigned int nthreads, size_t max_in,
+                     const char *sink_template, enum sample_format format,
+                     const struct rt_cpus *cpus, struct arena *arena) {
+    size_t hist = (size_t)(CHANNELIZER_TAPS - 1) * nchan;
+
+    memset(c, 0, sizeof(*c));
+    if (!template_valid(sink_template)) {
+        fprintf(stderr, "Channel output %s needs a single %%d\n",
+                sink_template);
+        return -1;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > nchan)
+        nthreads = nchan;
+    if (fft_init(&c->fft, nchan) != 0) {
+        fprintf(stderr, "Channel count must be a power of two\n");
+        return -1;
+    }
+
+    c->nchan = nchan;
+    c->nthreads = nthreads;
+    c->format = format;
+    c->arena = arena;
+    c->cap = hist + nchan + max_in;
+    c->max_steps = c->cap / nchan;
+    c->proto = malloc((size_t)nchan * CHANNELIZER_TAPS * sizeof(float));
+    c->in = arena_alloc(arena, c->cap * sizeof(float complex));
+    c->out = arena_alloc(arena, c->max_steps * nchan * sizeof(float complex));
+    c->sinks = calloc(nchan, sizeof(struct sink *));
+    c->workers = calloc(nthreads, sizeof(struct channel_worker));
+    c->nworkers = nthreads;
+    if (c->proto == NULL || c->in == NULL || c->out == NULL ||
+        c->sinks == NULL || c->workers == NULL)
+        goto fail;
+
+    // Start with a full window of zeros so the first step is valid
+    c->avail = hist;
+    dsp_lowpass_design(c->proto, nchan * CHANNELIZER_TAPS, 0.5 / nchan,
+                       CHANNELIZER_BETA);
+
+    for (unsigned int k = 0; k < nchan; k++) {
+        char spec[1024];
+        snprintf(spec, sizeof(spec), sink_template, (int)k);
+        c->sinks[k] = sink_open(spec);
+        if (c->sinks[k] == NULL)
+            goto fail;
+    }
+
+    for (unsigned int t = 0; t < nthreads; t++) {
+        c->workers[t].c = c;
+        c->workers[t].id = t;
+        c->workers[t].obuf =
+            arena_alloc(arena, 2 * c->max_steps * sizeof(float));
+        if (c->workers[t].obuf == NULL)
+            goto fail;
+    }
+
+    // The calling thread does the share of worker 0
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    pthread_cond_init(&c->idle, NULL);
+    c->started = 1;
+    for (unsigned int t = 1; t < nthreads; t++) {
+        if (pthread_create(&c->workers[t].thread, NULL, channelizer_thread,
+                           &c->workers[t]) != 0) {
+            fprintf(stderr, "Could only start %u channelizer threads\n", t);
+            break;
+        }
+        if (cpus != NULL)
+            rt_pin(c->workers[t].thread, cpus, t - 1);
+        c->started++;
+    }
+    // Work is only shared out between the threads that are running
+    c->nthreads = c->started;
+    pthread_barrier_init(&c->filtered, NULL, c->nthreads);
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to set up channelizer\n");
+    channelizer_free(c);
+    return -1;
+}
+
+void channelizer_free(struct channelizer *c) {
+    if (c->started) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = 1;
+        pthread_cond_broadcast(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+        for (unsigned int t = 1; t < c->started; t++)
+            pthread_join(c->workers[t].thread, NULL);
+        pthread_barrier_destroy(&c->filtered);
+        pthread_cond_destroy(&c->idle);
+        pthread_cond_destroy(&c->wake);
+        pthread_mutex_destroy(&c->lock);
+    }
+    if (c->workers != NULL) {
+        for (unsigned int t = 0; t < c->nworkers; t++)
+            arena_free(c->arena, c->workers[t].obuf);
+        free(c->workers);
+    }
+    if (c->sinks != NULL) {
+        for (unsigned int k = 0; k < c->nchan; k++)
+            sink_close(c->sinks[k]);
+        free(c->sinks);
+    }
+    free(c->proto);
+    arena_free(c->arena, c->in);
+    arena_free(c->arena, c->out);
+    fft_free(&c->fft);
+    memset(c, 0, sizeof(*c));
+}
+
+void channelizer_process(struct channelizer *c, const float *i,
+                         const float *q, size_t n,
+                         const struct block_info *info) {
+    size_t window = (size_t)CHANNELIZER_TAPS * c->nchan;
+    size_t used;
+
+    for (size_t s = 0; s < n; s++)
+        c->in[c->avail + s] = i[s] + q[s] * I;
+    c->avail += n;
+    if (c->avail < window)
+        return;
+
+    c->nsteps = (c->avail - window) / c->nchan + 1;
+    c->info = info;
+    pthread_mutex_lock(&c->lock);
+    c->running = c->nthreads - 1;
+    c->gen++;
+    pthread_cond_broadcast(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+
+    channelizer_work(&c->workers[0]);
+
+    pthread_mutex_lock(&c->lock);
+    while (c->running > 0)
+        pthread_cond_wait(&c->idle, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+
+    // Keep the samples the next steps still need
+    used = c->nsteps * c->nchan;
+    c->avail -= used;
+    memmove(c->in, c->in + used, c->avail * sizeof(float complex));
+}
@@ -0,0 +1,89 @@
+#ifndef CHANNELIZER_H
+#define CHANNELIZER_H
+
+#include <complex.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "fft.h"
+#include "format.h"
+#include "rt.h"
+#include "sink.h"
+
+/*
+ * Critically sampled polyphase filter bank channelizer.
+ *
+ * Splits a complex stream into nchan channels, each decimated by nchan and
+ * shifted to baseband. Channel k is centred on k * fs / nchan, so channels
+ * nchan/2 .. nchan-1 are the negative frequencies. For every output step
+ * the input window is weighted by the prototype low-pass, folded into
+ * nchan points and run through one FFT, which replaces nchan separate FIR
+ * filters.
+ *
+ * Work on a block is split across a pool of threads: first the output
+ * steps are shared out for filtering and FFT, then the channels are shared
+ * out for conversion and writing to their sinks.
+ */
+
+#define CHANNELIZER_TAPS 8 // prototype taps per polyphase branch
+
+struct channelizer;
+
+struct channel_worker {
+    struct channelizer *c;
+    unsigned int id;
+    pthread_t thread;
+    unsigned char *obuf; // one channel's output for one block
+};
+
+struct channelizer {
+    unsigned int nchan;
+    unsigned int nthreads;
+    enum sample_format format;
+    float *proto; // nchan * CHANNELIZER_TAPS
+
+    float complex *in; // unconsumed input, including filter history
+    size_t avail;
+    size_t cap;
+
+    float complex *out; // nsteps rows of nchan channels
+    size_t nsteps;
+    size_t max_steps;
+
+    struct fft fft;
+    struct sink **sinks; // one per channel
+    struct channel_worker *workers;
+    unsigned int nworkers; // allocated, nthreads of them are running
+    pthread_mutex_t lock;
+    pthread_cond_t wake;         // a new block (gen) or stop
+    pthread_cond_t idle;         // all helper threads finished the block
+    pthread_barrier_t filtered;  // between the FFT and the write phases
+    unsigned int gen;
+    unsigned int running;
+    int stop;
+    unsigned int started;
+    const struct block_info *info; // of the block being processed
+    struct arena *arena;
+};
+
+// nchan must be a power of two. sink_template is a sink spec containing a
+// single %d, replaced by the channel number. Blocks passed in are at most
+// max_in samples. format is FORMAT_S16 or FORMAT_F32. Worker threads are
+// spread one per CPU over cpus, if given. Block buffers come from arena,
+// which may be NULL. Returns 0 on success, -1 on failure (reported on
+// stderr).
+int channelizer_init(struct channelizer *c, unsigned int nchan,
+                     unsigned int nthreads, size_t max_in,
+                     const char *sink_template, enum sample_format format,
+                     const struct rt_cpus *cpus, struct arena *arena);
+void channelizer_free(struct channelizer *c);
+
+// Channelizes n complex samples given as separate I and Q arrays and
+// writes every channel's output to its sink, tagged with info.
+void channelizer_process(struct channelizer *c, const float *i,
+                         const float *q, size_t n,
+                         const struct block_info *info);
+
+#endif
@@ -0,0 +1,140 @@
+#include "control.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+#define CONTROL_LINE 512
+#define CONTROL_REPLY 2048
+
+static struct {
+    control_handler handler;
+    int listen_fd; // -1 when reading stdin
+    const char *path;
+    pthread_t thread;
+    atomic_bool stop;
+    bool started;
+} control;
+
+// Waits for fd to become readable, checking for control_stop every 100 ms.
+// Returns false when stopping.
+static bool wait_readable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    while (!atomic_load(&control.stop)) {
+        if (poll(&pfd, 1, 100) > 0)
+            return true;
+    }
+    return false;
+}
+
+// Serves one client until it goes away. out is where replies go.
+static void serve(int in, int out) {
+    char line[CONTROL_LINE], reply[CONTROL_REPLY];
+    size_t have = 0;
+
+    while (wait_readable(in)) {
+        ssize_t n = read(in, line + have, sizeof(line) - 1 - have);
+        char *start, *nl;
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        have += n;
+        line[have] = '\0';
+        start = line;
+        while ((nl = strchr(start, '\n')) != NULL) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            reply[0] = '\0';
+            if (*start != '\0')
+                control.handler(start, reply, sizeof(reply));
+            if (reply[0] != '\0' && write_all(out, reply, strlen(reply)) != 0)
+                return;
+            start = nl + 1;
+        }
+        have -= start - line;
+        memmove(line, start, have);
+        // A line that does not fit is dropped
+        if (have == sizeof(line) - 1)
+            have = 0;
+    }
+}
+
+static void *control_thread(void *arg) {
+    (void)arg;
+    if (control.listen_fd < 0) {
+        serve(0, 2);
+        return NULL;
+    }
+    while (wait_readable(control.listen_fd)) {
+        int fd = accept(control.listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve(fd, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int control_start(const char *spec, control_handler handler) {
+    struct sockaddr_un addr;
+
+    control.handler = handler;
+    control.listen_fd = -1;
+    if (strcmp(spec, "-") != 0) {
+        if (strlen(spec) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Control socket path %s is too long\n", spec);
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, spec);
+        control.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // A socket left over from an earlier run is in the way
+        unlink(spec);
+        if (control.listen_fd < 0 ||
+            bind(control.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(control.listen_fd, 4) != 0) {
+            fprintf(stderr, "Could not listen on %s: %s\n", spec,
+                    strerror(errno));
+            if (control.listen_fd >= 0)
+                close(control.listen_fd);
+            return -1;
+        }
+        control.path = spec;
+    }
+    if (pthread_create(&control.thread, NULL, control_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to start control thread\n");
+        if (control.listen_fd >= 0) {
+            close(control.listen_fd);
+            unlink(spec);
+        }
+        return -1;
+    }
+    control.started = true;
+    return 0;
+}
+
+void control_stop(void) {
+    if (!control.started)
+        return;
+    atomic_store(&control.stop, true);
+    pthread_join(control.thread, NULL);
+    if (control.listen_fd >= 0) {
+        close(control.listen_fd);
+        unlink(control.path);
+    }
+    control.started = false;
+}
@@ -0,0 +1,21 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+/*
+ * Runtime control channel: a line protocol on stdin ("-") or on a Unix
+ * stream socket at a path, served by its own thread so that nothing it
+ * does holds up the transfers. Every line goes to the handler, which
+ * writes the reply; clients of the socket are served one at a time.
+ */
+
+// Handles one command line (no newline). reply is a buffer of len bytes
+// for the answer, which should end in a newline.
+typedef void (*control_handler)(char *line, char *reply, size_t len);
+
+// Returns 0 on success, -1 with a message on stderr.
+int control_start(const char *spec, control_handler handler);
+void control_stop(void);
+
+#endif
@@ -0,0 +1,811 @@
+#include "convert.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON 1
+#endif
+
+static int always_supported(void) { return 1; }
+
+static void derand_scalar(uint16_t *samples, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] ^= 0xfffe * (samples[i] & 1);
+    }
+}
+
+static void halfband_scalar(const float *even, const float *odd,
+                            const float *taps, unsigned int ntaps, float *out,
+                            size_t n) {
+    for (size_t m = 0; m < n; m++) {
+        float acc = odd != NULL ? 0.5f * odd[m] : 0.0f;
+        for (unsigned int i = 0; i < ntaps / 2; i++)
+            acc += taps[i] * (even[m + i] + even[m + ntaps - 1 - i]);
+        out[m] = acc;
+    }
+}
+
+static inline uint16_t derand_sample(uint16_t v) { return v ^ (0xfffe * (v & 1)); }
+
+static void iq_split_scalar(const uint16_t *in, size_t count, int derand,
+                            float *i_out, float *q_out) {
+    for (size_t k = 0; 2 * k + 1 < count; k++) {
+        uint16_t a = in[2 * k], b = in[2 * k + 1];
+        float sign = (k & 1) ? -1.0f : 1.0f;
+
+        if (derand) {
+            a = derand_sample(a);
+            b = derand_sample(b);
+        }
+        i_out[k] = sign * (int16_t)a;
+        q_out[k] = -sign * (int16_t)b;
+    }
+}
+
+static void pack12_scalar(const uint16_t *in, size_t count, int derand,
+                          uint8_t *out) {
+    size_t k = 0;
+
+    for (; k + 1 < count; k += 2) {
+        uint16_t a = in[k], b = in[k + 1];
+
+        if (derand) {
+            a = derand_sample(a);
+            b = derand_sample(b);
+        }
+        // The arithmetic shift keeps the sign in bit 11
+        a = (uint16_t)((int16_t)a >> 4);
+        b = (uint16_t)((int16_t)b >> 4);
+        out[0] = (uint8_t)a;
+        out[1] = (uint8_t)(((a >> 8) & 0x0f) | (b << 4));
+        out[2] = (uint8_t)(b >> 4);
+        out += 3;
+    }
+    if (k < count) {
+        uint16_t a = derand ? derand_sample(in[k]) : in[k];
+
+        a = (uint16_t)((int16_t)a >> 4);
+        out[0] = (uint8_t)a;
+        out[1] = (uint8_t)((a >> 8) & 0x0f);
+    }
+}
+
+static void to_s8_scalar(const uint16_t *in, size_t count, int derand,
+                         unsigned int shift, int8_t *out) {
+    for (size_t i = 0; i < count; i++) {
+        uint16_t a = derand ? derand_sample(in[i]) : in[i];
+        int v = (int16_t)a >> shift;
+
+        out[i] = v > 127 ? 127 : v < -128 ? -128 : v;
+    }
+}
+
+static void to_f32_scalar(const uint16_t *in, size_t count, int derand,
+                          float *out) {
+    for (size_t i = 0; i < count; i++)
+        out[i] = (int16_t)(derand ? derand_sample(in[i]) : in[i]);
+}
+
+static uint64_t power_scalar(const uint16_t *in, size_t count, int derand) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t v = (int16_t)(derand ? derand_sample(in[i]) : in[i]);
+        sum += (uint32_t)(v * v);
+    }
+    return sum;
+}
+
+#ifdef CONVERT_X86
+
+static int avx2_supported(void) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static int avx512_supported(void) {
+    // The AVX-512 variant borrows the AVX2 12-bit packer
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") && avx2_supported();
+}
+
+__attribute__((target("avx2"))) static void derand_avx2(uint16_t *samples,
+                                                         size_t count) {
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i mask = _mm256_set1_epi16((short)0xfffe);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i *p = (__m256i *)(samples + i);
+        __m256i v = _mm256_loadu_si256(p);
+        // 0xffff where bit 0 is set, 0 elsewhere
+        __m256i lsb = _mm256_cmpeq_epi16(_mm256_and_si256(v, one), one);
+        v = _mm256_xor_si256(v, _mm256_and_si256(lsb, mask));
+        _mm256_storeu_si256(p, v);
+    }
+    derand_scalar(samples + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+derand_avx512(uint16_t *samples, size_t count) {
+    const __m512i one = _mm512_set1_epi16(1);
+    const __m512i flip = _mm512_set1_epi16((short)0xfffe);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(samples + i);
+        __mmask32 lsb = _mm512_test_epi16_mask(v, one);
+        v = _mm512_mask_mov_epi16(v, lsb, _mm512_xor_si512(v, flip));
+        _mm512_storeu_si512(samples + i, v);
+    }
+    derand_scalar(samples + i, count - i);
+}
+
+__attribute__((target("avx2,fma"))) static void
+halfband_avx2(const float *even, const float *odd, const float *taps,
+              unsigned int ntaps, float *out, size_t n) {
+    const __m256 half = _mm256_set1_ps(0.5f);
+    size_t m = 0;
+
+    // Vectorized across outputs; taps are folded by symmetry
+    for (; m + 8 <= n; m += 8) {
+        __m256 acc = odd != NULL ? _mm256_mul_ps(half, _mm256_loadu_ps(odd + m))
+                                 : _mm256_setzero_ps();
+        for (unsigned int i = 0; i < ntaps / 2; i++) {
+            __m256 s = _mm256_add_ps(_mm256_loadu_ps(even + m + i),
+                                     _mm256_loadu_ps(even + m + ntaps - 1 - i));
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(taps[i]), s, acc);
+        }
+        _mm256_storeu_ps(out + m, acc);
+    }
+    halfband_scalar(even + m, odd != NULL ? odd + m : NULL, taps, ntaps,
+                    out + m, n - m);
+}
+
+__attribute__((target("avx512f"))) static void
+halfband_avx512(const float *even, const float *odd, const float *taps,
+                unsigned int ntaps, float *out, size_t n) {
+    const __m512 half = _mm512_set1_ps(0.5f);
+    size_t m = 0;
+
+    for (; m + 16 <= n; m += 16) {
+        __m512 acc = odd != NULL ? _mm512_mul_ps(half, _mm512_loadu_ps(odd + m))
+                                 : _mm512_setzero_ps();
+        for (unsigned int i = 0; i < ntaps / 2; i++) {
+            __m512 s = _mm512_add_ps(_mm512_loadu_ps(even + m + i),
+                                     _mm512_loadu_ps(even + m + ntaps - 1 - i));
+            acc = _mm512_fmadd_ps(_mm512_set1_ps(taps[i]), s, acc);
+        }
+        _mm512_storeu_ps(out + m, acc);
+    }
+    halfband_scalar(even + m, odd != NULL ? odd + m : NULL, taps, ntaps,
+                    out + m, n - m);
+}
+
+__attribute__((target("avx2"))) static void
+iq_split_avx2(const uint16_t *in, size_t count, int derand, float *i_out,
+              float *q_out) {
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i mask = _mm256_set1_epi16((short)0xfffe);
+    // Each vector holds 8 sample pairs starting at an even pair index
+    const __m256 sign_i = _mm256_setr_ps(0.0f, -0.0f, 0.0f, -0.0f, 0.0f,
+                                         -0.0f, 0.0f, -0.0f);
+    const __m256 sign_q = _mm256_setr_ps(-0.0f, 0.0f, -0.0f, 0.0f, -0.0f,
+                                         0.0f, -0.0f, 0.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (derand) {
+            __m256i lsb = _mm256_cmpeq_epi16(_mm256_and_si256(v, one), one);
+            v = _mm256_xor_si256(v, _mm256_and_si256(lsb, mask));
+        }
+        // Sign-extend the low (even) and high (odd) halves of each pair
+        __m256i ev = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+        __m256i od = _mm256_srai_epi32(v, 16);
+        _mm256_storeu_ps(i_out + i / 2,
+                         _mm256_xor_ps(_mm256_cvtepi32_ps(ev), sign_i));
+        _mm256_storeu_ps(q_out + i / 2,
+                         _mm256_xor_ps(_mm256_cvtepi32_ps(od), sign_q));
+    }
+    iq_split_scalar(in + i, count - i, derand, i_out + i / 2, q_out + i / 2);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+iq_split_avx512(const uint16_t *in, size_t count, int derand, float *i_out,
+                float *q_out) {
+    const __m512i one = _mm512_set1_epi16(1);
+    const __m512i flip = _mm512_set1_epi16((short)0xfffe);
+    // Sign bit in odd lanes for I, in even lanes for Q
+    const __m512i sign_i = _mm512_set1_epi64(0x8000000000000000LL);
+    const __m512i sign_q = _mm512_set1_epi64(0x0000000080000000LL);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        if (derand) {
+            __mmask32 lsb = _mm512_test_epi16_mask(v, one);
+            v = _mm512_mask_mov_epi16(v, lsb, _mm512_xor_si512(v, flip));
+        }
+        __m512i ev = _mm512_srai_epi32(_mm512_slli_epi32(v, 16), 16);
+        __m512i od = _mm512_srai_epi32(v, 16);
+        __m512i fe = _mm512_castps_si512(_mm512_cvtepi32_ps(ev));
+        __m512i fo = _mm512_castps_si512(_mm512_cvtepi32_ps(od));
+        _mm512_storeu_si512(i_out + i / 2, _mm512_xor_si512(fe, sign_i));
+        _mm512_storeu_si512(q_out + i / 2, _mm512_xor_si512(fo, sign_q));
+    }
+    iq_split_scalar(in + i, count - i, derand, i_out + i / 2, q_out + i / 2);
+}
+
+
+__attribute__((target("avx2"))) static inline __m256i derand_avx2_v(__m256i v) {
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i mask = _mm256_set1_epi16((short)0xfffe);
+    __m256i lsb = _mm256_cmpeq_epi16(_mm256_and_si256(v, one), one);
+
+    return _mm256_xor_si256(v, _mm256_and_si256(lsb, mask));
+}
+
+__attribute__((target("avx2"))) static void
+pack12_avx2(const uint16_t *in, size_t count, int derand, uint8_t *out) {
+    const __m256i lo12 = _mm256_set1_epi32(0x0fff);
+    // Drop the top byte of each 32-bit lane holding a packed pair
+    const __m256i squeeze = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+
+    // Each half is stored as 16 bytes of which 12 are kept, so stay 8
+    // samples short of the end to have room for the other 4. In place the
+    // stores never reach input that has not been loaded yet.
+    for (; i + 24 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (derand)
+            v = derand_avx2_v(v);
+        v = _mm256_srai_epi16(v, 4);
+        // 32-bit lanes of b[11:0] a[11:0]
+        __m256i x = _mm256_or_si256(
+            _mm256_and_si256(v, lo12),
+            _mm256_slli_epi32(_mm256_srli_epi32(v, 16), 12));
+        x = _mm256_shuffle_epi8(x, squeeze);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i *)(out + 12), _mm256_extracti128_si256(x, 1));
+        out += 24;
+    }
+    pack12_scalar(in + i, count - i, derand, out);
+}
+
+__attribute__((target("avx2"))) static void
+to_s8_avx2(const uint16_t *in, size_t count, int derand, unsigned int shift,
+           int8_t *out) {
+    const __m128i sh = _mm_cvtsi32_si128((int)shift);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 16));
+        if (derand) {
+            a = derand_avx2_v(a);
+            b = derand_avx2_v(b);
+        }
+        a = _mm256_sra_epi16(a, sh);
+        b = _mm256_sra_epi16(b, sh);
+        // packs works per 128-bit lane; put the quarters back in order
+        __m256i r = _mm256_packs_epi16(a, b);
+        r = _mm256_permute4x64_epi64(r, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(out + i), r);
+    }
+    to_s8_scalar(in + i, count - i, derand, shift, out + i);
+}
+
+__attribute__((target("avx2"))) static void
+to_f32_avx2(const uint16_t *in, size_t count, int derand, float *out) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (derand)
+            v = derand_avx2_v(v);
+        __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(lo));
+        _mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(hi));
+    }
+    to_f32_scalar(in + i, count - i, derand, out + i);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+power_avx2(const uint16_t *in, size_t count, int derand) {
+    const __m256i lo32 = _mm256_set1_epi64x(0xffffffff);
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t sum[4];
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        if (derand)
+            v = derand_avx2_v(v);
+        // Pairs of squares reach 2^31, which only fits read as unsigned
+        __m256i sq = _mm256_madd_epi16(v, v);
+        acc = _mm256_add_epi64(acc, _mm256_and_si256(sq, lo32));
+        acc = _mm256_add_epi64(acc, _mm256_srli_epi64(sq, 32));
+    }
+    _mm256_storeu_si256((__m256i *)sum, acc);
+    return sum[0] + sum[1] + sum[2] + sum[3] +
+           power_scalar(in + i, count - i, derand);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+derand_avx512_v(__m512i v) {
+    const __m512i one = _mm512_set1_epi16(1);
+    const __m512i flip = _mm512_set1_epi16((short)0xfffe);
+    __mmask32 lsb = _mm512_test_epi16_mask(v, one);
+
+    return _mm512_mask_mov_epi16(v, lsb, _mm512_xor_si512(v, flip));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+to_s8_avx512(const uint16_t *in, size_t count, int derand, unsigned int shift,
+             int8_t *out) {
+    const __m128i sh = _mm_cvtsi32_si128((int)shift);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        if (derand)
+            v = derand_avx512_v(v);
+        v = _mm512_sra_epi16(v, sh);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtsepi16_epi8(v));
+    }
+    to_s8_scalar(in + i, count - i, derand, shift, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+to_f32_avx512(const uint16_t *in, size_t count, int derand, float *out) {
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        if (derand)
+            v = derand_avx512_v(v);
+        __m512i lo = _mm512_cvtepi16_epi32(_mm512_castsi512_si256(v));
+        __m512i hi = _mm512_cvtepi16_epi32(_mm512_extracti64x4_epi64(v, 1));
+        _mm512_storeu_ps(out + i, _mm512_cvtepi32_ps(lo));
+        _mm512_storeu_ps(out + i + 16, _mm512_cvtepi32_ps(hi));
+    }
+    to_f32_scalar(in + i, count - i, derand, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static uint64_t
+power_avx512(const uint16_t *in, size_t count, int derand) {
+    const __m512i lo32 = _mm512_set1_epi64(0xffffffff);
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        if (derand)
+            v = derand_avx512_v(v);
+        __m512i sq = _mm512_madd_epi16(v, v);
+        acc = _mm512_add_epi64(acc, _mm512_and_si512(sq, lo32));
+        acc = _mm512_add_epi64(acc, _mm512_srli_epi64(sq, 32));
+    }
+    return (uint64_t)_mm512_reduce_add_epi64(acc) +
+           power_scalar(in + i, count - i, derand);
+}
+
+#endif
+
+#ifdef CONVERT_NEON
+
+static void derand_neon(uint16_t *samples, size_t count) {
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t mask = vdupq_n_u16(0xfffe);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        uint16x8_t a = vld1q_u16(samples + i);
+        uint16x8_t b = vld1q_u16(samples + i + 8);
+        // vtstq sets a lane to all ones when (x & 1) != 0
+        a = veorq_u16(a, vandq_u16(vtstq_u16(a, one), mask));
+        b = veorq_u16(b, vandq_u16(vtstq_u16(b, one), mask));
+        vst1q_u16(samples + i, a);
+        vst1q_u16(samples + i + 8, b);
+    }
+    derand_scalar(samples + i, count - i);
+}
+
+static inline float32x4_t neon_fma(float32x4_t acc, float32x4_t a,
+                                   float32x4_t b) {
+#ifdef __aarch64__
+    return vfmaq_f32(acc, a, b);
+#else
+    return vmlaq_f32(acc, a, b);
+#endif
+}
+
+static void halfband_neon(const float *even, const float *odd,
+                          const float *taps, unsigned int ntaps, float *out,
+                          size_t n) {
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    size_t m = 0;
+
+    for (; m + 8 <= n; m += 8) {
+        float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+        if (odd != NULL) {
+            acc0 = vmulq_f32(half, vld1q_f32(odd + m));
+            acc1 = vmulq_f32(half, vld1q_f32(odd + m + 4));
+        }
+        for (unsigned int i = 0; i < ntaps / 2; i++) {
+            const float *lo = even + m + i;
+            const float *hi = even + m + ntaps - 1 - i;
+            float32x4_t t = vdupq_n_f32(taps[i]);
+            acc0 = neon_fma(acc0, t, vaddq_f32(vld1q_f32(lo), vld1q_f32(hi)));
+            acc1 = neon_fma(acc1, t,
+                            vaddq_f32(vld1q_f32(lo + 4), vld1q_f32(hi + 4)));
+        }
+        vst1q_f32(out + m, acc0);
+        vst1q_f32(out + m + 4, acc1);
+    }
+    halfband_scalar(even + m, odd != NULL ? odd + m : NULL, taps, ntaps,
+                    out + m, n - m);
+}
+
+static void iq_split_neon(const uint16_t *in, size_t count, int derand,
+                          float *i_out, float *q_out) {
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t mask = vdupq_n_u16(0xfffe);
+    // Each 8-pair block starts at an even pair index
+    static const float si[4] = {1.0f, -1.0f, 1.0f, -1.0f};
+    const float32x4_t sign_i = vld1q_f32(si);
+    const float32x4_t sign_q = vnegq_f32(sign_i);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        // vld2 deinterleaves into even (I) and odd (Q) samples
+        uint16x8x2_t v = vld2q_u16(in + i);
+        if (derand) {
+            v.val[0] = veorq_u16(v.val[0], vandq_u16(vtstq_u16(v.val[0], one), mask));
+            v.val[1] = veorq_u16(v.val[1], vandq_u16(vtstq_u16(v.val[1], one), mask));
+        }
+        int16x8_t e = vreinterpretq_s16_u16(v.val[0]);
+        int16x8_t o = vreinterpretq_s16_u16(v.val[1]);
+        float *ip = i_out + i / 2, *qp = q_out + i / 2;
+        vst1q_f32(ip, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(e))), sign_i));
+        vst1q_f32(ip + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(e))), sign_i));
+        vst1q_f32(qp, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(o))), sign_q));
+        vst1q_f32(qp + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(o))), sign_q));
+    }
+    iq_split_scalar(in + i, count - i, derand, i_out + i / 2, q_out + i / 2);
+}
+
+
+static inline uint16x8_t derand_neon_v(uint16x8_t v) {
+    return veorq_u16(v, vandq_u16(vtstq_u16(v, vdupq_n_u16(1)),
+                                  vdupq_n_u16(0xfffe)));
+}
+
+static void pack12_neon(const uint16_t *in, size_t count, int derand,
+                        uint8_t *out) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        uint16x8x2_t v = vld2q_u16(in + i);
+        if (derand) {
+            v.val[0] = derand_neon_v(v.val[0]);
+            v.val[1] = derand_neon_v(v.val[1]);
+        }
+        uint16x8_t a = vreinterpretq_u16_s16(
+            vshrq_n_s16(vreinterpretq_s16_u16(v.val[0]), 4));
+        uint16x8_t b = vreinterpretq_u16_s16(
+            vshrq_n_s16(vreinterpretq_s16_u16(v.val[1]), 4));
+        // vst3 interleaves the three bytes of each pair
+        uint8x8x3_t o;
+        o.val[0] = vmovn_u16(a);
+        o.val[1] = vmovn_u16(vorrq_u16(vandq_u16(vshrq_n_u16(a, 8),
+                                                 vdupq_n_u16(0x0f)),
+                                       vshlq_n_u16(b, 4)));
+        o.val[2] = vmovn_u16(vshrq_n_u16(b, 4));
+        vst3_u8(out, o);
+        out += 24;
+    }
+    pack12_scalar(in + i, count - i, derand, out);
+}
+
+static void to_s8_neon(const uint16_t *in, size_t count, int derand,
+                       unsigned int shift, int8_t *out) {
+    // vshl by a negative count is an arithmetic right shift
+    const int16x8_t sh = vdupq_n_s16(-(int16_t)shift);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        uint16x8_t a = vld1q_u16(in + i);
+        uint16x8_t b = vld1q_u16(in + i + 8);
+        if (derand) {
+            a = derand_neon_v(a);
+            b = derand_neon_v(b);
+        }
+        int16x8_t sa = vshlq_s16(vreinterpretq_s16_u16(a), sh);
+        int16x8_t sb = vshlq_s16(vreinterpretq_s16_u16(b), sh);
+        vst1q_s8(out + i, vcombine_s8(vqmovn_s16(sa), vqmovn_s16(sb)));
+    }
+    to_s8_scalar(in + i, count - i, derand, shift, out + i);
+}
+
+static void to_f32_neon(const uint16_t *in, size_t count, int derand,
+                        float *out) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t v = vld1q_u16(in + i);
+        if (derand)
+            v = derand_neon_v(v);
+        int16x8_t s = vreinterpretq_s16_u16(v);
+        vst1q_f32(out + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))));
+        vst1q_f32(out + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))));
+    }
+    to_f32_scalar(in + i, count - i, derand, out + i);
+}
+
+static uint64_t power_neon(const uint16_t *in, size_t count, int derand) {
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t v = vld1q_u16(in + i);
+        if (derand)
+            v = derand_neon_v(v);
+        int16x8_t s = vreinterpretq_s16_u16(v);
+        int32x4_t lo = vmull_s16(vget_low_s16(s), vget_low_s16(s));
+        int32x4_t hi = vmull_s16(vget_high_s16(s), vget_high_s16(s));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(lo));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(hi));
+    }
+    return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) +
+           power_scalar(in + i, count - i, derand);
+}
+
+#endif
+
+const struct convert_impl convert_impls[] = {
+    {"scalar", always_supported, derand_scalar, halfband_scalar,
+     iq_split_scalar, pack12_scalar, to_s8_scalar, to_f32_scalar,
+     power_scalar},
+#ifdef CONVERT_X86
+    {"avx2", avx2_supported, derand_avx2, halfband_avx2, iq_split_avx2,
+     pack12_avx2, to_s8_avx2, to_f32_avx2, power_avx2},
+    {"avx512", avx512_supported, derand_avx512, halfband_avx512,
+     iq_split_avx512, pack12_avx2, to_s8_avx512, to_f32_avx512,
+     power_avx512},
+#endif
+#ifdef CONVERT_NEON
+    {"neon", always_supported, derand_neon, halfband_neon, iq_split_neon,
+     pack12_neon, to_s8_neon, to_f32_neon, power_neon},
+#endif
+    {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+};
+
+const struct convert_impl *convert_select(const char *name) {
+    const struct convert_impl *best = &convert_impls[0];
+
+    for (const struct convert_impl *impl = convert_impls; impl->name; impl++) {
+        if (!impl->supported())
+            continue;
+        if (name != NULL && strcmp(name, impl->name) == 0)
+            return impl;
+        // Entries are listed slowest to fastest
+        best = impl;
+    }
+    return name == NULL ? best : NULL;
+}
+
+// Float kernels may sum in a different order or fuse multiply-adds, so
+// they are compared against scalar with a tolerance relative to the
+// magnitude of the inputs.
+static int check_halfband(const struct convert_impl *impl) {
+    static const unsigned int ntaps[] = {2, 8, 32};
+    static const size_t lengths[] = {0, 1, 7, 8, 15, 16, 17, 33, 1001};
+    const size_t maxlen = 1001 + 32 + 1;
+    float *even = malloc(maxlen * sizeof(float));
+    float *odd = malloc(maxlen * sizeof(float));
+    float *expect = malloc(maxlen * sizeof(float));
+    float *got = malloc(maxlen * sizeof(float));
+    float taps[32];
+    int ok = 1;
+
+    if (even == NULL || odd == NULL || expect == NULL || got == NULL) {
+        ok = 0;
+        goto out;
+    }
+    for (size_t i = 0; i < maxlen; i++) {
+        even[i] = (float)(rand() % 65536 - 32768);
+        odd[i] = (float)(rand() % 65536 - 32768);
+    }
+    for (size_t t = 0; t < sizeof(ntaps) / sizeof(ntaps[0]); t++) {
+        unsigned int nt = ntaps[t];
+
+        for (unsigned int i = 0; i < nt / 2; i++) {
+            taps[i] = (float)rand() / RAND_MAX - 0.5f;
+            taps[nt - 1 - i] = taps[i];
+        }
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            size_t n = lengths[l];
+
+            // Offset by one to make the loads unaligned, and cover the
+            // plain FIR form too
+            for (int fir = 0; fir < 2; fir++) {
+                const float *o = fir ? NULL : odd + 1;
+                halfband_scalar(even + 1, o, taps, nt, expect, n);
+                impl->halfband(even + 1, o, taps, nt, got, n);
+                for (size_t i = 0; i < n; i++) {
+                    if (fabsf(got[i] - expect[i]) > 1e-5f * 32768.0f * nt)
+                        ok = 0;
+                }
+            }
+        }
+    }
+
+out:
+    free(even);
+    free(odd);
+    free(expect);
+    free(got);
+    return ok;
+}
+
+// Conversions and sign flips are exact, so these must match exactly.
+static int check_iq_split(const struct convert_impl *impl,
+                          const uint16_t *input) {
+    static const size_t lengths[] = {0, 4, 12, 16, 20, 32, 36, 64, 4096};
+    float *expect = malloc(2 * 4096 * sizeof(float));
+    float *got = malloc(2 * 4096 * sizeof(float));
+    int ok = 1;
+
+    if (expect == NULL || got == NULL) {
+        ok = 0;
+        goto out;
+    }
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t n = lengths[l];
+
+        for (int derand = 0; derand < 2; derand++) {
+            iq_split_scalar(input + 1, n, derand, expect, expect + n / 2);
+            impl->iq_split(input + 1, n, derand, got, got + n / 2);
+            for (size_t i = 0; i < n; i++) {
+                if (got[i] != expect[i])
+                    ok = 0;
+            }
+        }
+    }
+
+out:
+    free(expect);
+    free(got);
+    return ok;
+}
+
+// Integer outputs must match exactly, and so must the float conversion.
+// The packers are also run in place, as the pipeline does.
+static int check_formats(const struct convert_impl *impl,
+                         const uint16_t *input) {
+    static const size_t lengths[] = {0, 1, 2, 7, 15, 16, 17, 24, 25, 31,
+                                     33, 40, 63, 65, 4099};
+    static const unsigned int shifts[] = {0, 4, 8, 15};
+    const size_t maxbytes = 4 * 4099;
+    unsigned char *expect = malloc(maxbytes);
+    unsigned char *got = malloc(maxbytes + sizeof(float));
+    int ok = 1;
+
+    if (expect == NULL || got == NULL) {
+        ok = 0;
+        goto out;
+    }
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t n = lengths[l];
+
+        for (int derand = 0; derand < 2; derand++) {
+            const uint16_t *in = input + 1;
+            size_t bytes = (3 * n + 1) / 2;
+
+            pack12_scalar(in, n, derand, expect);
+            impl->pack12(in, n, derand, got);
+            if (memcmp(expect, got, bytes) != 0)
+                ok = 0;
+            memcpy(got, in, n * sizeof(uint16_t));
+            impl->pack12((const uint16_t *)got, n, derand, got);
+            if (memcmp(expect, got, bytes) != 0)
+                ok = 0;
+
+            for (size_t s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+                to_s8_scalar(in, n, derand, shifts[s], (int8_t *)expect);
+                memcpy(got, in, n * sizeof(uint16_t));
+                impl->to_s8((const uint16_t *)got, n, derand, shifts[s],
+                            (int8_t *)got);
+                if (memcmp(expect, got, n) != 0)
+                    ok = 0;
+            }
+
+            // Off the vector alignment as well
+            to_f32_scalar(in, n, derand, (float *)expect);
+            impl->to_f32(in, n, derand, (float *)got + 1);
+            if (memcmp(expect, (float *)got + 1, n * sizeof(float)) != 0)
+                ok = 0;
+
+            if (impl->power(in, n, derand) != power_scalar(in, n, derand))
+                ok = 0;
+        }
+    }
+
+out:
+    free(expect);
+    free(got);
+    return ok;
+}
+
+int convert_selftest(void) {
+    // Odd sizes and offsets exercise both the vector body and the tail
+    static const size_t lengths[] = {0, 1, 7, 15, 16, 17, 31, 33, 63, 65, 4099};
+    const size_t maxlen = 4099 + 1;
+    uint16_t *input = malloc(maxlen * sizeof(uint16_t));
+    uint16_t *expect = malloc(maxlen * sizeof(uint16_t));
+    uint16_t *got = malloc((maxlen + 1) * sizeof(uint16_t));
+    int failed = 0;
+
+    if (input == NULL || expect == NULL || got == NULL) {
+        fprintf(stderr, "selftest: out of memory\n");
+        free(input);
+        free(expect);
+        free(got);
+        return -1;
+    }
+
+    srand(0x2208);
+    for (size_t i = 0; i < maxlen; i++)
+        input[i] = (uint16_t)rand();
+    // Make sure both extremes and both parities are covered
+    input[0] = 0x0000;
+    input[1] = 0xffff;
+    input[2] = 0x0001;
+    input[3] = 0xfffe;
+    // and the largest squares, whose pair sums overflow int32
+    for (size_t i = 4; i < 8; i++)
+        input[i] = 0x8000;
+
+    for (const struct convert_impl *impl = convert_impls; impl->name; impl++) {
+        int ok = 1;
+
+        if (!impl->supported()) {
+            fprintf(stderr, "selftest: %-8s not supported, skipped\n",
+                    impl->name);
+            continue;
+        }
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            for (size_t offset = 0; offset < 2; offset++) {
+                size_t n = lengths[l];
+
+                memcpy(expect, input, n * sizeof(uint16_t));
+                derand_scalar(expect, n);
+                memcpy(got + offset, input, n * sizeof(uint16_t));
+                impl->derand(got + offset, n);
+                if (memcmp(expect, got + offset, n * sizeof(uint16_t)) != 0)
+                    ok = 0;
+            }
+        }
+        if (!check_halfband(impl) || !check_iq_split(impl, input) ||
+            !check_formats(impl, input))
+            ok = 0;
+        fprintf(stderr, "selftest: %-8s %s\n", impl->name, ok ? "ok" : "MISMATCH");
+        failed += !ok;
+    }
+
+    free(input);
+    free(expect);
+    free(got);
+    return failed;
+}
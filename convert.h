@@ -0,0 +1,76 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample conversion and DSP kernels.
+ *
+ * Each kernel has a scalar reference implementation and explicitly
+ * vectorized variants selected at runtime from what the CPU supports, so
+ * the binary does not need to be built with -march=native.
+ */
+
+// Undo the LTC2208 output randomizer in place: when bit 0 of a sample is
+// set, bits 1..15 have been XORed with it.
+typedef void (*derand_fn)(uint16_t *samples, size_t count);
+
+// Polyphase half-band decimate-by-2, computing n outputs:
+//   out[m] = sum(taps[i] * even[m + i], i < ntaps) + 0.5 * odd[m]
+// where even/odd are the even and odd input phases and taps is symmetric
+// with ntaps even. With odd == NULL this is a plain symmetric FIR.
+typedef void (*halfband_fn)(const float *even, const float *odd,
+                            const float *taps, unsigned int ntaps, float *out,
+                            size_t n);
+
+// Front half of real-to-complex conversion, in one pass: optionally undo
+// the randomizer, mix by fs/4 (multiplying by 1, -j, -1, j is just sign
+// flips) and split into the I samples (even inputs) and Q samples (odd
+// inputs) as float. count is a multiple of 4; count / 2 samples are
+// written to each of i_out and q_out.
+typedef void (*iq_split_fn)(const uint16_t *in, size_t count, int derand,
+                            float *i_out, float *q_out);
+
+// Conversions of raw samples to the compact output formats, each
+// optionally undoing the randomizer in the same pass. See format.h for the
+// layouts. out may be the same buffer as in for pack12 and to_s8, whose
+// output is never longer than their input.
+typedef void (*pack12_fn)(const uint16_t *in, size_t count, int derand,
+                          uint8_t *out);
+typedef void (*to_s8_fn)(const uint16_t *in, size_t count, int derand,
+                         unsigned int shift, int8_t *out);
+typedef void (*to_f32_fn)(const uint16_t *in, size_t count, int derand,
+                          float *out);
+
+// Sum of the squared samples, after undoing the randomizer if derand is
+// set (without modifying in). count must stay below 2^33 so that the sum
+// fits; transfers are far smaller.
+typedef uint64_t (*power_fn)(const uint16_t *in, size_t count, int derand);
+
+struct convert_impl {
+    const char *name;
+    int (*supported)(void);
+    derand_fn derand;
+    halfband_fn halfband;
+    iq_split_fn iq_split;
+    pack12_fn pack12;
+    to_s8_fn to_s8;
+    to_f32_fn to_f32;
+    power_fn power;
+};
+
+// All variants compiled in, scalar first, terminated by a zeroed entry.
+extern const struct convert_impl convert_impls[];
+
+// Returns the named variant if it is supported (NULL otherwise), or the
+// fastest supported variant when name is NULL.
+const struct convert_impl *convert_select(const char *name);
+
+// Runs every supported variant against the scalar one on random data,
+// including odd lengths and unaligned buffers. Integer kernels must match
+// bit for bit, float kernels to within rounding. Returns the number of
+// mismatching variants and reports each one on stderr.
+int convert_selftest(void);
+
+#endif
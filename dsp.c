@@ -0,0 +1,343 @@
+#include "dsp.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Taps of the even phase; the full prototype has 2 * ntaps - 1 taps
+#define HALFBAND_TAPS_FIRST 16
+#define HALFBAND_TAPS_LAST 32
+// Kaiser window beta, about 90 dB of alias rejection
+#define HALFBAND_BETA 8.0
+
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < 1e-12 * sum)
+            break;
+    }
+    return sum;
+}
+
+// Kaiser-windowed sinc half-band. Only the odd taps of the prototype
+// (relative to the centre) are non-zero, and those form the even phase.
+static void halfband_design(float *taps, unsigned int ntaps, double beta) {
+    double sum = 0.0;
+    double half = ntaps; // window half-length, just past the outermost tap
+
+    for (unsigned int i = 0; i < ntaps; i++) {
+        double k = 2.0 * i - (ntaps - 1.0);
+        double r = k / half;
+        double w = bessel_i0(beta * sqrt(1.0 - r * r)) / bessel_i0(beta);
+        double h = sin(M_PI * k / 2.0) / (M_PI * k) * w;
+        taps[i] = (float)h;
+        sum += h;
+    }
+    // Unity gain at DC: the centre tap contributes the other 0.5
+    for (unsigned int i = 0; i < ntaps; i++)
+        taps[i] = (float)(taps[i] * 0.5 / sum);
+}
+
+void dsp_lowpass_design(float *taps, unsigned int n, double cutoff,
+                        double beta) {
+    double centre = (n - 1) / 2.0;
+    double half = n / 2.0;
+    double sum = 0.0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        double k = i - centre;
+        double r = k / half;
+        double w = bessel_i0(beta * sqrt(1.0 - r * r)) / bessel_i0(beta);
+        double h = k == 0.0 ? 2.0 * cutoff
+                            : sin(2.0 * M_PI * cutoff * k) / (M_PI * k);
+        taps[i] = (float)(h * w);
+        sum += h * w;
+    }
+    for (unsigned int i = 0; i < n; i++)
+        taps[i] = (float)(taps[i] / sum);
+}
+
+int decimator_init(struct decimator *d, unsigned int factor, size_t max_in,
+                   const struct convert_impl *kernels, struct arena *arena) {
+    memset(d, 0, sizeof(*d));
+    if (factor < 1 || factor > DECIMATE_MAX || (factor & (factor - 1)) != 0)
+        return -1;
+
+    d->factor = factor;
+    d->max_in = max_in;
+    d->kernels = kernels;
+    d->arena = arena;
+    while ((1U << d->nstages) < factor)
+        d->nstages++;
+
+    for (unsigned int s = 0; s < d->nstages; s++) {
+        struct halfband_stage *st = &d->stage[s];
+        bool last = s + 1 == d->nstages;
+        size_t cap = (max_in >> (s + 1)) + 2;
+
+        st->ntaps = last ? HALFBAND_TAPS_LAST : HALFBAND_TAPS_FIRST;
+        st->taps = malloc(st->ntaps * sizeof(float));
+        st->even = arena_alloc(arena, (st->ntaps - 1 + cap) * sizeof(float));
+        st->odd = arena_alloc(arena, (st->ntaps / 2 + cap) * sizeof(float));
+        if (st->taps == NULL || st->even == NULL || st->odd == NULL) {
+            decimator_free(d);
+            return -1;
+        }
+        halfband_design(st->taps, st->ntaps, HALFBAND_BETA);
+    }
+    return 0;
+}
+
+void decimator_free(struct decimator *d) {
+    for (unsigned int s = 0; s < d->nstages; s++) {
+        free(d->stage[s].taps);
+        arena_free(d->arena, d->stage[s].even);
+        arena_free(d->arena, d->stage[s].odd);
+    }
+    memset(d, 0, sizeof(*d));
+}
+
+// Filters the phases loaded into st into out, then keeps the tail as
+// history for the next block.
+static size_t stage_filter(struct halfband_stage *st, halfband_fn kernel,
+                           float *out) {
+    size_t he = st->ntaps - 1, ho = st->ntaps / 2;
+    size_t n = st->count;
+
+    kernel(st->even, st->odd, st->taps, st->ntaps, out, n);
+    memmove(st->even, st->even + n, he * sizeof(float));
+    memmove(st->odd, st->odd + n, ho * sizeof(float));
+    st->count = 0;
+    return n;
+}
+
+// Splits input into even/odd phases after the history. The input is fully
+// consumed before filtering, so a stage may write its output over it.
+static void stage_load_s16(struct halfband_stage *st, const int16_t *in,
+                           size_t n) {
+    float *even = st->even + st->ntaps - 1;
+    float *odd = st->odd + st->ntaps / 2;
+    size_t i = 0, p = 0;
+
+    if (st->has_carry && n > 0) {
+        even[p] = st->carry;
+        odd[p++] = in[i++];
+        st->has_carry = 0;
+    }
+    for (; i + 1 < n; i += 2, p++) {
+        even[p] = in[i];
+        odd[p] = in[i + 1];
+    }
+    if (i < n) {
+        st->carry = in[i];
+        st->has_carry = 1;
+    }
+    st->count = p;
+}
+
+static void stage_load_f32(struct halfband_stage *st, const float *in,
+                           size_t n) {
+    float *even = st->even + st->ntaps - 1;
+    float *odd = st->odd + st->ntaps / 2;
+    size_t i = 0, p = 0;
+
+    if (st->has_carry && n > 0) {
+        even[p] = st->carry;
+        odd[p++] = in[i++];
+        st->has_carry = 0;
+    }
+    for (; i + 1 < n; i += 2, p++) {
+        even[p] = in[i];
+        odd[p] = in[i + 1];
+    }
+    if (i < n) {
+        st->carry = in[i];
+        st->has_carry = 1;
+    }
+    st->count = p;
+}
+
+size_t decimator_process_f32(struct decimator *d, const float *in, size_t n,
+                             float *out) {
+    size_t count = n;
+
+    if (d->nstages == 0) {
+        memmove(out, in, n * sizeof(float));
+        return n;
+    }
+
+    for (unsigned int s = 0; s < d->nstages; s++) {
+        stage_load_f32(&d->stage[s], s == 0 ? in : out, count);
+        count = stage_filter(&d->stage[s], d->kernels->halfband, out);
+    }
+    return count;
+}
+
+size_t decimator_process(struct decimator *d, const int16_t *in, size_t n,
+                         float *out) {
+    size_t count;
+
+    if (d->nstages == 0) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = in[i];
+        return n;
+    }
+
+    stage_load_s16(&d->stage[0], in, n);
+    count = stage_filter(&d->stage[0], d->kernels->halfband, out);
+    for (unsigned int s = 1; s < d->nstages; s++) {
+        stage_load_f32(&d->stage[s], out, count);
+        count = stage_filter(&d->stage[s], d->kernels->halfband, out);
+    }
+    return count;
+}
+
+int iq_init(struct iq_converter *c, size_t max_in,
+            const struct convert_impl *kernels, struct arena *arena) {
+    size_t cap = max_in / 2 + 2;
+
+    memset(c, 0, sizeof(*c));
+    c->ntaps = HALFBAND_TAPS_LAST;
+    c->kernels = kernels;
+    c->arena = arena;
+    c->taps = malloc(c->ntaps * sizeof(float));
+    c->ibuf = arena_alloc(arena, (c->ntaps - 1 + cap) * sizeof(float));
+    c->qbuf = arena_alloc(arena, (c->ntaps - 1 + cap) * sizeof(float));
+    if (c->taps == NULL || c->ibuf == NULL || c->qbuf == NULL) {
+        iq_free(c);
+        return -1;
+    }
+    halfband_design(c->taps, c->ntaps, HALFBAND_BETA);
+    // The mix splits the power between the two sidebands and the I branch
+    // is passed through at unity, so Q needs twice the half-band gain.
+    for (unsigned int i = 0; i < c->ntaps; i++)
+        c->taps[i] *= 2.0f;
+    return 0;
+}
+
+void iq_free(struct iq_converter *c) {
+    free(c->taps);
+    arena_free(c->arena, c->ibuf);
+    arena_free(c->arena, c->qbuf);
+    memset(c, 0, sizeof(*c));
+}
+
+size_t iq_process(struct iq_converter *c, const uint16_t *in, size_t n,
+                  int derand, float *i_out, float *q_out) {
+    size_t hist = c->ntaps - 1;
+    size_t count = 0, take = 0, whole;
+
+    // A period left over from the last call is completed first
+    if (c->ncarry > 0) {
+        uint16_t period[4];
+
+        take = 4 - c->ncarry < n ? 4 - c->ncarry : n;
+        memcpy(period, c->carry, c->ncarry * sizeof(*in));
+        memcpy(period + c->ncarry, in, take * sizeof(*in));
+        if (c->ncarry + take < 4) {
+            memcpy(c->carry, period, (c->ncarry + take) * sizeof(*in));
+            c->ncarry += take;
+            return 0;
+        }
+        c->kernels->iq_split(period, 4, derand, c->ibuf + hist,
+                             c->qbuf + hist);
+        count = 2;
+    }
+    whole = (n - take) & ~(size_t)3;
+    c->kernels->iq_split(in + take, whole, derand, c->ibuf + hist + count,
+                         c->qbuf + hist + count);
+    count += whole / 2;
+    c->ncarry = n - take - whole;
+    memcpy(c->carry, in + take + whole, c->ncarry * sizeof(*in));
+
+    c->kernels->halfband(c->qbuf, NULL, c->taps, c->ntaps, q_out, count);
+    // The FIR centre lies between Q samples m + ntaps/2 - 1 and m + ntaps/2,
+    // which is where I sample m + ntaps/2 sits
+    memcpy(i_out, c->ibuf + c->ntaps / 2, count * sizeof(float));
+    memmove(c->ibuf, c->ibuf + count, hist * sizeof(float));
+    memmove(c->qbuf, c->qbuf + count, hist * sizeof(float));
+    return count;
+}
+
+void dsp_f32_to_s16(const float *in, int16_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float v = in[i];
+        if (v > 32767.0f)
+            v = 32767.0f;
+        else if (v < -32768.0f)
+            v = -32768.0f;
+        out[i] = (int16_t)lrintf(v);
+    }
+}
+
+int dsp_selftest(void) {
+    // Odd pieces, as a gap filled with an odd number of samples leaves
+    static const size_t pieces[] = {1, 2, 5, 3, 4097, 6, 7, 1023, 4};
+    const size_t len = 16384;
+    uint16_t *input = malloc(len * sizeof(uint16_t));
+    float *expect = malloc(2 * (len / 2 + 2) * sizeof(float));
+    float *got = malloc(2 * (len / 2 + 2) * sizeof(float));
+    int failed = 0;
+
+    if (input == NULL || expect == NULL || got == NULL) {
+        fprintf(stderr, "selftest: out of memory\n");
+        free(input);
+        free(expect);
+        free(got);
+        return -1;
+    }
+    srand(0x2208);
+    for (size_t i = 0; i < len; i++)
+        input[i] = (uint16_t)rand();
+
+    for (const struct convert_impl *impl = convert_impls; impl->name; impl++) {
+        struct iq_converter whole, split;
+        size_t n, m = 0;
+        int ok;
+
+        if (!impl->supported())
+            continue;
+        if (iq_init(&whole, len, impl, NULL) != 0 ||
+            iq_init(&split, len, impl, NULL) != 0) {
+            fprintf(stderr, "selftest: out of memory\n");
+            iq_free(&whole);
+            free(input);
+            free(expect);
+            free(got);
+            return -1;
+        }
+        n = iq_process(&whole, input, len, 1, expect, expect + len / 2 + 2);
+        for (size_t off = 0, p = 0; off < len; p++) {
+            size_t k = pieces[p % (sizeof(pieces) / sizeof(pieces[0]))];
+
+            if (k > len - off)
+                k = len - off;
+            m += iq_process(&split, input + off, k, 1, got + m,
+                            got + len / 2 + 2 + m);
+            off += k;
+        }
+        // The FIR kernels may sum a tail in another order than their
+        // vector body, so allow for rounding, far below a phase error
+        ok = m == n;
+        for (size_t i = 0; ok && i < n; i++) {
+            if (fabsf(expect[i] - got[i]) > 0.5f ||
+                fabsf(expect[len / 2 + 2 + i] - got[len / 2 + 2 + i]) > 0.5f)
+                ok = 0;
+        }
+        fprintf(stderr, "selftest: %-8s iq %s\n", impl->name,
+                ok ? "ok" : "MISMATCH");
+        failed += !ok;
+        iq_free(&whole);
+        iq_free(&split);
+    }
+
+    free(input);
+    free(expect);
+    free(got);
+    return failed;
+}
@@ -0,0 +1,97 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "convert.h"
+
+/*
+ * Integer-ratio decimation by a cascade of polyphase half-band filters.
+ * Every stage halves the rate; the last stage uses the longest filter
+ * since its transition band is the narrowest relative to its input rate.
+ * Processing is in float, with the FIR inner loop in the SIMD kernels.
+ */
+
+#define DECIMATE_MAX 64
+
+struct halfband_stage {
+    unsigned int ntaps; // taps of the even phase, the odd phase is 0.5 * delta
+    float *taps;
+    float *even;  // ntaps - 1 samples of history followed by new samples
+    float *odd;   // ntaps / 2 samples of history followed by new samples
+    size_t count; // new samples in even/odd
+    float carry;  // odd leftover input sample, if has_carry
+    int has_carry;
+};
+
+struct decimator {
+    unsigned int factor; // 1 (bypass) or a power of two up to DECIMATE_MAX
+    unsigned int nstages;
+    struct halfband_stage stage[6];
+    size_t max_in;
+    const struct convert_impl *kernels;
+    struct arena *arena;
+};
+
+// Prepares a decimator for blocks of at most max_in input samples, with
+// its buffers from arena (may be NULL). Returns 0 on success, -1 on a bad
+// factor or allocation failure.
+int decimator_init(struct decimator *d, unsigned int factor, size_t max_in,
+                   const struct convert_impl *kernels, struct arena *arena);
+void decimator_free(struct decimator *d);
+
+// Filters and decimates n <= max_in samples. out must have room for
+// n / 2 + 1 samples since it also holds the intermediate stages. Returns
+// the number of samples written to out, about n / factor.
+size_t decimator_process(struct decimator *d, const int16_t *in, size_t n,
+                         float *out);
+
+// Same for float input, e.g. the I or Q output of an iq_converter. out may
+// be the same buffer as in.
+size_t decimator_process_f32(struct decimator *d, const float *in, size_t n,
+                             float *out);
+
+/*
+ * Real-to-complex conversion: mix by fs/4 and low-pass with a half-band,
+ * producing complex samples at half the input rate. After the mix only the
+ * odd (Q) samples need filtering, since the even taps of a half-band are
+ * zero apart from the centre; I is just the delayed even input.
+ */
+struct iq_converter {
+    unsigned int ntaps;
+    float *taps;
+    float *ibuf; // ntaps - 1 samples of history followed by new samples
+    float *qbuf;
+    uint16_t carry[3]; // raw samples short of a whole mixer period
+    unsigned int ncarry;
+    const struct convert_impl *kernels;
+    struct arena *arena;
+};
+
+int iq_init(struct iq_converter *c, size_t max_in,
+            const struct convert_impl *kernels, struct arena *arena);
+void iq_free(struct iq_converter *c);
+
+// Converts n <= max_in raw samples, undoing the randomizer first if derand
+// is set. Samples beyond a multiple of 4 are kept for the next call, which
+// keeps the mixer phase. Returns the number of complex samples written to
+// i_out and q_out, at most n / 2 + 2.
+size_t iq_process(struct iq_converter *c, const uint16_t *in, size_t n,
+                  int derand, float *i_out, float *q_out);
+
+// Designs a Kaiser-windowed sinc low-pass of n taps with unity DC gain.
+// cutoff is in cycles per sample (0.5 is Nyquist).
+void dsp_lowpass_design(float *taps, unsigned int n, double cutoff,
+                        double beta);
+
+// Converts float samples back to int16 with rounding and saturation.
+void dsp_f32_to_s16(const float *in, int16_t *out, size_t n);
+
+// Checks with every supported kernel set that converting a stream in odd
+// pieces gives what converting it at once does. Returns the number of
+// mismatches, reported on stderr.
+int dsp_selftest(void);
+
+#endif
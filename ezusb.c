@@ -26,6 +26,10 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "libusb.h"
 #include "ezusb.h"
@@ -115,6 +119,15 @@ static bool fx2lp_is_external(uint32_t addr, size_t len)
 #define RW_INTERNAL     0xA0	/* hardware implements this one */
 #define RW_MEMORY       0xA3
 
+/*
+ * The FX3 bootloader takes at most 4 KB per request. Each chunk costs a
+ * control round trip, and reading it back doubled that, so by default only
+ * the image checksum is checked and ezusb_verify turns the read-back on.
+ */
+#define FX3_CHUNK       4096
+
+int ezusb_verify = 0;
+
 /*
  * Issues the specified vendor-specific write request.
  */
@@ -565,145 +578,216 @@ static int ram_poke(void *context, uint32_t addr, bool external,
 	return rc;
 }
 
+static uint32_t fx3_word(const unsigned char *p)
+{
+	uint32_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
 /*
- * Load a Cypress Image file into target RAM.
+ * Parse a Cypress Image held in memory into its section table and check
+ * the checksum, so that uploads only have to send the sections.
  * See http://www.cypress.com/?docID=41351 (AN76405 PDF) for more info.
  */
-static int fx3_load_ram(libusb_device_handle *device, const char *path)
+int fx3_image_parse(struct fx3_image *img, const void *data, size_t size)
 {
-	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLen, dLength;
-	uint32_t* dImageBuf;
-	unsigned char *bBuf, hBuf[4], blBuf[4], rBuf[4096];
-	FILE *image;
-	int ret = 0;
-
-	image = fopen(path, "rb");
-	if (image == NULL) {
-		logerror("unable to open '%s' for input\n", path);
-		return -2;
-	} else if (verbose)
-		logerror("open firmware image %s for RAM upload\n", path);
+	const unsigned char *p = data, *end = p + size;
+	uint32_t dCheckSum = 0, dLength, dAddress, i;
+	struct fx3_section *sections;
 
-	// Read header
-	if (fread(hBuf, sizeof(char), sizeof(hBuf), image) != sizeof(hBuf)) {
-		logerror("could not read image header");
-		ret = -3;
-		goto exit;
-	}
+	img->data = data;
+	img->size = size;
+	img->nsections = 0;
+	img->sections = NULL;
 
 	// check "CY" signature byte and format
-	if ((hBuf[0] != 'C') || (hBuf[1] != 'Y')) {
+	if (size < 4 || (p[0] != 'C') || (p[1] != 'Y')) {
 		logerror("image doesn't have a CYpress signature\n");
-		ret = -3;
-		goto exit;
+		return -3;
 	}
 
 	// Check bImageType
-	switch(hBuf[3]) {
+	switch(p[3]) {
 	case 0xB0:
 		if (verbose)
-			logerror("normal FW binary %s image with checksum\n", (hBuf[2]&0x01)?"data":"executable");
+			logerror("normal FW binary %s image with checksum\n", (p[2]&0x01)?"data":"executable");
 		break;
 	case 0xB1:
 		logerror("security binary image is not currently supported\n");
-		ret = -3;
-		goto exit;
+		return -3;
 	case 0xB2:
 		logerror("VID:PID image is not currently supported\n");
-		ret = -3;
-		goto exit;
+		return -3;
 	default:
-		logerror("invalid image type 0x%02X\n", hBuf[3]);
-		ret = -3;
-		goto exit;
+		logerror("invalid image type 0x%02X\n", p[3]);
+		return -3;
+	}
+	p += 4;
+
+	while (1) {
+		if (end - p < 8) {
+			logerror("could not read image");
+			goto fail;
+		}
+		dLength = fx3_word(p);
+		dAddress = fx3_word(p + 4);
+		p += 8;
+		if (dLength == 0)
+			break; // done
+		if ((size_t)(end - p) / 4 < dLength) {
+			logerror("could not read image");
+			goto fail;
+		}
+
+		sections = realloc(img->sections, (img->nsections + 1) * sizeof(*sections));
+		if (sections == NULL) {
+			logerror("could not allocate section table\n");
+			free(img->sections);
+			img->sections = NULL;
+			return -4;
+		}
+		img->sections = sections;
+		sections[img->nsections].address = dAddress;
+		sections[img->nsections].length = dLength * 4;
+		sections[img->nsections].data = p;
+		img->nsections++;
+
+		for (i = 0; i < dLength; i++)
+			dCheckSum += fx3_word(p + 4 * i);
+		p += 4 * dLength;
+	}
+	img->entry = dAddress;
+
+	// compare with the pre-computed checksum
+	if (end - p < 4 || dCheckSum != fx3_word(p)) {
+		logerror("checksum error\n");
+		free(img->sections);
+		img->sections = NULL;
+		return -7;
+	}
+	return 0;
+
+fail:
+	free(img->sections);
+	img->sections = NULL;
+	return -3;
+}
+
+/*
+ * Map a Cypress Image file and parse it.
+ */
+int fx3_image_open(struct fx3_image *img, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd, ret;
+
+	img->mapped = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		logerror("unable to open '%s' for input\n", path);
+		return -2;
+	} else if (verbose)
+		logerror("open firmware image %s for RAM upload\n", path);
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		logerror("could not read image header");
+		close(fd);
+		return -3;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		logerror("could not map '%s': %s\n", path, strerror(errno));
+		return -3;
+	}
+
+	ret = fx3_image_parse(img, data, st.st_size);
+	if (ret != 0) {
+		munmap(data, st.st_size);
+		return ret;
 	}
+	img->mapped = 1;
+	return 0;
+}
+
+void fx3_image_close(struct fx3_image *img)
+{
+	free(img->sections);
+	img->sections = NULL;
+	img->nsections = 0;
+	if (img->mapped)
+		munmap((void *)img->data, img->size);
+	img->mapped = 0;
+}
+
+/*
+ * Upload a parsed Cypress Image into target RAM and start it.
+ */
+int fx3_image_load(libusb_device_handle *device, const struct fx3_image *img)
+{
+	uint32_t dAddress, dLen, dLength;
+	const unsigned char *bBuf;
+	unsigned char blBuf[4] = { 0 }, rBuf[FX3_CHUNK];
 
 	// Read the bootloader version
 	if (verbose) {
 		if ((ezusb_read(device, "read bootloader version", RW_INTERNAL, 0xFFFF0020, blBuf, 4) < 0)) {
 			logerror("Could not read bootloader version\n");
-			ret = -8;
-			goto exit;
+			return -8;
 		}
 		logerror("FX3 bootloader version: 0x%02X%02X%02X%02X\n", blBuf[3], blBuf[2], blBuf[1], blBuf[0]);
 	}
 
-	dCheckSum = 0;
 	if (verbose)
 		logerror("writing image...\n");
-	while (1) {
-		if ((fread(&dLength, sizeof(uint32_t), 1, image) != 1) ||  // read dLength
-			(fread(&dAddress, sizeof(uint32_t), 1, image) != 1)) { // read dAddress
-			logerror("could not read image");
-			ret = -3;
-			goto exit;
-		}
-		if (dLength == 0)
-			break; // done
-
-		// coverity[tainted_data]
-		dImageBuf = (uint32_t*)calloc(dLength, sizeof(uint32_t));
-		if (dImageBuf == NULL) {
-			logerror("could not allocate buffer for image chunk\n");
-			ret = -4;
-			goto exit;
-		}
-
-		// read sections
-		if (fread(dImageBuf, sizeof(uint32_t), dLength, image) != dLength) {
-			logerror("could not read image");
-			free(dImageBuf);
-			ret = -3;
-			goto exit;
-		}
-		for (i = 0; i < dLength; i++)
-			dCheckSum += dImageBuf[i];
-		dLength <<= 2; // convert to Byte length
-		bBuf = (unsigned char*) dImageBuf;
+	for (unsigned int s = 0; s < img->nsections; s++) {
+		dAddress = img->sections[s].address;
+		dLength = img->sections[s].length;
+		bBuf = img->sections[s].data;
 
 		while (dLength > 0) {
-			dLen = 4096; // 4K max
+			dLen = FX3_CHUNK;
 			if (dLen > dLength)
 				dLen = dLength;
 			if ((ezusb_write(device, "write firmware", RW_INTERNAL, dAddress, bBuf, dLen) < 0) ||
-				(ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0)) {
+				(ezusb_verify && ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0)) {
 				logerror("R/W error\n");
-				free(dImageBuf);
-				ret = -5;
-				goto exit;
+				return -5;
 			}
 			// Verify data: rBuf with bBuf
-			for (i = 0; i < dLen; i++) {
-				if (rBuf[i] != bBuf[i]) {
-					logerror("verify error");
-					free(dImageBuf);
-					ret = -6;
-					goto exit;
-				}
+			if (ezusb_verify && memcmp(rBuf, bBuf, dLen) != 0) {
+				logerror("verify error");
+				return -6;
 			}
 
 			dLength -= dLen;
 			bBuf += dLen;
 			dAddress += dLen;
 		}
-		free(dImageBuf);
-	}
-
-	// read pre-computed checksum data
-	if ((fread(&dExpectedCheckSum, sizeof(uint32_t), 1, image) != 1) ||
-		(dCheckSum != dExpectedCheckSum)) {
-		logerror("checksum error\n");
-		ret = -7;
-		goto exit;
 	}
 
 	// transfer execution to Program Entry
-	if (!ezusb_fx3_jump(device, dAddress)) {
-		ret = -6;
-	}
+	if (!ezusb_fx3_jump(device, img->entry))
+		return -6;
+	return 0;
+}
 
-exit:
-	fclose(image);
+/*
+ * Load a Cypress Image file into target RAM.
+ */
+static int fx3_load_ram(libusb_device_handle *device, const char *path)
+{
+	struct fx3_image img;
+	int ret;
+
+	ret = fx3_image_open(&img, path);
+	if (ret != 0)
+		return ret;
+	ret = fx3_image_load(device, &img);
+	fx3_image_close(&img);
 	return ret;
 }
 
@@ -852,7 +936,7 @@ int command_send(struct libusb_device_handle *dev_handle, enum FX3Command cmd,
   /* Send the control message. */
   ret = libusb_control_transfer(
       dev_handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, cmd, 0, 0,
-      (unsigned char *)&data, sizeof(data), 0);
+      (unsigned char *)&data, sizeof(data), FX3_COMMAND_TIMEOUT);
 
   if (ret < 0) {
     fprintf(stderr, "Could not send command: 0x%X with data: %d. Error : %s.\n",
@@ -872,7 +956,7 @@ int argument_send(struct libusb_device_handle *dev_handle, enum ArgumentList cmd
   uint8_t zero = 0;
   ret = libusb_control_transfer(
       dev_handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, SETARGFX3, data, cmd,
-      (unsigned char *)&zero, sizeof(zero), 0);
+      (unsigned char *)&zero, sizeof(zero), FX3_COMMAND_TIMEOUT);
 
   if (ret < 0) {
     fprintf(stderr, "Could not send argument: 0x%X with data: %d. Error : %s.\n",
@@ -883,3 +967,119 @@ int argument_send(struct libusb_device_handle *dev_handle, enum ArgumentList cmd
   return 0;
 }
 
+/* What an asynchronous request needs once it completes */
+struct command_context {
+  command_callback callback;
+  void *user_data;
+  const char *what; /* "command" or "argument" */
+  unsigned int id;
+  uint32_t data;
+};
+
+static void LIBUSB_CALL command_complete(struct libusb_transfer *transfer) {
+  struct command_context *ctx = transfer->user_data;
+  int status;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    status = 0;
+    break;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    status = LIBUSB_ERROR_TIMEOUT;
+    break;
+  case LIBUSB_TRANSFER_STALL:
+    status = LIBUSB_ERROR_PIPE;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    status = LIBUSB_ERROR_NO_DEVICE;
+    break;
+  default:
+    status = LIBUSB_ERROR_IO;
+    break;
+  }
+  if (status != 0)
+    fprintf(stderr, "Could not send %s: 0x%X with data: %d. Error : %s.\n",
+            ctx->what, ctx->id, ctx->data, libusb_error_name(status));
+  if (ctx->callback != NULL)
+    ctx->callback(status, ctx->user_data);
+  free(ctx);
+  /* LIBUSB_TRANSFER_FREE_* take care of the transfer and its buffer */
+}
+
+/*
+ * Submits one vendor request with len bytes of payload. The transfer
+ * carries its own copy of the payload, so the caller's can go away.
+ */
+static int vendor_submit(struct libusb_device_handle *dev_handle,
+                         uint8_t request, uint16_t value, uint16_t index,
+                         const void *payload, uint16_t len,
+                         struct command_context *ctx, unsigned int timeout) {
+  struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+  unsigned char *buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+  int ret;
+
+  if (transfer == NULL || buf == NULL) {
+    libusb_free_transfer(transfer);
+    free(buf);
+    free(ctx);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  libusb_fill_control_setup(buf, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                            request, value, index, len);
+  memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, payload, len);
+  libusb_fill_control_transfer(transfer, dev_handle, buf, command_complete,
+                               ctx, timeout);
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+  ret = libusb_submit_transfer(transfer);
+  if (ret != 0) {
+    fprintf(stderr, "Could not send %s: 0x%X with data: %d. Error : %s.\n",
+            ctx->what, ctx->id, ctx->data, libusb_error_name(ret));
+    libusb_free_transfer(transfer); /* frees buf too, per the flags */
+    free(ctx);
+  }
+  return ret;
+}
+
+static struct command_context *command_context(const char *what,
+                                               unsigned int id, uint32_t data,
+                                               command_callback callback,
+                                               void *user_data) {
+  struct command_context *ctx = malloc(sizeof(*ctx));
+
+  if (ctx != NULL) {
+    ctx->callback = callback;
+    ctx->user_data = user_data;
+    ctx->what = what;
+    ctx->id = id;
+    ctx->data = data;
+  }
+  return ctx;
+}
+
+int command_send_async(struct libusb_device_handle *dev_handle,
+                       enum FX3Command cmd, uint32_t data,
+                       unsigned int timeout, command_callback callback,
+                       void *user_data) {
+  struct command_context *ctx =
+      command_context("command", cmd, data, callback, user_data);
+
+  if (ctx == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  return vendor_submit(dev_handle, cmd, 0, 0, &data, sizeof(data), ctx,
+                       timeout);
+}
+
+int argument_send_async(struct libusb_device_handle *dev_handle,
+                        enum ArgumentList cmd, uint32_t data,
+                        unsigned int timeout, command_callback callback,
+                        void *user_data) {
+  struct command_context *ctx =
+      command_context("argument", cmd, data, callback, user_data);
+  uint8_t zero = 0;
+
+  if (ctx == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  return vendor_submit(dev_handle, SETARGFX3, data, cmd, &zero, sizeof(zero),
+                       ctx, timeout);
+}
@@ -89,6 +89,37 @@ typedef struct {
 extern int ezusb_load_ram(libusb_device_handle *device,
 	const char *path, int fx_type, int img_type, int stage);
 
+/*
+ * A Cypress FX3 image split into its sections, which point into the image
+ * itself. fx3_image_open maps a file, fx3_image_parse takes an image that
+ * is already in memory; both check the checksum, so fx3_image_load only
+ * has to send the sections, and one parsed image can boot many devices.
+ */
+struct fx3_section {
+	uint32_t address;
+	uint32_t length; /* bytes */
+	const unsigned char *data;
+};
+
+struct fx3_image {
+	const unsigned char *data;
+	size_t size;
+	int mapped;
+	unsigned int nsections;
+	struct fx3_section *sections;
+	uint32_t entry;
+};
+
+extern int fx3_image_open(struct fx3_image *img, const char *path);
+extern int fx3_image_parse(struct fx3_image *img, const void *data, size_t size);
+extern int fx3_image_load(libusb_device_handle *device, const struct fx3_image *img);
+extern void fx3_image_close(struct fx3_image *img);
+
+/*
+ * The image built in with make EMBED_FIRMWARE=file.img, or NULL.
+ */
+extern const unsigned char *fx3_embedded_image(size_t *size);
+
 /*
  * This function uploads the firmware from the given file into EEPROM.
  * This uses the right CPUCS address to terminate the EEPROM load with
@@ -106,13 +137,37 @@ extern int ezusb_load_eeprom(libusb_device_handle *device,
 /* Verbosity level (default 1). Can be increased or decreased with options v/q  */
 extern int verbose;
 
+/* Read back and compare every chunk of an FX3 upload (default 0) */
+extern int ezusb_verify;
+
 extern void logerror(const char *format, ...)/* PRINTF_FORMAT(1, 2)*/;
 
+/* Timeout in ms of the FX3 vendor requests below */
+#define FX3_COMMAND_TIMEOUT 1000
+
 int command_send(struct libusb_device_handle *dev_handle, enum FX3Command cmd,
                  uint32_t data);
 int argument_send(struct libusb_device_handle *dev_handle, enum ArgumentList cmd,
                  uint32_t data);
 
+/*
+ * The same without waiting. The callback runs from libusb event handling
+ * with 0 or a libusb_error once the device has taken the request or it
+ * failed or timed out. Requests to one device complete in the order they
+ * were submitted, so a sequence can be queued at once. Returns 0 when
+ * submitted, otherwise a libusb_error and the callback is not called.
+ */
+typedef void (*command_callback)(int status, void *user_data);
+
+int command_send_async(struct libusb_device_handle *dev_handle,
+                       enum FX3Command cmd, uint32_t data,
+                       unsigned int timeout, command_callback callback,
+                       void *user_data);
+int argument_send_async(struct libusb_device_handle *dev_handle,
+                        enum ArgumentList cmd, uint32_t data,
+                        unsigned int timeout, command_callback callback,
+                        void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
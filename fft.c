@@ -0,0 +1,64 @@
+#include "fft.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int fft_init(struct fft *f, unsigned int n) {
+    memset(f, 0, sizeof(*f));
+    if (n < 2 || (n & (n - 1)) != 0)
+        return -1;
+
+    f->n = n;
+    while ((1U << f->log2n) < n)
+        f->log2n++;
+    f->twiddle = malloc(n / 2 * sizeof(float complex));
+    f->bitrev = malloc(n * sizeof(unsigned int));
+    if (f->twiddle == NULL || f->bitrev == NULL) {
+        fft_free(f);
+        return -1;
+    }
+    for (unsigned int k = 0; k < n / 2; k++) {
+        double a = -2.0 * M_PI * k / n;
+        f->twiddle[k] = (float)cos(a) + (float)sin(a) * I;
+    }
+    for (unsigned int k = 0; k < n; k++) {
+        unsigned int r = 0;
+        for (unsigned int b = 0; b < f->log2n; b++)
+            r |= ((k >> b) & 1) << (f->log2n - 1 - b);
+        f->bitrev[k] = r;
+    }
+    return 0;
+}
+
+void fft_free(struct fft *f) {
+    free(f->twiddle);
+    free(f->bitrev);
+    memset(f, 0, sizeof(*f));
+}
+
+void fft_forward(const struct fft *f, float complex *data) {
+    unsigned int n = f->n;
+
+    for (unsigned int k = 0; k < n; k++) {
+        unsigned int r = f->bitrev[k];
+        if (r > k) {
+            float complex t = data[k];
+            data[k] = data[r];
+            data[r] = t;
+        }
+    }
+
+    for (unsigned int len = 2, step = n / 2; len <= n; len <<= 1, step >>= 1) {
+        unsigned int half = len / 2;
+        for (unsigned int base = 0; base < n; base += len) {
+            float complex *a = data + base;
+            float complex *b = a + half;
+            for (unsigned int j = 0; j < half; j++) {
+                float complex t = b[j] * f->twiddle[j * step];
+                b[j] = a[j] - t;
+                a[j] = a[j] + t;
+            }
+        }
+    }
+}
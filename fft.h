@@ -0,0 +1,28 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex.h>
+#include <stddef.h>
+
+/*
+ * In-place iterative radix-2 complex FFT with precomputed twiddles and
+ * bit-reversal table. The plan is read-only once initialised, so several
+ * threads can share one.
+ */
+
+struct fft {
+    unsigned int n; // power of two
+    unsigned int log2n;
+    float complex *twiddle; // exp(-2*pi*i*k/n), k < n/2
+    unsigned int *bitrev;
+};
+
+// Returns 0 on success, -1 if n is not a power of two or on allocation
+// failure.
+int fft_init(struct fft *f, unsigned int n);
+void fft_free(struct fft *f);
+
+// Forward transform, X[k] = sum(x[j] * exp(-2*pi*i*j*k/n)), unscaled.
+void fft_forward(const struct fft *f, float complex *data);
+
+#endif
@@ -0,0 +1,24 @@
+#include "ezusb.h"
+
+#ifdef EMBED_FIRMWARE
+// The assembler pulls the image in as it is, so the build needs no
+// conversion tool. Word aligned for the section table.
+__asm__(".section .rodata\n"
+        ".balign 16\n"
+        "fx3_embedded_start:\n"
+        ".incbin \"" EMBED_FIRMWARE "\"\n"
+        "fx3_embedded_end:\n"
+        ".previous\n");
+
+extern const unsigned char fx3_embedded_start[], fx3_embedded_end[];
+
+const unsigned char *fx3_embedded_image(size_t *size) {
+    *size = fx3_embedded_end - fx3_embedded_start;
+    return fx3_embedded_start;
+}
+#else
+const unsigned char *fx3_embedded_image(size_t *size) {
+    *size = 0;
+    return NULL;
+}
+#endif
@@ -0,0 +1,38 @@
+#include "format.h"
+
+#include <string.h>
+
+static const char *const format_names[] = {
+    [FORMAT_S16] = "s16",
+    [FORMAT_F32] = "f32",
+    [FORMAT_S12] = "s12",
+    [FORMAT_S8] = "s8",
+};
+
+int format_parse(const char *name, enum sample_format *format) {
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = (enum sample_format)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *format_name(enum sample_format format) {
+    return format_names[format];
+}
+
+size_t format_bytes(enum sample_format format, size_t n) {
+    switch (format) {
+    case FORMAT_S16:
+        return 2 * n;
+    case FORMAT_F32:
+        return 4 * n;
+    case FORMAT_S12:
+        return (3 * n + 1) / 2;
+    case FORMAT_S8:
+        return n;
+    }
+    return 0;
+}
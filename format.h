@@ -0,0 +1,23 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+
+// Output sample formats. Complex output interleaves I and Q.
+enum sample_format {
+    FORMAT_S16, // int16, native endian
+    FORMAT_F32, // float32, native endian
+    FORMAT_S12, // top 12 bits of each sample, two samples in three bytes:
+                // a[7:0], b[3:0] a[11:8], b[11:4]; a stream of an odd
+                // number ends with a[7:0], a[11:8]
+    FORMAT_S8,  // int8 of the sample shifted right, saturated
+};
+
+// Parses "s16", "s12", "s8" or "f32". Returns 0 on success, -1 if unknown.
+int format_parse(const char *name, enum sample_format *format);
+const char *format_name(enum sample_format format);
+// Bytes taken by n (real) samples. An odd trailing s12 sample takes two,
+// which only happens at the end of a stream, see pipeline_flush.
+size_t format_bytes(enum sample_format format, size_t n);
+
+#endif
@@ -0,0 +1,61 @@
+#include "meta.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+int meta_open(struct meta *m, const char *spec, unsigned int interval_ms) {
+    m->sink = sink_open(spec);
+    m->interval_ns = (uint64_t)interval_ms * 1000000;
+    m->next_time = 0;
+    return m->sink != NULL ? 0 : -1;
+}
+
+void meta_close(struct meta *m) {
+    sink_close(m->sink);
+    m->sink = NULL;
+}
+
+void meta_record(struct meta *m, const char *type, uint64_t sample,
+                 uint64_t offset, const char *fields, ...) {
+    char line[1024];
+    int n;
+
+    if (m->sink == NULL)
+        return;
+    n = snprintf(line, sizeof(line),
+                 "{\"type\":\"%s\",\"sample\":%llu,\"offset\":%llu", type,
+                 (unsigned long long)sample, (unsigned long long)offset);
+    if (fields != NULL && n < (int)sizeof(line)) {
+        va_list ap;
+        va_start(ap, fields);
+        n += vsnprintf(line + n, sizeof(line) - n, fields, ap);
+        va_end(ap);
+    }
+    if (n > (int)sizeof(line) - 3)
+        n = sizeof(line) - 3;
+    line[n++] = '}';
+    line[n++] = '\n';
+    sink_write(m->sink, line, n, NULL);
+}
+
+void meta_block(struct meta *m, const struct block_info *info,
+                uint64_t offset) {
+    if (m->sink == NULL)
+        return;
+    if (info->lost > 0 || info->restarted)
+        meta_record(m, "gap", info->sample_index, offset,
+                    ",\"lost\":%llu,\"reason\":\"%s\"",
+                    (unsigned long long)info->lost,
+                    info->restarted   ? "reset"
+                    : info->lost_usb  ? "usb"
+                    : info->lost_rate ? "rate"
+                                      : "ring");
+    // A gap breaks the sample-to-time relation, so re-anchor right away
+    if (info->timestamp_ns >= m->next_time || info->lost > 0 ||
+        info->restarted) {
+        meta_record(m, "time", info->sample_index, offset,
+                    ",\"time_ns\":%llu",
+                    (unsigned long long)info->timestamp_ns);
+        m->next_time = info->timestamp_ns + m->interval_ns;
+    }
+}
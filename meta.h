@@ -0,0 +1,52 @@
+#ifndef META_H
+#define META_H
+
+#include <stdint.h>
+
+#include "sink.h"
+
+/*
+ * Metadata side channel: JSON lines on their own sink, tying the 64-bit
+ * ADC sample counter to the host clock and to the output stream. Every
+ * record has the ADC sample index it applies to and the byte offset in the
+ * main output where that sample's output begins:
+ *
+ *   {"type":"config","sample":0,"offset":0,"samplerate":...,...}
+ *   {"type":"time","sample":N,"offset":B,"time_ns":T}
+ *       the block starting at sample N completed at CLOCK_REALTIME T
+ *   {"type":"gap","sample":N,"offset":B,"lost":L,
+ *    "reason":"usb"|"ring"|"rate"|"reset"}
+ *       L samples before N never reached the output
+ *
+ * A "usb" gap counts the bytes of failed transfers. A "rate" gap is of
+ * samples the device never delivered at all, missing only from the sample
+ * rate (see rate_check): L is an estimate, and N is where the gap was
+ * noticed, somewhat after where it happened. A "reset" gap is a
+ * discontinuity: the device went away and streaming was restarted, and L
+ * is estimated from the time it was gone.
+ *
+ * Records are written from the writer thread only.
+ */
+
+struct meta {
+    struct sink *sink;
+    uint64_t interval_ns; // between time records
+    uint64_t next_time;   // CLOCK_REALTIME of the next time record
+};
+
+// interval_ms is the spacing of time records. Returns 0 on success.
+int meta_open(struct meta *m, const char *spec, unsigned int interval_ms);
+void meta_close(struct meta *m);
+
+// Writes one record of the given type. fields, if not NULL, is a printf
+// format for extra ",\"key\":value" members.
+void meta_record(struct meta *m, const char *type, uint64_t sample,
+                 uint64_t offset, const char *fields, ...)
+    __attribute__((format(printf, 5, 6)));
+
+// Called for every block before its output is written at offset: writes a
+// gap record for samples lost before it and a time record when one is due.
+void meta_block(struct meta *m, const struct block_info *info,
+                uint64_t offset);
+
+#endif
@@ -0,0 +1,322 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int pipeline_init(struct pipeline *p, const struct pipeline_config *cfg) {
+    size_t max_samples = cfg->max_bytes / sizeof(int16_t);
+    unsigned int channels = cfg->iq ? 2 : 1;
+
+    memset(p, 0, sizeof(*p));
+    p->cfg = *cfg;
+
+    if (cfg->iq &&
+        iq_init(&p->iqc, max_samples, cfg->kernels, cfg->arena) != 0)
+        goto fail;
+    for (unsigned int c = 0; c < channels; c++) {
+        // The IQ converter already halves the rate
+        size_t in = cfg->iq ? max_samples / 2 : max_samples;
+        if (decimator_init(&p->dec[c], cfg->decimate, in, cfg->kernels,
+                           cfg->arena) != 0)
+            goto fail;
+        p->fbuf[c] =
+            arena_alloc(cfg->arena, (max_samples + 1) * sizeof(float));
+        if (p->fbuf[c] == NULL)
+            goto fail;
+    }
+    p->obuf = arena_alloc(cfg->arena, (max_samples + 2) * sizeof(float));
+    if (p->obuf == NULL)
+        goto fail;
+    if (cfg->channels > 0 &&
+        channelizer_init(&p->chan, cfg->channels, cfg->channel_threads,
+                         max_samples / 2 / cfg->decimate + 1,
+                         cfg->channel_out, cfg->format,
+                         cfg->worker_cpus, cfg->arena) != 0)
+        goto fail;
+    if (cfg->spectrum > 0 &&
+        spectrum_init(&p->spec, cfg->spectrum, cfg->spectrum_avg, cfg->iq,
+                      cfg->channel_threads,
+                      (cfg->iq ? max_samples / 2 : max_samples) / cfg->decimate + 1,
+                      cfg->worker_cpus, cfg->arena) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    pipeline_free(p);
+    return -1;
+}
+
+void pipeline_free(struct pipeline *p) {
+    if (p->cfg.iq)
+        iq_free(&p->iqc);
+    for (unsigned int c = 0; c < 2; c++) {
+        decimator_free(&p->dec[c]);
+        arena_free(p->cfg.arena, p->fbuf[c]);
+    }
+    arena_free(p->cfg.arena, p->obuf);
+    if (p->cfg.channels > 0)
+        channelizer_free(&p->chan);
+    if (p->cfg.spectrum > 0)
+        spectrum_free(&p->spec);
+    memset(p, 0, sizeof(*p));
+}
+
+// Packs n raw samples in s to s12 at dst, after the sample held back from
+// the last block, and holds back an odd one at the end. dst is s, or
+// another buffer with room for n / 2 + 1 pairs. Returns the bytes written.
+static size_t pack12_stream(struct pipeline *p, uint16_t *s, size_t n,
+                            int derand, unsigned char *dst) {
+    const struct convert_impl *k = p->cfg.kernels;
+    size_t skip, m;
+    uint16_t pair[2];
+    int hold;
+
+    if (n == 0)
+        return 0;
+    skip = p->has_carry12 ? 1 : 0;
+    m = (n - skip) & ~(size_t)1;
+    hold = skip + m < n;
+    // Samples packed on their own are decoded first
+    if (derand && (skip || hold)) {
+        k->derand(s, n);
+        derand = 0;
+    }
+    pair[0] = p->carry12;
+    pair[1] = s[0];
+    if (hold)
+        p->carry12 = s[n - 1];
+    p->has_carry12 = hold;
+    if (!skip) {
+        k->pack12(s, m, derand, dst);
+        return m / 2 * 3;
+    }
+
+    if (dst == (unsigned char *)s) {
+        // In place the pairs would overtake the samples they come from, so
+        // they are packed where those start and then moved up a byte
+        k->pack12(s + 1, m, 0, dst + 2);
+        memmove(dst + 3, dst + 2, m / 2 * 3);
+    } else {
+        k->pack12(s + 1, m, 0, dst + 3);
+    }
+    k->pack12(pair, 2, 0, dst);
+    return 3 + m / 2 * 3;
+}
+
+// Converts n int16 samples in obuf to the output format, in place.
+// Returns their length in bytes.
+static size_t pack_s16(struct pipeline *p, size_t n) {
+    const uint16_t *s = (const uint16_t *)p->obuf;
+
+    if (p->cfg.format == FORMAT_S12)
+        return pack12_stream(p, (uint16_t *)p->obuf, n, 0, p->obuf);
+    else if (p->cfg.format == FORMAT_S8)
+        p->cfg.kernels->to_s8(s, n, 0, p->cfg.shift, (int8_t *)p->obuf);
+    return format_bytes(p->cfg.format, n);
+}
+
+static size_t process_real(struct pipeline *p, unsigned char *buf, size_t len,
+                           const struct block_info *info,
+                           const unsigned char **out) {
+    const struct convert_impl *k = p->cfg.kernels;
+    size_t n = len / sizeof(int16_t);
+    int derand = p->cfg.randomizer;
+
+    if (p->cfg.spectrum > 0) {
+        if (p->cfg.decimate == 1) {
+            k->to_f32((const uint16_t *)buf, n, derand, p->fbuf[0]);
+        } else {
+            if (derand)
+                k->derand((uint16_t *)buf, n);
+            n = decimator_process(&p->dec[0], (int16_t *)buf, n, p->fbuf[0]);
+        }
+        return spectrum_process(&p->spec, p->fbuf[0], NULL, n, info, out);
+    }
+
+    // Without decimation one kernel converts straight from the transfer
+    // buffer, undoing the randomizer on the way. The compact formats are
+    // packed in place.
+    if (p->cfg.decimate == 1) {
+        const uint16_t *s = (const uint16_t *)buf;
+
+        *out = buf;
+        switch (p->cfg.format) {
+        case FORMAT_S16:
+            if (derand)
+                k->derand((uint16_t *)buf, n);
+            break;
+        case FORMAT_S12:
+            // A held back sample makes the output longer than the input
+            if (p->has_carry12)
+                *out = p->obuf;
+            return pack12_stream(p, (uint16_t *)buf, n, derand,
+                                 (unsigned char *)*out);
+        case FORMAT_S8:
+            k->to_s8(s, n, derand, p->cfg.shift, (int8_t *)buf);
+            break;
+        case FORMAT_F32:
+            k->to_f32(s, n, derand, (float *)p->obuf);
+            *out = p->obuf;
+            break;
+        }
+        return format_bytes(p->cfg.format, n);
+    }
+
+    if (derand)
+        k->derand((uint16_t *)buf, n);
+    n = decimator_process(&p->dec[0], (int16_t *)buf, n, p->fbuf[0]);
+
+    *out = p->obuf;
+    if (p->cfg.format == FORMAT_F32) {
+        memcpy(p->obuf, p->fbuf[0], n * sizeof(float));
+        return format_bytes(FORMAT_F32, n);
+    }
+    dsp_f32_to_s16(p->fbuf[0], (int16_t *)p->obuf, n);
+    return pack_s16(p, n);
+}
+
+static size_t process_iq(struct pipeline *p, unsigned char *buf, size_t len,
+                         const struct block_info *info,
+                         const unsigned char **out) {
+    size_t n;
+
+    // Randomizer decode is fused into the mixer
+    n = iq_process(&p->iqc, (const uint16_t *)buf, len / sizeof(int16_t),
+                   p->cfg.randomizer, p->fbuf[0], p->fbuf[1]);
+    if (p->cfg.decimate > 1) {
+        decimator_process_f32(&p->dec[0], p->fbuf[0], n, p->fbuf[0]);
+        n = decimator_process_f32(&p->dec[1], p->fbuf[1], n, p->fbuf[1]);
+    }
+
+    if (p->cfg.channels > 0) {
+        channelizer_process(&p->chan, p->fbuf[0], p->fbuf[1], n, info);
+        return 0;
+    }
+    if (p->cfg.spectrum > 0)
+        return spectrum_process(&p->spec, p->fbuf[0], p->fbuf[1], n, info, out);
+
+    *out = p->obuf;
+    if (p->cfg.format == FORMAT_F32) {
+        float *o = (float *)p->obuf;
+        for (size_t i = 0; i < n; i++) {
+            o[2 * i] = p->fbuf[0][i];
+            o[2 * i + 1] = p->fbuf[1][i];
+        }
+        return format_bytes(FORMAT_F32, 2 * n);
+    }
+
+    int16_t *o = (int16_t *)p->obuf;
+    float iq[2];
+    for (size_t i = 0; i < n; i++) {
+        iq[0] = p->fbuf[0][i];
+        iq[1] = p->fbuf[1][i];
+        dsp_f32_to_s16(iq, o + 2 * i, 2);
+    }
+    return pack_s16(p, 2 * n);
+}
+
+size_t pipeline_process(struct pipeline *p, unsigned char *buf, size_t len,
+                        const struct block_info *info,
+                        const unsigned char **out) {
+    if (p->cfg.iq)
+        return process_iq(p, buf, len, info, out);
+    return process_real(p, buf, len, info, out);
+}
+
+size_t pipeline_flush(struct pipeline *p, const unsigned char **out) {
+    if (!p->has_carry12)
+        return 0;
+    p->cfg.kernels->pack12(&p->carry12, 1, 0, p->obuf);
+    p->has_carry12 = 0;
+    *out = p->obuf;
+    return format_bytes(FORMAT_S12, 1);
+}
+
+// Runs in through a new pipeline in pieces of the given sizes, cycled,
+// and appends its output, flushed, to out. Returns the output length, or
+// 0 if the pipeline could not be set up.
+static size_t selftest_run(const struct pipeline_config *cfg,
+                           const uint16_t *in, size_t len,
+                           const size_t *pieces, size_t npieces,
+                           uint16_t *scratch, unsigned char *out) {
+    struct pipeline p;
+    const unsigned char *o;
+    size_t done = 0, k;
+
+    if (pipeline_init(&p, cfg) != 0)
+        return 0;
+    for (size_t off = 0, i = 0; off < len; off += k, i++) {
+        size_t n;
+
+        k = pieces[i % npieces] < len - off ? pieces[i % npieces] : len - off;
+        // Processing is in place
+        memcpy(scratch, in + off, k * sizeof(*in));
+        n = pipeline_process(&p, (unsigned char *)scratch, k * sizeof(*in),
+                             NULL, &o);
+        memcpy(out + done, o, n);
+        done += n;
+    }
+    k = pipeline_flush(&p, &o);
+    memcpy(out + done, o, k);
+    done += k;
+    pipeline_free(&p);
+    return done;
+}
+
+int pipeline_selftest(void) {
+    // Odd pieces, as short transfers and odd gap fills give
+    static const size_t pieces[] = {1, 2, 5, 3, 4097, 6, 7, 1023, 4};
+    static const size_t whole[] = {16383};
+    const size_t len = 16383;
+    uint16_t *input = malloc(len * sizeof(uint16_t));
+    uint16_t *scratch = malloc(len * sizeof(uint16_t));
+    unsigned char *expect = malloc(2 * len);
+    unsigned char *got = malloc(2 * len);
+    int failed = 0;
+
+    if (input == NULL || scratch == NULL || expect == NULL || got == NULL) {
+        fprintf(stderr, "selftest: out of memory\n");
+        failed = -1;
+        goto out;
+    }
+    srand(0x2208);
+    for (size_t i = 0; i < len; i++)
+        input[i] = (uint16_t)rand();
+
+    for (const struct convert_impl *impl = convert_impls; impl->name; impl++) {
+        int ok = 1;
+
+        if (!impl->supported())
+            continue;
+        // Straight from the transfer, with and without the randomizer, and
+        // in place after decimation
+        for (unsigned int t = 0; t < 3; t++) {
+            struct pipeline_config cfg = {
+                .randomizer = t == 1,
+                .decimate = t == 2 ? 2 : 1,
+                .format = FORMAT_S12,
+                .max_bytes = len * sizeof(uint16_t),
+                .kernels = impl,
+            };
+            size_t n = selftest_run(&cfg, input, len, whole, 1, scratch,
+                                    expect);
+            size_t m = selftest_run(&cfg, input, len, pieces,
+                                    sizeof(pieces) / sizeof(pieces[0]),
+                                    scratch, got);
+
+            if (n == 0 || m != n || memcmp(expect, got, n) != 0)
+                ok = 0;
+        }
+        fprintf(stderr, "selftest: %-8s s12 %s\n", impl->name,
+                ok ? "ok" : "MISMATCH");
+        failed += !ok;
+    }
+
+out:
+    free(input);
+    free(scratch);
+    free(expect);
+    free(got);
+    return failed;
+}
@@ -0,0 +1,73 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "channelizer.h"
+#include "convert.h"
+#include "dsp.h"
+#include "format.h"
+#include "sink.h"
+#include "spectrum.h"
+
+/*
+ * Processing applied on the writer thread to every block from the device,
+ * between the output ring and the output: randomizer decode, optional
+ * real-to-complex conversion, decimation and conversion to the output
+ * sample format, or splitting into channels written to their own sinks,
+ * or averaging into power spectrum frames.
+ */
+
+struct pipeline_config {
+    int randomizer;        // undo the ADC output randomizer
+    int iq;                // emit interleaved complex samples at fs / 2
+    unsigned int decimate; // additional decimation, power of two
+    enum sample_format format;
+    unsigned int shift; // right shift of s16 samples for s8 output
+    size_t max_bytes; // largest block that will be passed in
+    const struct convert_impl *kernels;
+    unsigned int channels;        // channelize the complex output, if > 0
+    unsigned int channel_threads; // also used by the spectrum
+    const char *channel_out;      // sink spec template, see channelizer.h
+    const struct rt_cpus *worker_cpus; // worker thread affinity, or NULL
+    unsigned int spectrum;        // output spectra of this size, if > 0
+    unsigned int spectrum_avg;    // transforms per spectrum frame
+    struct arena *arena;          // for the block buffers, or NULL
+};
+
+struct pipeline {
+    struct pipeline_config cfg;
+    struct iq_converter iqc;
+    struct decimator dec[2]; // real, or I and Q
+    float *fbuf[2];
+    unsigned char *obuf;
+    struct channelizer chan;
+    struct spectrum spec;
+    uint16_t carry12; // s12 sample short of a pair, randomizer undone
+    int has_carry12;
+};
+
+// Returns 0 on success, -1 on allocation failure.
+int pipeline_init(struct pipeline *p, const struct pipeline_config *cfg);
+void pipeline_free(struct pipeline *p);
+
+// Processes one block of raw samples, possibly in place. Sets *out to the
+// output bytes, valid until the next call, and returns their length. When
+// channelizing, the channels go to their own sinks, tagged with info, and
+// this returns 0. With a spectrum the output is the frames completed by the
+// block, if any.
+size_t pipeline_process(struct pipeline *p, unsigned char *buf, size_t len,
+                        const struct block_info *info,
+                        const unsigned char **out);
+// s12 pairs never straddle blocks: an odd sample at the end of one is held
+// back for the next. This sets *out to what is still held, padded, and
+// returns its length, for the writer to put out before closing the sink.
+size_t pipeline_flush(struct pipeline *p, const unsigned char **out);
+
+// Checks with every supported kernel set that s12 output of a stream
+// processed in odd pieces is that of the stream processed at once.
+// Returns the number of mismatches, reported on stderr.
+int pipeline_selftest(void);
+
+#endif
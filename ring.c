@@ -0,0 +1,100 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static void futex_wait(_Atomic unsigned int *addr, unsigned int val,
+                       unsigned int timeout_ms) {
+    struct timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+    };
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAIT_PRIVATE, val, &ts,
+            NULL, 0);
+}
+
+static void futex_wake(_Atomic unsigned int *addr) {
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAKE_PRIVATE, INT_MAX,
+            NULL, NULL, 0);
+}
+
+int ring_init(struct ring *r, unsigned int size) {
+    unsigned int n = 1;
+
+    memset(r, 0, sizeof(*r));
+    while (n < size)
+        n <<= 1;
+
+    r->slots = calloc(n, sizeof(struct ring_slot));
+    if (r->slots == NULL)
+        return -1;
+    r->size = n;
+    r->mask = n - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->waiting, 0);
+    return 0;
+}
+
+void ring_free(struct ring *r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+struct ring_slot *ring_reserve(struct ring *r) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    unsigned int used = head - tail;
+
+    if (used >= r->size) {
+        r->drops++;
+        return NULL;
+    }
+    if (used + 1 > r->high_water)
+        r->high_water = used + 1;
+    return &r->slots[head & r->mask];
+}
+
+void ring_commit(struct ring *r) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    // seq_cst store/load pair so that either the consumer sees the new
+    // head before sleeping, or we see it waiting and wake it.
+    atomic_store(&r->head, head + 1);
+    if (atomic_load(&r->waiting))
+        futex_wake(&r->head);
+}
+
+struct ring_slot *ring_peek(struct ring *r) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+    return &r->slots[tail & r->mask];
+}
+
+void ring_release(struct ring *r) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+void ring_wait(struct ring *r, unsigned int timeout_ms) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head;
+
+    atomic_store(&r->waiting, 1);
+    head = atomic_load(&r->head);
+    if (head == tail)
+        futex_wait(&r->head, head, timeout_ms);
+    atomic_store(&r->waiting, 0);
+}
+
+void ring_wake(struct ring *r) { futex_wake(&r->head); }
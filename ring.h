@@ -0,0 +1,79 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock-free single-producer/single-consumer ring of fixed-size slots.
+ *
+ * The producer is the libusb event thread (transfer_callback), the
+ * consumer is the writer thread. The producer never waits: when the ring
+ * is full the block is dropped and counted. The consumer sleeps on a
+ * futex when the ring is empty and is woken by the producer on commit.
+ *
+ * Every slot owns a buffer. A free slot's buffer is a spare the producer
+ * may take: instead of copying into it, the producer swaps it with the
+ * buffer of the transfer that just completed, so data is never copied
+ * and the transfer can be resubmitted at once with the spare.
+ */
+
+#define RING_CACHELINE 64
+
+struct ring_slot {
+    unsigned char *buf; // owned by the slot, provided by the caller
+    size_t len;         // valid bytes in buf
+    uint64_t timestamp_ns; // CLOCK_REALTIME when the transfer completed
+    uint64_t completed_ns; // the same on CLOCK_MONOTONIC_RAW, for latency
+    uint64_t sample_index; // ADC samples before this block, lost ones too
+    uint64_t lost;         // samples lost between the last block and this
+    int lost_usb;          // some of them in failed transfers
+    int lost_rate;         // some only missing from the sample rate
+    int restarted;         // the device was reset before this block
+};
+
+struct ring {
+    struct ring_slot *slots;
+    unsigned int size; // number of slots, power of two
+    unsigned int mask;
+
+    // Producer side
+    _Alignas(RING_CACHELINE) _Atomic unsigned int head;
+    unsigned int high_water; // max slots ever in use
+    uint64_t drops;          // blocks dropped because the ring was full
+
+    // Consumer side
+    _Alignas(RING_CACHELINE) _Atomic unsigned int tail;
+    _Atomic int waiting; // consumer is (about to be) asleep on head
+};
+
+// Allocates a ring of at least `size` slots. The caller fills in
+// slots[i].buf before use and frees them before ring_free.
+// Returns 0 on success, -1 on allocation failure.
+int ring_init(struct ring *r, unsigned int size);
+void ring_free(struct ring *r);
+
+// Producer: next free slot, or NULL (and a drop is counted) if full.
+struct ring_slot *ring_reserve(struct ring *r);
+// Producer: publish the slot returned by ring_reserve.
+void ring_commit(struct ring *r);
+
+// Consumer: oldest filled slot, or NULL if empty.
+struct ring_slot *ring_peek(struct ring *r);
+// Consumer: hand the slot returned by ring_peek back to the producer.
+void ring_release(struct ring *r);
+// Consumer: sleep until the ring is non-empty, ring_wake() is called or
+// timeout_ms expires.
+void ring_wait(struct ring *r, unsigned int timeout_ms);
+
+// Wakes a consumer sleeping in ring_wait, e.g. to let it see a stop flag.
+void ring_wake(struct ring *r);
+
+static inline unsigned int ring_used(struct ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+#endif
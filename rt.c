@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "rt.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static int cpu_isset(const struct rt_cpus *cpus, int cpu) {
+    return (cpus->mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+int rt_parse_cpus(const char *list, struct rt_cpus *cpus) {
+    const char *p = list;
+
+    memset(cpus, 0, sizeof(*cpus));
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0 || first >= RT_MAX_CPUS)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= RT_MAX_CPUS)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!cpu_isset(cpus, cpu))
+                cpus->count++;
+            cpus->mask[cpu / 64] |= 1ULL << (cpu % 64);
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return cpus->count > 0 ? 0 : -1;
+}
+
+int rt_pin(pthread_t thread, const struct rt_cpus *cpus, int index) {
+    size_t size = CPU_ALLOC_SIZE(RT_MAX_CPUS);
+    cpu_set_t *set;
+    int skip, ret;
+
+    if (cpus->count == 0)
+        return 0;
+    set = CPU_ALLOC(RT_MAX_CPUS);
+    if (set == NULL)
+        return -1;
+    CPU_ZERO_S(size, set);
+    skip = index >= 0 ? index % cpus->count : 0;
+    for (int cpu = 0; cpu < RT_MAX_CPUS; cpu++) {
+        if (!cpu_isset(cpus, cpu))
+            continue;
+        if (index < 0) {
+            CPU_SET_S(cpu, size, set);
+        } else if (skip-- == 0) {
+            CPU_SET_S(cpu, size, set);
+            break;
+        }
+    }
+    ret = pthread_setaffinity_np(thread, size, set);
+    CPU_FREE(set);
+    if (ret != 0) {
+        fprintf(stderr, "Could not set CPU affinity: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int rt_fifo(pthread_t thread, int priority) {
+    struct sched_param param = {.sched_priority = priority};
+    int ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+    if (ret != 0) {
+        fprintf(stderr, "Could not set SCHED_FIFO priority %d: %s\n",
+                priority, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int rt_mlock(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Could not lock memory: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef RT_H
+#define RT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Scheduling controls for the capture threads: CPU affinity, SCHED_FIFO
+ * priority and locking memory so page faults cannot stall them. All of
+ * them may need privileges (CAP_SYS_NICE, RLIMIT_MEMLOCK); failures are
+ * reported on stderr and the caller carries on without.
+ */
+
+#define RT_MAX_CPUS 1024
+
+struct rt_cpus {
+    uint64_t mask[RT_MAX_CPUS / 64];
+    int count; // CPUs in mask, 0 when no affinity was asked for
+};
+
+// Parses a CPU list such as "2", "0,2" or "4-7,12". Returns 0 on success,
+// -1 on a malformed list.
+int rt_parse_cpus(const char *list, struct rt_cpus *cpus);
+
+// Pins a thread to the whole set when index < 0, otherwise to the
+// index-th CPU of the set (modulo its size), for spreading a pool of
+// workers one per CPU. Does nothing for an empty set.
+int rt_pin(pthread_t thread, const struct rt_cpus *cpus, int index);
+
+// Switches a thread to SCHED_FIFO at the given priority (1-99).
+int rt_fifo(pthread_t thread, int priority);
+
+// Locks all current and future pages into memory.
+int rt_mlock(void);
+
+#endif
@@ -22,11 +22,27 @@ SOFTWARE.
 
 */
 
+#include "arena.h"
+#include "control.h"
+#include "convert.h"
 #include "ezusb.h"
+#include "capture.h"
+#include "meta.h"
+#include "pipeline.h"
+#include "ring.h"
+#include "rt.h"
+#include "sim.h"
+#include "sink.h"
+#include "stats.h"
+#include "tune.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libusb.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -40,84 +56,1595 @@ SOFTWARE.
 
 unsigned int queuedepth = 16; // Number of requests to queue
 unsigned int reqsize = 8;     // Request size in number of packets
-unsigned int duration = 100;  // Duration of the test in seconds
+unsigned int duration = 0;    // Seconds to stream, 0 until stopped
+unsigned int ringsize = 128;  // Spare transfer buffers rotating through the output ring
+unsigned int decimate = 1;    // Output decimation factor
+unsigned int channels = 0;    // Channelizer channels, 0 for none
+unsigned int channel_threads = 0; // Channelizer/spectrum worker threads, 0 for auto
+const char *channel_out = "channel%02d.raw";
+unsigned int spectrum = 0;      // Spectrum FFT size, 0 for none
+unsigned int spectrum_avg = 64; // Transforms averaged per spectrum frame
+const char *output_spec = "-"; // Sink for the main stream, see sink.h
+const char *record_path = NULL; // Record with O_DIRECT instead of output_spec
+const char *capture_base = NULL; // SigMF capture, instead of either
+const char *trigger_spec = NULL; // Triggered capture to these events, or that
+static const char *decode_path = NULL; // rice: recording to decode to output_spec
+static bool trigger_power = false; // Trigger on the mean power of a transfer
+static double trigger_level;       // ... reaching this, in squared counts
+static double trigger_pre = 5, trigger_post = 5; // Seconds around a trigger
+unsigned int rotate_mb = 0;     // Start a new recording file every N MB
+unsigned int rotate_sec = 0;    // ... or every N seconds
+unsigned int stats_interval = 0; // Seconds between reports, 0 for SIGUSR1 only
+const char *stats_json = NULL;   // File for JSON reports
+static bool event_thread_on = false; // Handle libusb events on their own thread
+static int event_prio = 0;           // SCHED_FIFO priority for it, 0 for none
+static bool lock_memory = false;     // mlockall before streaming
+static struct rt_cpus event_cpus, writer_cpus, worker_cpus;
+static atomic_bool event_stop = false;
+const char *control_spec = NULL;     // Control channel, - or a socket path
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER; // settings
+const char *meta_spec = NULL;        // Sink for metadata records
+unsigned int meta_interval = 1000;   // Milliseconds between time records
+static bool low_latency = false;     // Small transfers, many in flight
+unsigned int autotune_mb = 0;         // Buffer budget for --autotune, 0 for off
+
+// What the output gets in place of lost samples, see fill_gap
+enum fill_mode {
+    FILL_NONE,
+    FILL_ZERO,
+    FILL_MARKER,
+};
+static enum fill_mode fill = FILL_NONE;
+
+static unsigned int samplerate = 32000000;
+static unsigned int gain = 0x83;
+static unsigned int att = 0;
+static enum sample_format format = FORMAT_S16;
+static unsigned int shift = 8; // s8 output keeps the top byte by default
 
 const char *firmware = NULL;
 
 static unsigned int ep = 1 | LIBUSB_ENDPOINT_IN;
 
 static int interface_number = 0;
-static struct libusb_device_handle *dev_handle = NULL;
-unsigned int pktsize;
-unsigned int success_count = 0;  // Number of successful transfers
-unsigned int failure_count = 0;  // Number of failed transfers
-unsigned int transfer_size = 0;  // Size of data transfers performed so far
-unsigned int transfer_index = 0; // Write index into the transfer_size array
+static libusb_context *usb_ctx;       // Shared by all devices
 volatile bool stop_transfers = false; // Request to stop data transfers
-volatile int xfers_in_progress = 0;
 
 volatile int sleep_time = 0;
 
+static const struct convert_impl *kernels; // Runtime-selected SIMD variant
+
+#define MAX_DEVICES 8
+#define CONTROL_EVENTS 16 // settings changes waiting for the writer
+#define RATE_PPM 200      // ADC clock tolerance of the sample rate check
+#define RATE_SLACK_MS 10  // completion jitter it takes beyond the queue
+
+// Recovery: a device that disappears or whose transfers all die is closed
+// once its transfers have drained, then found again by its USB path (or
+// serial), booted if it came back in the bootloader, and restarted. The
+// ring, sink and pipeline carry on, so consumers only see a gap.
+enum device_state {
+    DEV_STREAMING,
+    DEV_LOST,    // transfers draining, nothing resubmitted
+    DEV_WAITING, // USB side closed, looking for the device
+};
+
+// A settings change, for the metadata channel
+struct control_event {
+    uint64_t sample; // first sample after the change was done
+    const char *setting;
+    unsigned int value;
+};
+
+// One RX888 and everything streaming from it. The event thread owns the
+// transfer side, the device's writer thread the output side.
+struct device {
+    unsigned int index;
+    const char *select;         // --device argument, NULL for the first found
+    struct sim *sim;            // Simulated instead of USB, if not NULL
+    char path[32];              // bus-port[.port...], for messages
+    struct libusb_device_handle *handle;
+    struct libusb_device_handle *pool_handle; // the buffers were mapped from
+    struct libusb_config_descriptor *config;
+    bool claimed;
+    unsigned int pktsize;
+    atomic_int state;           // enum device_state
+    uint64_t lost_ns;           // when it went away
+    uint64_t boot_ns;           // last firmware upload while recovering
+    unsigned int recoveries;
+
+    volatile int xfers_in_progress;
+    struct libusb_transfer **transfers;
+    unsigned char **databuffers;
+    bool parked[64];            // Transfer not resubmitted by autotune
+    struct tune tuner;
+    uint64_t sample_counter;    // Next ADC sample
+    _Atomic uint64_t sample_now; // The same, for other threads
+    uint64_t pending_lost;      // Lost samples not yet in a slot
+    int pending_lost_usb;
+    int pending_lost_rate;
+    int pending_restart;
+    bool rate_anchored;         // The sample rate check has a reference:
+    uint64_t rate_ns;           // a completion time, CLOCK_MONOTONIC_RAW,
+    uint64_t rate_samples;      // and the samples received by then
+    bool rate_short;            // Completions are behind beyond the slack,
+    uint64_t rate_deficit;      // this many samples when last they got
+    uint64_t rate_deficit_ns;   // better by more than the jitter, at
+
+    struct ring ring;           // transfer_callback -> writer_thread
+    bool pool_devmem;           // Buffers come from libusb_dev_mem_alloc
+    struct arena arena;         // Otherwise from here, as do DSP buffers
+    char *output;               // Output spec with %D expanded
+    char *channel_out;
+    char *meta_spec;
+    struct sink *sink;          // Where writer_thread sends the stream
+    struct pipeline pl;
+    bool pl_ready;
+    struct meta meta;           // Written by the writer thread only
+    struct capture capture;     // Likewise, if capture_base is set
+    uint16_t *fill_buf;         // A transfer's worth, with --fill
+    pthread_t writer;
+    bool writer_running;
+    atomic_bool writer_stop;    // Set once no more data will arrive
+    struct stats *stats;
+
+    // Settings, changed at runtime under control_lock
+    unsigned int gain, att, gpio;
+    struct control_event events[CONTROL_EVENTS];
+    unsigned int nevents;
+    atomic_uint events_pending; // nevents, read without the lock
+    pthread_mutex_t events_lock;
+    atomic_uint trigger_requests; // From SIGUSR2 and the control channel
+};
+
+static struct device devices[MAX_DEVICES];
+static unsigned int ndevices;
+static struct stats device_stats[MAX_DEVICES]; // Reported together
+static atomic_uint usb_arrivals;      // Bumped by hotplug, for recovery
+static bool hotplug_on;
+static const char *sim_sources[MAX_DEVICES]; // --simulate, one per device
+static unsigned int nsims;
+static struct sim sims[MAX_DEVICES];
+static bool sim_unpaced = false;      // Simulate as fast as it is consumed
+
 int verbose;
 static int randomizer;
 static int dither;
+static int iq;
 static int has_firmware;
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Stops resubmitting the device's transfers and leaves the rest to
+// recover_devices. Called from event handling.
+static void device_lost(struct device *d, const char *why) {
+    int streaming = DEV_STREAMING;
+
+    if (stop_transfers ||
+        !atomic_compare_exchange_strong(&d->state, &streaming, DEV_LOST))
+        return;
+    d->lost_ns = stats_now_ns();
+    fprintf(stderr, "Device %s %s, recovering\n", d->path, why);
+}
+
+static int submit_transfer(struct device *d, struct libusb_transfer *transfer) {
+    if (d->sim != NULL)
+        return sim_submit(d->sim, transfer);
+    return libusb_submit_transfer(transfer);
+}
+
+static void resubmit(struct device *d, struct libusb_transfer *transfer) {
+    int ret = submit_transfer(d, transfer);
+
+    if (ret == 0)
+        d->xfers_in_progress++;
+    else if (ret == LIBUSB_ERROR_NO_DEVICE)
+        device_lost(d, "is gone");
+}
+
+// Resubmits a completed transfer with the current tuning. Transfers beyond
+// the tuned depth are parked instead, and submitted again when it grows.
+static void autotune(struct device *d, struct libusb_transfer *transfer,
+                     uint64_t now) {
+    struct tune *tuner = &d->tuner;
+    unsigned int idx = 0;
+
+    while (idx < queuedepth - 1 && d->transfers[idx] != transfer)
+        idx++;
+    if (tune_update(tuner, now,
+                    transfer->status != LIBUSB_TRANSFER_COMPLETED))
+        fprintf(stderr, "Autotune %s: depth %u, %u packets per transfer, "
+                "%.2f ms in flight\n", d->path, tuner->depth, tuner->size,
+                tune_inflight_ns(tuner) / 1e6);
+
+    if (idx >= tuner->depth) {
+        d->parked[idx] = true;
+    } else {
+        transfer->length = tuner->size * d->pktsize;
+        resubmit(d, transfer);
+    }
+    for (unsigned int i = 0; i < tuner->depth; i++) {
+        if (!d->parked[i])
+            continue;
+        d->parked[i] = false;
+        d->transfers[i]->length = tuner->size * d->pktsize;
+        resubmit(d, d->transfers[i]);
+    }
+}
+
+// Samples the FX3 drops when its buffers overflow never reach the host,
+// not even in a failed transfer, so the count is checked against the
+// sample rate as well. The reference is the completion that came earliest
+// relative to the samples it brought, and every completion that is ahead
+// of it (allowing RATE_PPM of clock error) becomes the new reference.
+// Completions can be late by up to all the transfers in flight, plus some
+// scheduling jitter. A shortfall beyond that may still be a stall of the
+// host, after which the transfers in flight all come in at once, so it is
+// only counted once completions have stopped catching up for as long as
+// the transfers in flight take. What is missing then is counted as lost
+// samples just before the n samples of the transfer at hand, later in the
+// stream than where they went missing.
+static void rate_check(struct device *d, uint64_t n) {
+    uint64_t now = stats_raw_ns();
+    uint64_t have = d->sample_counter + n - d->rate_samples;
+    uint64_t inflight = (uint64_t)queuedepth * reqsize * d->pktsize / 2;
+    uint64_t jitter = (uint64_t)samplerate / 1000 * RATE_SLACK_MS;
+    uint64_t settle_ns = inflight * 1000000000ull / samplerate +
+                         RATE_SLACK_MS * 1000000ull;
+    uint64_t lost;
+    double expect;
+
+    if (!d->rate_anchored || stop_transfers) {
+        d->rate_anchored = true;
+        d->rate_short = false;
+        d->rate_ns = now;
+        d->rate_samples = d->sample_counter + n;
+        return;
+    }
+    expect = (now - d->rate_ns) / 1e9 * samplerate * (1 - RATE_PPM / 1e6);
+    if (have >= expect) {
+        d->rate_short = false;
+        d->rate_ns = now;
+        d->rate_samples = d->sample_counter + n;
+        return;
+    }
+    lost = expect - have;
+    if (lost <= inflight + jitter) {
+        d->rate_short = false;
+        return;
+    }
+    // Behind, unless a stall is still draining: wait while it gets better
+    // by more than the jitter
+    if (!d->rate_short || lost + jitter < d->rate_deficit) {
+        d->rate_short = true;
+        d->rate_deficit = lost;
+        d->rate_deficit_ns = now;
+        return;
+    }
+    if (now - d->rate_deficit_ns < settle_ns)
+        return;
+
+    if (lost > d->rate_deficit)
+        lost = d->rate_deficit;
+    d->rate_short = false;
+    stats_block(d->stats, lost, true);
+    stats_rate_gap(d->stats, lost);
+    d->sample_counter += lost;
+    d->pending_lost += lost;
+    d->pending_lost_rate = 1;
+    if (verbose)
+        fprintf(stderr, "Device %s: %llu samples short of the sample rate\n",
+                d->path, (unsigned long long)lost);
+    d->rate_ns = now;
+    d->rate_samples = d->sample_counter + n;
+}
+
 static void transfer_callback(struct libusb_transfer *transfer) {
-    int size = 0;
-    int ret = 0;
+    uint64_t start = stats_now_ns();
+    struct device *d = transfer->user_data;
+    struct ring_slot *slot;
 
-    xfers_in_progress--;
+    d->xfers_in_progress--;
 
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        failure_count++;
+        stats_transfer(d->stats, transfer->status, 0);
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+            device_lost(d, "is gone");
+        // Cancelled transfers at shutdown are not a gap in the stream.
+        // Whatever arrived in a failed transfer is discarded, but still
+        // counted so that sample indices stay true.
+        if (!stop_transfers) {
+            uint64_t n = transfer->actual_length / sizeof(int16_t);
+            stats_block(d->stats, n, true);
+            d->sample_counter += n;
+            d->pending_lost += n;
+            d->pending_lost_usb = 1;
+        }
         fprintf(stderr, "Transfer callback status %s received %d \
 	   bytes.\n",
                 libusb_error_name(transfer->status), transfer->actual_length);
     } else {
-        size = transfer->actual_length;
-        success_count++;
-        uint16_t *samples = (uint16_t *)transfer->buffer;
-        if (randomizer) {
-            for (int i = 0; i < size / 2; i++) {
-                samples[i] ^= 0xfffe * (samples[i] & 1);
-            }
+        stats_transfer(d->stats, transfer->status, transfer->actual_length);
+        if (transfer->actual_length < transfer->length)
+            stats_short(d->stats);
+        rate_check(d, transfer->actual_length / sizeof(int16_t));
+        // Only hand the data off here; everything that can block or burn
+        // CPU runs on the writer thread so the transfer goes straight back.
+        // The filled buffer moves into the ring and the slot's spare buffer
+        // is resubmitted in its place. If the ring is full the data is
+        // dropped and the same buffer is reused.
+        slot = ring_reserve(&d->ring);
+        if (slot != NULL) {
+            unsigned char *spare = slot->buf;
+            slot->buf = transfer->buffer;
+            slot->len = transfer->actual_length;
+            slot->timestamp_ns = now_ns();
+            slot->completed_ns = stats_raw_ns();
+            slot->sample_index = d->sample_counter;
+            slot->lost = d->pending_lost;
+            slot->lost_usb = d->pending_lost_usb;
+            slot->lost_rate = d->pending_lost_rate;
+            slot->restarted = d->pending_restart;
+            ring_commit(&d->ring);
+            transfer->buffer = spare;
+            d->pending_lost = 0;
+            d->pending_lost_usb = 0;
+            d->pending_lost_rate = 0;
+            d->pending_restart = 0;
+        } else {
+            d->pending_lost += transfer->actual_length / sizeof(int16_t);
+        }
+        d->sample_counter += transfer->actual_length / sizeof(int16_t);
+        stats_block(d->stats, transfer->actual_length / sizeof(int16_t),
+                    slot == NULL);
+    }
+    if (stop_transfers || atomic_load(&d->state) != DEV_STREAMING)
+        ; // left to drain
+    else if (autotune_mb > 0)
+        autotune(d, transfer, start);
+    else
+        resubmit(d, transfer);
+    atomic_store_explicit(&d->sample_now, d->sample_counter,
+                          memory_order_relaxed);
+    stats_hist_add(&d->stats->callback, stats_now_ns() - start);
+}
+
+// Writes metadata records for the settings changes that are in effect from
+// the block at info on, which starts at offset in the output.
+static void control_events(struct device *d, const struct block_info *info,
+                           uint64_t offset) {
+    unsigned int kept = 0;
+
+    pthread_mutex_lock(&d->events_lock);
+    for (unsigned int i = 0; i < d->nevents; i++) {
+        struct control_event *e = &d->events[i];
+        if (e->sample > info->sample_index) {
+            d->events[kept++] = *e;
+            continue;
+        }
+        meta_record(&d->meta, "control", info->sample_index, offset,
+                    ",\"setting\":\"%s\",\"value\":%u", e->setting,
+                    e->value);
+    }
+    d->nevents = kept;
+    atomic_store(&d->events_pending, kept);
+    pthread_mutex_unlock(&d->events_lock);
+}
+
+// Checks the transfer behind info for a trigger, before its output goes
+// to the trigger sink: an external request, or a mean power at the
+// threshold. The power is a single pass over the raw samples.
+static void trigger_check(struct device *d, const struct ring_slot *slot,
+                          const struct block_info *info) {
+    struct trigger_event ev;
+    size_t n = slot->len / sizeof(uint16_t);
+    bool fire = false;
+
+    if (atomic_load_explicit(&d->trigger_requests, memory_order_relaxed))
+        fire = atomic_exchange(&d->trigger_requests, 0) > 0;
+    if (trigger_power && n > 0 &&
+        (double)kernels->power((const uint16_t *)slot->buf, n, randomizer) >=
+            trigger_level * n)
+        fire = true;
+    if (!fire || !trigger_sink_fire(d->sink, &ev))
+        return;
+    fprintf(stderr, "Trigger %s: event %u at sample %llu, from sample %llu\n",
+            d->path, ev.number, (unsigned long long)info->sample_index,
+            (unsigned long long)ev.sample_index);
+    meta_record(&d->meta, "trigger", info->sample_index, d->sink->bytes,
+                ",\"event\":%u,\"start_sample\":%llu,\"start_offset\":%llu",
+                ev.number, (unsigned long long)ev.sample_index,
+                (unsigned long long)ev.offset);
+}
+
+// Writes filler in place of the samples lost before the block at info,
+// through the pipeline like any other data, so that the output keeps one
+// sample per sample period and the DSP state moves on as it would have.
+// Zeros are silence. Markers are the most negative sample (-32768, and
+// the same extreme in s12, s8 and f32), which the ADC only gives when
+// clipping; they come out as such without -i and -D.
+static void fill_gap(struct device *d, const struct block_info *info) {
+    const uint16_t value = fill == FILL_MARKER ? 0x8000 : 0;
+    const size_t chunk = reqsize * d->pktsize / sizeof(uint16_t);
+    struct block_info fi = {
+        .timestamp_ns = info->timestamp_ns,
+        .sample_index = info->sample_index - info->lost,
+    };
+    uint64_t left = info->lost;
+    const unsigned char *out;
+    size_t outlen;
+
+    while (left > 0) {
+        size_t n = left < chunk ? left : chunk;
+
+        // The pipeline works in place, so every chunk starts over
+        for (size_t i = 0; i < n; i++)
+            d->fill_buf[i] = value;
+        outlen = pipeline_process(&d->pl, (unsigned char *)d->fill_buf,
+                                  n * sizeof(uint16_t), &fi, &out);
+        if (outlen > 0 && sink_write(d->sink, out, outlen, &fi) != 0) {
+            fprintf(stderr, "Error writing to %s: %s\n", d->output,
+                    strerror(errno));
+            break;
+        }
+        stats_fill(d->stats, n);
+        left -= n;
+        fi.sample_index += n;
+    }
+}
+
+// Drains the device's ring to its sink until writer_stop is set and the
+// ring is empty.
+static void *writer_thread(void *arg) {
+    struct device *d = arg;
+    struct ring_slot *slot;
+    struct block_info info;
+    const unsigned char *out;
+    size_t outlen;
+    uint64_t start;
+    bool ok;
+
+    while (1) {
+        slot = ring_peek(&d->ring);
+        if (slot == NULL) {
+            if (atomic_load(&d->writer_stop))
+                break;
+            ring_wait(&d->ring, 100);
+            continue;
         }
-        ret = write(1, transfer->buffer, transfer->actual_length);
-        if (ret < 0) {
-            fprintf(stderr, "Error writing to stdout: %s", strerror(errno));
+        start = stats_now_ns();
+        info.timestamp_ns = slot->timestamp_ns;
+        info.sample_index = slot->sample_index;
+        info.lost = slot->lost;
+        info.lost_usb = slot->lost_usb;
+        info.lost_rate = slot->lost_rate;
+        info.restarted = slot->restarted;
+        // Before the records, so that their offsets are the block's
+        if (fill != FILL_NONE && info.lost > 0)
+            fill_gap(d, &info);
+        meta_block(&d->meta, &info, d->sink->bytes);
+        capture_block(&d->capture, &info, d->sink->bytes);
+        if (atomic_load_explicit(&d->events_pending, memory_order_relaxed))
+            control_events(d, &info, d->sink->bytes);
+        if (trigger_spec != NULL)
+            trigger_check(d, slot, &info);
+        outlen = pipeline_process(&d->pl, slot->buf, slot->len, &info, &out);
+        ok = outlen == 0 || sink_write(d->sink, out, outlen, &info) == 0;
+        if (!ok) {
+            fprintf(stderr, "Error writing to %s: %s\n", d->output,
+                    strerror(errno));
         }
+        stats_write(d->stats, outlen, ok, stats_now_ns() - start);
+        if (ok)
+            stats_hist_add(&d->stats->latency,
+                           stats_raw_ns() - slot->completed_ns);
+        ring_release(&d->ring);
     }
-    if (!stop_transfers) {
-        if (libusb_submit_transfer(transfer) == 0)
-            xfers_in_progress++;
+    // Only the end of the stream pads a half s12 pair
+    outlen = pipeline_flush(&d->pl, &out);
+    if (outlen > 0 && sink_write(d->sink, out, outlen, NULL) != 0)
+        fprintf(stderr, "Error writing to %s: %s\n", d->output,
+                strerror(errno));
+    return NULL;
+}
+
+// Runs libusb event handling, and so every transfer_callback of every
+// device, with the timing guarantees set up in main. Wakes up periodically
+// to notice event_stop.
+static void *event_thread(void *arg) {
+    struct timeval tv = {0, 100000};
+
+    (void)arg;
+    while (!atomic_load(&event_stop))
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    return NULL;
+}
+
+// Buffers are page aligned either way (usbfs memory is mmapped), for a
+// consumer that could write them out with O_DIRECT as they are. The record
+// sink does not: a ring slot is reused as soon as the writer releases it,
+// and the pipeline often packs a block in place to an unaligned length, so
+// it copies into chunks of its own.
+static unsigned char *pool_alloc(struct device *d, size_t len) {
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (d->pool_devmem)
+        return libusb_dev_mem_alloc(d->handle, len);
+#endif
+    // The arena page aligns allocations of a page or more
+    size_t page = sysconf(_SC_PAGESIZE);
+    return arena_alloc(&d->arena, (len + page - 1) & ~(page - 1));
+}
+
+static void pool_free(struct device *d, unsigned char *buf, size_t len) {
+    if (buf == NULL)
+        return;
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (d->pool_devmem) {
+        libusb_dev_mem_free(d->pool_handle, buf, len);
+        return;
+    }
+#endif
+    arena_free(&d->arena, buf);
+}
+
+// The buffer pool is the queuedepth transfer buffers followed by one spare
+// per ring slot.
+static unsigned char **pool_entry(struct device *d, unsigned int n) {
+    if (n < queuedepth)
+        return &d->databuffers[n];
+    return &d->ring.slots[n - queuedepth].buf;
+}
+
+// Allocates the whole buffer pool. Buffers are mapped from usbfs when the
+// platform supports it, so the kernel DMAs straight into them instead of
+// copying every URB. All buffers rotate through the transfers, so if any
+// of them cannot be device memory (e.g. the usbfs memory limit is hit),
+// all of them fall back to the arena.
+static int alloc_buffer_pool(struct device *d, size_t bufsize) {
+    unsigned int total = queuedepth + d->ring.size;
+    unsigned int n;
+
+#if LIBUSB_API_VERSION >= 0x01000105
+    d->pool_devmem = d->sim == NULL;
+#endif
+    while (1) {
+        // One mapping for the lot, so that they share huge pages
+        if (!d->pool_devmem)
+            arena_reserve(&d->arena, (size_t)total * bufsize);
+        for (n = 0; n < total; n++) {
+            unsigned char **entry = pool_entry(d, n);
+            *entry = pool_alloc(d, bufsize);
+            if (*entry == NULL)
+                break;
+        }
+        if (n == total)
+            return 0;
+        while (n-- > 0) {
+            unsigned char **entry = pool_entry(d, n);
+            pool_free(d, *entry, bufsize);
+            *entry = NULL;
+        }
+        if (!d->pool_devmem)
+            return -1;
+        d->pool_devmem = false;
     }
 }
 
 // Function to free data buffers and transfer structures
-static void free_transfer_buffers(unsigned char **databuffers,
-                                  struct libusb_transfer **transfers) {
-    // Free up any allocated data buffers
-    if (databuffers != NULL) {
+static void free_transfer_buffers(struct device *d) {
+    // Free up any allocated data buffers. Buffers rotate between transfers
+    // and the ring, so free whatever each transfer holds now.
+    if (d->databuffers != NULL) {
         for (unsigned int i = 0; i < queuedepth; i++) {
-            if (databuffers[i] != NULL) {
-                free(databuffers[i]);
+            if (d->transfers != NULL && d->transfers[i] != NULL &&
+                d->transfers[i]->buffer != NULL) {
+                d->databuffers[i] = d->transfers[i]->buffer;
             }
-            databuffers[i] = NULL;
+            pool_free(d, d->databuffers[i], reqsize * d->pktsize);
+            d->databuffers[i] = NULL;
         }
-        free(databuffers);
+        free(d->databuffers);
+        d->databuffers = NULL;
     }
 
     // Free up any allocated transfer structures
-    if (transfers != NULL) {
+    if (d->transfers != NULL) {
         for (unsigned int i = 0; i < queuedepth; i++) {
-            if (transfers[i] != NULL) {
-                libusb_free_transfer(transfers[i]);
+            if (d->transfers[i] != NULL) {
+                libusb_free_transfer(d->transfers[i]);
             }
-            transfers[i] = NULL;
+            d->transfers[i] = NULL;
+        }
+        free(d->transfers);
+        d->transfers = NULL;
+    }
+}
+
+static void free_ring_buffers(struct device *d) {
+    if (d->ring.slots == NULL)
+        return;
+    for (unsigned int i = 0; i < d->ring.size; i++) {
+        pool_free(d, d->ring.slots[i].buf, reqsize * d->pktsize);
+        d->ring.slots[i].buf = NULL;
+    }
+    ring_free(&d->ring);
+}
+
+// Copies an output spec with every %D replaced by the device number, so
+// that one spec serves several devices, e.g. record:/data/rx%D.raw
+static char *expand_spec(const char *spec, unsigned int index) {
+    size_t len = strlen(spec) + 1;
+    char *out, *p;
+
+    for (const char *s = strstr(spec, "%D"); s != NULL; s = strstr(s + 2, "%D"))
+        len += 8;
+    out = malloc(len);
+    if (out == NULL)
+        return NULL;
+    p = out;
+    while (*spec != '\0') {
+        if (spec[0] == '%' && spec[1] == 'D') {
+            p += sprintf(p, "%u", index);
+            spec += 2;
+        } else {
+            *p++ = *spec++;
         }
-        free(transfers);
     }
+    *p = '\0';
+    return out;
+}
+
+// Physical location as in sysfs, e.g. 2-1.4. It is stable across firmware
+// uploads and reboots, unlike the device address.
+static void usb_path(libusb_device *dev, char *buf, size_t len) {
+    uint8_t ports[8];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    size_t off = snprintf(buf, len, "%u", libusb_get_bus_number(dev));
+
+    for (int i = 0; i < n && off < len; i++)
+        off += snprintf(buf + off, len - off, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+// Whether an opened device is the one a --device argument asks for: a
+// bus-port path, or sn:SERIAL for the serial number string.
+static bool device_matches(libusb_device_handle *handle, const char *select) {
+    libusb_device *dev = libusb_get_device(handle);
+    struct libusb_device_descriptor desc;
+    unsigned char serial[128];
+    char path[32];
+
+    if (select == NULL || strcmp(select, "all") == 0)
+        return true;
+    if (strncmp(select, "sn:", 3) == 0) {
+        if (libusb_get_device_descriptor(dev, &desc) != 0 ||
+            desc.iSerialNumber == 0)
+            return false;
+        if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                               serial, sizeof(serial)) < 0)
+            return false;
+        return strcmp((char *)serial, select + 3) == 0;
+    }
+    usb_path(dev, path, sizeof(path));
+    return strcmp(path, select) == 0;
+}
+
+static bool device_taken(libusb_device *dev) {
+    for (unsigned int i = 0; i < ndevices; i++) {
+        if (devices[i].handle != NULL &&
+            libusb_get_device(devices[i].handle) == dev)
+            return true;
+    }
+    return false;
+}
+
+// Loads the firmware into every FX3 in bootloader mode that one of the
+// selections could refer to. Only a path says which one before the upload,
+// so without one all of them get it. Returns the number updated.
+static unsigned int upload_firmware(const struct fx3_image *img,
+                                    const char **selects, unsigned int nselect) {
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(usb_ctx, &list);
+    unsigned int updated = 0;
+    bool any = nselect == 0;
+
+    for (unsigned int s = 0; s < nselect; s++) {
+        if (strcmp(selects[s], "all") == 0 || strncmp(selects[s], "sn:", 3) == 0)
+            any = true;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *handle;
+        char path[32];
+        bool wanted = any;
+
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != 0x04b4 || desc.idProduct != 0x00f3)
+            continue;
+        usb_path(list[i], path, sizeof(path));
+        for (unsigned int s = 0; s < nselect; s++) {
+            if (strcmp(selects[s], path) == 0)
+                wanted = true;
+        }
+        if (!wanted || libusb_open(list[i], &handle) != 0)
+            continue;
+        if (fx3_image_load(handle, img) == 0) {
+            fprintf(stderr, "Firmware updated on %s\n", path);
+            updated++;
+        } else {
+            fprintf(stderr,
+                    "Firmware upload failed for "
+                    "device %d.%d (logical).\n",
+                    libusb_get_bus_number(list[i]),
+                    libusb_get_device_address(list[i]));
+        }
+        libusb_close(handle);
+        // Same as before: without a selection only the first one
+        if (nselect == 0)
+            break;
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    return updated;
+}
+
+// Number of streaming devices that are there and can be opened. Right
+// after enumeration udev may not have set the permissions yet.
+static unsigned int count_devices(void) {
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(usb_ctx, &list);
+    unsigned int count = 0;
+
+    for (ssize_t i = 0; i < n; i++) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *handle;
+
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != 0x04b4 || desc.idProduct != 0x00f1)
+            continue;
+        if (libusb_open(list[i], &handle) == 0) {
+            libusb_close(handle);
+            count++;
+        }
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    return count;
+}
+
+// Polls for freshly booted devices to come back with the streaming PID,
+// which takes well under the fixed 2 s that used to be slept.
+static void wait_for_devices(unsigned int want) {
+    uint64_t start = stats_now_ns();
+    uint64_t deadline = start + 5000000000ULL;
+
+    while (count_devices() < want) {
+        if (stats_now_ns() > deadline) {
+            fprintf(stderr, "Timed out waiting for %u devices to "
+                            "re-enumerate\n", want);
+            return;
+        }
+        usleep(20000);
+    }
+    if (verbose)
+        fprintf(stderr, "Devices re-enumerated after %.0f ms\n",
+                (stats_now_ns() - start) / 1e6);
+}
+
+// Opens the streaming devices for a selection. "all" takes every one not
+// taken yet, anything else the first match. Returns the number opened.
+static unsigned int open_devices(const char *select) {
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(usb_ctx, &list);
+    unsigned int opened = 0;
+
+    for (ssize_t i = 0; i < n && ndevices < MAX_DEVICES; i++) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *handle;
+
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != 0x04b4 || desc.idProduct != 0x00f1 ||
+            device_taken(list[i]))
+            continue;
+        if (libusb_open(list[i], &handle) != 0)
+            continue;
+        if (!device_matches(handle, select)) {
+            libusb_close(handle);
+            continue;
+        }
+        struct device *d = &devices[ndevices];
+        d->index = ndevices;
+        d->select = select;
+        d->handle = handle;
+        d->pool_handle = handle;
+        d->stats = &device_stats[ndevices];
+        pthread_mutex_init(&d->events_lock, NULL);
+        usb_path(list[i], d->path, sizeof(d->path));
+        ndevices++;
+        opened++;
+        if (select == NULL || strcmp(select, "all") != 0)
+            break;
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    return opened;
+}
+
+// Sets up a device for each --simulate source. Returns the number opened,
+// 0 if any of them fails.
+static unsigned int open_sims(void) {
+    for (unsigned int i = 0; i < nsims; i++) {
+        struct device *d = &devices[ndevices];
+
+        if (sim_open(&sims[i], sim_sources[i], sim_unpaced ? 0 : samplerate,
+                     randomizer, kernels, samplerate) != 0)
+            return 0;
+        d->index = ndevices;
+        d->sim = &sims[i];
+        d->stats = &device_stats[ndevices];
+        pthread_mutex_init(&d->events_lock, NULL);
+        snprintf(d->path, sizeof(d->path), "sim%u", i);
+        ndevices++;
+    }
+    return nsims;
+}
+
+// Claims the streaming interface and reads the endpoint's transfer unit.
+static int device_claim(struct device *d) {
+    struct libusb_endpoint_descriptor const *endpointDesc;
+    struct libusb_ss_endpoint_companion_descriptor *ep_comp;
+    struct libusb_interface_descriptor const *interfaceDesc;
+    int ret;
+
+    if (d->sim != NULL) {
+        d->pktsize = SIM_PKTSIZE;
+        return 0;
+    }
+
+    ret = libusb_kernel_driver_active(d->handle, 0);
+    if (ret != 0) {
+        fprintf(stderr,
+                "Kernel driver active. Trying to detach kernel driver\n");
+        ret = libusb_detach_kernel_driver(d->handle, 0);
+        if (ret != 0) {
+            fprintf(stderr,
+                    "Could not detach kernel driver from an interface\n");
+            return -1;
+        }
+    }
+
+    libusb_get_config_descriptor(libusb_get_device(d->handle), 0, &d->config);
+
+    ret = libusb_claim_interface(d->handle, interface_number);
+    if (ret != 0) {
+        fprintf(stderr, "Error claiming interface on %s\n", d->path);
+        return -1;
+    }
+    d->claimed = true;
+
+    fprintf(stderr, "Successfully claimed interface on %s\n", d->path);
+
+    interfaceDesc = &(d->config->interface[0].altsetting[0]);
+
+    endpointDesc = &interfaceDesc->endpoint[0];
+
+    // There is no companion descriptor, and so no bursts, below SuperSpeed
+    if (libusb_get_ss_endpoint_companion_descriptor(usb_ctx, endpointDesc,
+                                                    &ep_comp) != 0) {
+        d->pktsize = endpointDesc->wMaxPacketSize;
+        return 0;
+    }
+
+    d->pktsize = endpointDesc->wMaxPacketSize * (ep_comp->bMaxBurst + 1);
+
+    libusb_free_ss_endpoint_companion_descriptor(ep_comp);
+    return 0;
+}
+
+// Allocates transfers and buffers and opens the output side: sink,
+// processing, metadata and the writer thread.
+static int device_setup(struct device *d, unsigned int start_depth,
+                        unsigned int start_size) {
+    bool allocfail = false;
+
+    d->gain = gain;
+    d->att = att;
+    d->gpio = (dither ? DITH : 0) | (randomizer ? RANDO : 0);
+    arena_init(&d->arena, d->sim != NULL
+                              ? -1
+                              : arena_usb_node(libusb_get_bus_number(
+                                    libusb_get_device(d->handle))));
+
+    if (autotune_mb > 0)
+        tune_init(&d->tuner, start_depth, queuedepth, start_size, reqsize,
+                  d->pktsize, samplerate * 2.0);
+
+    d->databuffers = (u_char **)calloc(queuedepth, sizeof(u_char *));
+
+    d->transfers = (struct libusb_transfer **)calloc(
+        queuedepth, sizeof(struct libusb_transfer *));
+
+    if ((d->databuffers != NULL) && (d->transfers != NULL)) {
+        for (unsigned int i = 0; i < queuedepth; i++) {
+            d->transfers[i] = libusb_alloc_transfer(0);
+            if (d->transfers[i] == NULL) {
+                allocfail = true;
+                break;
+            }
+        }
+
+    } else {
+        allocfail = true;
+    }
+
+    if (!allocfail && (ring_init(&d->ring, ringsize) != 0 ||
+                       alloc_buffer_pool(d, reqsize * d->pktsize) != 0)) {
+        allocfail = true;
+    }
+
+    if (capture_base != NULL) {
+        char *base = expand_spec(capture_base, d->index);
+
+        d->output = base != NULL ? malloc(strlen(base) + 12) : NULL;
+        if (d->output != NULL)
+            sprintf(d->output, "%s.sigmf-data", base);
+        free(base);
+    } else {
+        d->output = expand_spec(trigger_spec != NULL  ? trigger_spec
+                                : record_path != NULL ? record_path
+                                                      : output_spec,
+                                d->index);
+    }
+    d->channel_out = expand_spec(channel_out, d->index);
+    if (meta_spec != NULL)
+        d->meta_spec = expand_spec(meta_spec, d->index);
+    if (allocfail || d->output == NULL || d->channel_out == NULL ||
+        (meta_spec != NULL && d->meta_spec == NULL)) {
+        fprintf(stderr, "Failed to allocate buffers and transfers\n");
+        return -1;
+    }
+
+    fprintf(stderr, "Buffer pool %s: %u in flight + %u spare, %zu bytes, %s\n",
+            d->path, queuedepth, d->ring.size,
+            (size_t)(queuedepth + d->ring.size) * reqsize * d->pktsize,
+            d->pool_devmem ? "usbfs zero-copy" : "arena");
+
+    struct pipeline_config plcfg = {
+        .randomizer = randomizer,
+        .iq = iq,
+        .decimate = decimate,
+        .format = format,
+        .shift = shift,
+        .max_bytes = reqsize * d->pktsize,
+        .kernels = kernels,
+        .channels = channels,
+        .channel_threads = channel_threads,
+        .channel_out = d->channel_out,
+        .worker_cpus = &worker_cpus,
+        .spectrum = spectrum,
+        .spectrum_avg = spectrum_avg,
+        .arena = &d->arena,
+    };
+    if (capture_base != NULL) {
+        d->sink = record_sink_open(d->output, 0, 0);
+    } else if (trigger_spec != NULL) {
+        // Output bytes per second; complex output has as many numbers
+        double rate = format_bytes(format, samplerate / decimate);
+
+        d->sink = trigger_sink_open(d->output, trigger_pre * rate,
+                                    trigger_post * rate);
+    } else if (record_path != NULL) {
+        d->sink = record_sink_open(d->output,
+                                   (uint64_t)rotate_mb * 1024 * 1024,
+                                   rotate_sec);
+    } else {
+        d->sink = sink_open(d->output);
+    }
+    if (d->sink == NULL)
+        return -1;
+    if (pipeline_init(&d->pl, &plcfg) != 0) {
+        fprintf(stderr, "Failed to set up output processing\n");
+        return -1;
+    }
+    d->pl_ready = true;
+    if (fill != FILL_NONE) {
+        d->fill_buf = arena_alloc(&d->arena, reqsize * d->pktsize);
+        if (d->fill_buf == NULL) {
+            fprintf(stderr, "Failed to allocate buffers and transfers\n");
+            return -1;
+        }
+    }
+    if (d->arena.bytes > 0)
+        fprintf(stderr,
+                "Arena %s: %zu MB on NUMA node %d, %zu MB from the huge page "
+                "pool%s\n",
+                d->path, d->arena.bytes >> 20, d->arena.node,
+                d->arena.hugetlb >> 20,
+                d->arena.unlocked ? ", not locked (RLIMIT_MEMLOCK)" : "");
+
+    if (d->meta_spec != NULL) {
+        if (meta_open(&d->meta, d->meta_spec, meta_interval) != 0)
+            return -1;
+        meta_record(&d->meta, "config", 0, 0,
+                    ",\"device\":%u,\"usb\":\"%s\",\"samplerate\":%u,"
+                    "\"gainmode\":\"%s\",\"gain\":%u,"
+                    "\"att\":%u,\"dither\":%s,\"randomizer\":%s,"
+                    "\"iq\":%s,\"decimate\":%u,\"format\":\"%s\","
+                    "\"shift\":%u,\"spectrum\":%u,\"average\":%u",
+                    d->index, d->path, samplerate,
+                    (gain & 0x80) ? "high" : "low", gain & 0x7f,
+                    att, dither ? "true" : "false",
+                    randomizer ? "true" : "false", iq ? "true" : "false",
+                    decimate, format_name(format), shift, spectrum,
+                    spectrum_avg);
+    }
+    if (capture_base != NULL) {
+        char hw[512];
+        struct capture_config ccfg = {
+            .samplerate = samplerate,
+            .ratio = decimate * (iq ? 2 : 1),
+            .format = format,
+            .iq = iq,
+            .hw = hw,
+        };
+
+        snprintf(hw, sizeof(hw),
+                 ",\n    \"rx888:usb\": \"%s\",\n    \"rx888:samplerate\": %u,"
+                 "\n    \"rx888:gainmode\": \"%s\",\n    \"rx888:gain\": %u,"
+                 "\n    \"rx888:att\": %u,\n    \"rx888:dither\": %s,"
+                 "\n    \"rx888:randomizer\": %s,\n    \"rx888:decimate\": %u",
+                 d->path, samplerate, (gain & 0x80) ? "high" : "low",
+                 gain & 0x7f, att, dither ? "true" : "false",
+                 randomizer ? "true" : "false", decimate);
+        char *base = expand_spec(capture_base, d->index);
+        int ret = base != NULL
+                      ? capture_open(&d->capture, base, &ccfg, meta_interval)
+                      : -1;
+        free(base);
+        if (ret != 0)
+            return -1;
+    }
+
+    if (pthread_create(&d->writer, NULL, writer_thread, d) != 0) {
+        fprintf(stderr, "Failed to start writer thread\n");
+        return -1;
+    }
+    d->writer_running = true;
+    // One writer per CPU of the list when there are several devices
+    rt_pin(d->writer, &writer_cpus, ndevices > 1 ? (int)d->index : -1);
+    return 0;
+}
+
+// Queues the device's transfers. The ADC is started separately so that
+// all devices start together.
+static void device_submit(struct device *d) {
+    d->rate_anchored = false;
+    for (unsigned int i = 0; i < queuedepth; i++) {
+        libusb_fill_bulk_transfer(d->transfers[i], d->handle, ep,
+                                  d->databuffers[i], reqsize * d->pktsize,
+                                  transfer_callback, d, 0);
+        d->parked[i] = false;
+        if (autotune_mb > 0) {
+            d->transfers[i]->length = d->tuner.size * d->pktsize;
+            if (i >= d->tuner.depth) {
+                d->parked[i] = true;
+                continue;
+            }
+        }
+        if (submit_transfer(d, d->transfers[i]) == 0)
+            d->xfers_in_progress++;
+    }
+}
+
+// Control requests in flight together, on one device or several. The
+// submitter holds a reference until batch_wait, so that requests which
+// complete early cannot finish the batch.
+struct command_batch {
+    atomic_uint pending;
+    atomic_uint failed;
+    int done; // for libusb_handle_events_timeout_completed
+};
+
+// A request of a batch. Requests may share one.
+struct command {
+    struct command_batch *batch;
+    struct device *d;
+    int status;      // of the last one to complete
+    uint64_t sample; // the device's sample counter at that point
+};
+
+static void batch_begin(struct command_batch *b) {
+    atomic_init(&b->pending, 1);
+    atomic_init(&b->failed, 0);
+    b->done = 0;
+}
+
+static void batch_release(struct command_batch *b) {
+    if (atomic_fetch_sub(&b->pending, 1) == 1)
+        b->done = 1;
+}
+
+static void command_done(int status, void *user_data) {
+    struct command *c = user_data;
+
+    c->status = status;
+    c->sample = atomic_load(&c->d->sample_now);
+    if (status != 0)
+        atomic_fetch_add(&c->batch->failed, 1);
+    batch_release(c->batch);
+}
+
+static void batch_submitted(struct command *c, int ret) {
+    if (ret == 0)
+        return;
+    c->status = ret;
+    atomic_fetch_add(&c->batch->failed, 1);
+    batch_release(c->batch);
+}
+
+static void batch_command(struct command_batch *b, struct command *c,
+                          struct device *d, enum FX3Command cmd,
+                          uint32_t data) {
+    c->batch = b;
+    c->d = d;
+    atomic_fetch_add(&b->pending, 1);
+    // A simulated device takes every setting at once
+    if (d->sim != NULL) {
+        command_done(0, c);
+        return;
+    }
+    batch_submitted(c, command_send_async(d->handle, cmd, data,
+                                          FX3_COMMAND_TIMEOUT, command_done,
+                                          c));
+}
+
+static void batch_argument(struct command_batch *b, struct command *c,
+                           struct device *d, enum ArgumentList arg,
+                           uint32_t data) {
+    c->batch = b;
+    c->d = d;
+    atomic_fetch_add(&b->pending, 1);
+    if (d->sim != NULL) {
+        command_done(0, c);
+        return;
+    }
+    batch_submitted(c, argument_send_async(d->handle, arg, data,
+                                           FX3_COMMAND_TIMEOUT, command_done,
+                                           c));
+}
+
+// Waits for every request of the batch, handling events if no other
+// thread does. Returns the number that failed.
+static unsigned int batch_wait(struct command_batch *b) {
+    struct timeval tv = {0, 100000};
+
+    batch_release(b);
+    while (!b->done)
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, &b->done);
+    return atomic_load(&b->failed);
+}
+
+// Sets up the front end and the ADC clock. Streaming begins with
+// device_start, separately so that several devices can start together.
+// The requests go out back to back and the device takes them in order.
+static void device_configure(struct device *d, struct command_batch *b,
+                             struct command *c) {
+    batch_command(b, c, d, GPIOFX3, d->gpio);
+    batch_argument(b, c, d, DAT31_ATT, d->att);
+    batch_argument(b, c, d, AD8340_VGA, d->gain);
+    batch_command(b, c, d, STARTADC, samplerate);
+}
+
+static void device_start(struct device *d, struct command_batch *b,
+                         struct command *c) {
+    batch_command(b, c, d, STARTFX3, 0);
+    batch_command(b, c, d, TUNERSTDBY, 0);
+}
+
+// The ADC clock is given this long to settle before streaming starts
+#define ADC_SETTLE_US 5000
+
+// Gives up the USB side of a lost device. The handle the buffer pool was
+// mapped from stays open until device_close, the buffers are still in use.
+static void device_release(struct device *d) {
+    if (d->claimed)
+        libusb_release_interface(d->handle, interface_number);
+    d->claimed = false;
+    if (d->config)
+        libusb_free_config_descriptor(d->config);
+    d->config = NULL;
+    if (d->handle != d->pool_handle)
+        libusb_close(d->handle);
+    d->handle = NULL;
+}
+
+// Picks a device up again on a new handle and restarts streaming. The next
+// block is marked as a discontinuity with the samples missed in between
+// estimated from the time it was gone.
+static int device_resume(struct device *d, libusb_device_handle *handle) {
+    unsigned int pktsize = d->pktsize;
+    uint64_t gone = stats_now_ns() - d->lost_ns;
+
+    d->handle = handle;
+    if (device_claim(d) != 0 || d->pktsize != pktsize) {
+        if (d->pktsize != pktsize)
+            fprintf(stderr, "Device %s came back with %u byte packets "
+                    "instead of %u, restart to use it\n", d->path,
+                    d->pktsize, pktsize);
+        d->pktsize = pktsize;
+        device_release(d);
+        return -1;
+    }
+
+    uint64_t lost = gone / 1000 * samplerate / 1000000;
+    d->sample_counter += lost;
+    d->pending_lost += lost;
+    d->pending_restart = 1;
+    atomic_store(&d->sample_now, d->sample_counter);
+    atomic_store(&d->state, DEV_STREAMING);
+    device_submit(d);
+
+    struct command_batch batch;
+    struct command c;
+    batch_begin(&batch);
+    device_configure(d, &batch, &c);
+    batch_wait(&batch);
+    usleep(ADC_SETTLE_US);
+    batch_begin(&batch);
+    device_start(d, &batch, &c);
+    batch_wait(&batch);
+    d->recoveries++;
+    fprintf(stderr, "Device %s recovered after %.1f s\n", d->path, gone / 1e9);
+    return 0;
+}
+
+// Whether a device on the bus could be the lost one: the same USB path,
+// or for sn:SERIAL selections the same serial anywhere.
+static bool device_is(struct device *d, libusb_device *dev,
+                      libusb_device_handle *handle) {
+    char path[32];
+
+    usb_path(dev, path, sizeof(path));
+    if (strcmp(path, d->path) == 0)
+        return true;
+    return handle != NULL && d->select != NULL &&
+           strncmp(d->select, "sn:", 3) == 0 && device_matches(handle, d->select);
+}
+
+// Runs the recovery state machine of every device, from the main loop.
+// img is used to boot devices that come back without firmware.
+static void recover_devices(const struct fx3_image *img) {
+    static unsigned int seen_arrivals;
+    static uint64_t next_scan;
+    uint64_t now = stats_now_ns();
+    bool waiting = false, scan = false;
+
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+
+        if (d->sim != NULL)
+            continue;
+        switch (atomic_load(&d->state)) {
+        case DEV_STREAMING:
+            // Every transfer failed and none could be resubmitted
+            if (d->xfers_in_progress == 0)
+                device_lost(d, "stopped streaming");
+            break;
+        case DEV_LOST:
+            if (d->xfers_in_progress != 0)
+                break;
+            device_release(d);
+            atomic_store(&d->state, DEV_WAITING);
+            scan = true;
+            // fall through
+        case DEV_WAITING:
+            waiting = true;
+            break;
+        }
+    }
+    if (!waiting)
+        return;
+    // Hotplug says when to look, otherwise poll
+    if (atomic_load(&usb_arrivals) != seen_arrivals)
+        scan = true;
+    if (now >= next_scan)
+        scan = true;
+    if (!scan)
+        return;
+    seen_arrivals = atomic_load(&usb_arrivals);
+    next_scan = now + (hotplug_on ? 1000000000ULL : 200000000ULL);
+
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(usb_ctx, &list);
+    for (ssize_t i = 0; i < n; i++) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *handle = NULL;
+
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != 0x04b4 ||
+            (desc.idProduct != 0x00f1 && desc.idProduct != 0x00f3) ||
+            device_taken(list[i]))
+            continue;
+        for (unsigned int k = 0; k < ndevices; k++) {
+            struct device *d = &devices[k];
+
+            if (atomic_load(&d->state) != DEV_WAITING)
+                continue;
+            if (desc.idProduct == 0x00f3) {
+                // Back in the bootloader, which only the path can tell
+                if (!device_is(d, list[i], NULL) || img == NULL ||
+                    now < d->boot_ns + 5000000000ULL)
+                    continue;
+                d->boot_ns = now;
+                if (libusb_open(list[i], &handle) != 0)
+                    break;
+                if (fx3_image_load(handle, img) == 0)
+                    fprintf(stderr, "Firmware reloaded on %s\n", d->path);
+                libusb_close(handle);
+                handle = NULL;
+                break;
+            }
+            if (handle == NULL && libusb_open(list[i], &handle) != 0)
+                break;
+            if (device_is(d, list[i], handle)) {
+                device_resume(d, handle); // keeps waiting on failure
+                handle = NULL;
+                break;
+            }
+        }
+        if (handle != NULL)
+            libusb_close(handle);
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+}
+
+// Notes devices going away and wakes recover_devices up for arrivals.
+// Runs inside libusb event handling.
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
+                                        libusb_device *dev,
+                                        libusb_hotplug_event event,
+                                        void *user_data) {
+    (void)ctx;
+    (void)user_data;
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        atomic_fetch_add(&usb_arrivals, 1);
+        return 0;
+    }
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+        if (atomic_load(&d->state) == DEV_STREAMING && d->handle != NULL &&
+            libusb_get_device(d->handle) == dev)
+            device_lost(d, "was unplugged");
+    }
+    return 0;
+}
+
+static const char *state_names[] = {"streaming", "lost", "waiting"};
+
+// Queues the request for one setting on a device.
+static void device_set(struct device *d, const char *setting,
+                       unsigned int value, struct command_batch *b,
+                       struct command *c) {
+    unsigned int gpio = d->gpio;
+
+    if (strcmp(setting, "gain") == 0) {
+        d->gain = (d->gain & 0x80) | value;
+        batch_argument(b, c, d, AD8340_VGA, d->gain);
+        return;
+    }
+    if (strcmp(setting, "gainmode") == 0) {
+        d->gain = (d->gain & 0x7f) | (value ? 0x80 : 0);
+        batch_argument(b, c, d, AD8340_VGA, d->gain);
+        return;
+    }
+    if (strcmp(setting, "att") == 0) {
+        d->att = value;
+        batch_argument(b, c, d, DAT31_ATT, d->att);
+        return;
+    }
+    if (strcmp(setting, "dither") == 0)
+        gpio = value ? gpio | DITH : gpio & ~DITH;
+    else if (strcmp(setting, "bias-hf") == 0)
+        gpio = value ? gpio | BIAS_HF : gpio & ~BIAS_HF;
+    else if (strcmp(setting, "bias-vhf") == 0)
+        gpio = value ? gpio | BIAS_VHF : gpio & ~BIAS_VHF;
+    else // gpio
+        gpio = value;
+    // The pipeline undoes the randomizer, so that bit is not up for change
+    d->gpio = (gpio & ~RANDO) | (d->gpio & RANDO);
+    batch_command(b, c, d, GPIOFX3, d->gpio);
+}
+
+static const char *const setting_names[] = {
+    "gain", "gainmode", "att", "dither", "bias-hf", "bias-vhf", "gpio",
+};
+
+// Parses a setting and its value, see control_command. *setting is set to
+// the name in setting_names. Returns -1 if either is invalid.
+static int parse_setting(const char *name, const char *arg,
+                         const char **setting, unsigned int *value) {
+    char *end;
+    unsigned long v;
+
+    *setting = NULL;
+    for (unsigned int i = 0;
+         i < sizeof(setting_names) / sizeof(setting_names[0]); i++) {
+        if (strcmp(name, setting_names[i]) == 0)
+            *setting = setting_names[i];
+    }
+    if (*setting == NULL)
+        return -1;
+
+    if (strcmp(name, "gainmode") == 0) {
+        if (strcmp(arg, "high") != 0 && strcmp(arg, "low") != 0)
+            return -1;
+        *value = strcmp(arg, "high") == 0;
+        return 0;
+    }
+    if (strcmp(name, "dither") == 0 || strcmp(name, "bias-hf") == 0 ||
+        strcmp(name, "bias-vhf") == 0) {
+        if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)
+            return -1;
+        *value = strcmp(arg, "on") == 0;
+        return 0;
+    }
+    v = strtoul(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0')
+        return -1;
+    if ((strcmp(name, "gain") == 0 && v <= 127) ||
+        (strcmp(name, "att") == 0 && v <= 63) ||
+        (strcmp(name, "gpio") == 0 && v <= 0xffffffff)) {
+        *value = v;
+        return 0;
+    }
+    return -1;
+}
+
+// Handles a line of the control channel: "SETTING VALUE [DEVICE]",
+// "trigger [DEVICE]" or "status". The reply names, per device, the first sample after the
+// change; the metadata channel gets a control record at that sample.
+static void control_command(char *line, char *reply, size_t len) {
+    char name[32], arg[32];
+    const char *setting;
+    unsigned int value;
+    int dev = -1, n;
+    size_t off;
+
+    n = sscanf(line, "%31s %31s %d", name, arg, &dev);
+    if (n >= 1 && strcmp(name, "status") == 0) {
+        off = 0;
+        pthread_mutex_lock(&control_lock);
+        for (unsigned int i = 0; i < ndevices && off < len; i++) {
+            struct device *d = &devices[i];
+            off += snprintf(reply + off, len - off,
+                            "dev=%u usb=%s state=%s sample=%llu gain=%u "
+                            "gainmode=%s att=%u gpio=0x%x\n",
+                            d->index, d->path,
+                            state_names[atomic_load(&d->state)],
+                            (unsigned long long)atomic_load(&d->sample_now),
+                            d->gain & 0x7f, (d->gain & 0x80) ? "high" : "low",
+                            d->att, d->gpio);
+        }
+        pthread_mutex_unlock(&control_lock);
+        return;
+    }
+    if (n >= 1 && strcmp(name, "trigger") == 0) {
+        dev = n >= 2 ? (int)strtol(arg, NULL, 10) : -1;
+        if (trigger_spec == NULL ||
+            (n >= 2 && (dev < 0 || (unsigned int)dev >= ndevices))) {
+            snprintf(reply, len, "error: %s\n",
+                     trigger_spec == NULL ? "not a triggered capture"
+                                          : "no such device");
+            return;
+        }
+        for (unsigned int i = 0; i < ndevices; i++)
+            if (dev < 0 || (unsigned int)dev == i)
+                atomic_fetch_add(&devices[i].trigger_requests, 1);
+        snprintf(reply, len, "ok\n");
+        return;
+    }
+    if (n < 2 || parse_setting(name, arg, &setting, &value) != 0 ||
+        (n == 3 && (dev < 0 || (unsigned int)dev >= ndevices))) {
+        snprintf(reply, len,
+                 "error: expected status, trigger, gain 0-127, gainmode high|low, "
+                 "att 0-63, dither|bias-hf|bias-vhf on|off or gpio VALUE, "
+                 "then optionally a device number\n");
+        return;
+    }
+
+    // All devices get the request at once, and the reply waits for all
+    struct command_batch batch;
+    struct command c[MAX_DEVICES];
+    batch_begin(&batch);
+    pthread_mutex_lock(&control_lock);
+    for (unsigned int i = 0; i < ndevices; i++) {
+        c[i].status = LIBUSB_ERROR_NO_DEVICE;
+        if ((dev < 0 || (unsigned int)dev == i) &&
+            atomic_load(&devices[i].state) == DEV_STREAMING)
+            device_set(&devices[i], setting, value, &batch, &c[i]);
+    }
+    batch_wait(&batch);
+
+    off = snprintf(reply, len, "ok");
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+        int ret = c[i].status;
+        uint64_t sample = c[i].sample;
+
+        if (dev >= 0 && (unsigned int)dev != i)
+            continue;
+        if (ret == 0 && d->meta.sink != NULL) {
+            pthread_mutex_lock(&d->events_lock);
+            if (d->nevents < CONTROL_EVENTS) {
+                struct control_event *e = &d->events[d->nevents++];
+                e->sample = sample;
+                e->setting = setting;
+                e->value = value;
+                atomic_store(&d->events_pending, d->nevents);
+            }
+            pthread_mutex_unlock(&d->events_lock);
+        }
+        if (off < len) {
+            if (ret == 0)
+                off += snprintf(reply + off, len - off, " dev=%u sample=%llu",
+                                i, (unsigned long long)sample);
+            else
+                off += snprintf(reply + off, len - off, " dev=%u failed", i);
+        }
+    }
+    pthread_mutex_unlock(&control_lock);
+    if (off < len)
+        snprintf(reply + off, len - off, "\n");
+}
+
+static int transfers_in_progress(void) {
+    int n = 0;
+
+    for (unsigned int i = 0; i < ndevices; i++)
+        n += devices[i].xfers_in_progress;
+    return n;
+}
+
+// Stops the writer once the transfers are done and frees everything the
+// device has, whatever state setup got it to.
+static void device_close(struct device *d) {
+    if (d->writer_running) {
+        atomic_store(&d->writer_stop, true);
+        ring_wake(&d->ring);
+        pthread_join(d->writer, NULL);
+        d->writer_running = false;
+    }
+    free_transfer_buffers(d);
+    free_ring_buffers(d);
+    if (d->pl_ready)
+        pipeline_free(&d->pl);
+    arena_free(&d->arena, d->fill_buf);
+    arena_destroy(&d->arena);
+    if (d->sink != NULL)
+        sink_close(d->sink);
+    if (d->meta.sink != NULL)
+        meta_close(&d->meta);
+    capture_close(&d->capture);
+    free(d->output);
+    free(d->channel_out);
+    free(d->meta_spec);
+    pthread_mutex_destroy(&d->events_lock);
+    if (d->claimed)
+        libusb_release_interface(d->handle, interface_number);
+    if (d->config)
+        libusb_free_config_descriptor(d->config);
+    if (d->handle && d->handle != d->pool_handle)
+        libusb_close(d->handle);
+    if (d->pool_handle)
+        libusb_close(d->pool_handle);
+    if (d->sim != NULL)
+        sim_close(d->sim);
+    memset(d, 0, sizeof(*d));
 }
 
 static void sig_stop(int signum) {
@@ -126,9 +1653,17 @@ static void sig_stop(int signum) {
     fprintf(stderr, "\nAbort. Stopping transfers\n");
     stop_transfers = true;
 }
+
+// Triggers every device; the writers pick it up with their next block
+static void sig_trigger(int signum) {
+    (void)signum;
+    for (unsigned int i = 0; i < ndevices; i++)
+        atomic_fetch_add(&devices[i].trigger_requests, 1);
+}
 void printhelp() {
     fprintf(stderr, " --verbose, -v      Verbose output\n");
-    fprintf(stderr, " --firmware, -f     Firmware file\n");
+    fprintf(stderr, " --firmware, -f     Firmware file, default the built-in one if there is\n");
+    fprintf(stderr, " --verify, -V       Read back the firmware after uploading it\n");
     fprintf(stderr, " --dither, -d       Enable dithering\n");
     fprintf(stderr, " --rand, -r         Enable output randomization\n");
     fprintf(stderr, " --samplerate, -s   Sample Rate, default 32000000\n");
@@ -137,13 +1672,72 @@ void printhelp() {
     fprintf(stderr, " --gain, -g         Gain value, default 3\n");
     fprintf(stderr, " --queuedepth, -q   Queue depth, default 16\n");
     fprintf(stderr, " --reqsize, -p      Packets per transfer request, default 8\n");
+    fprintf(stderr, " --ringsize, -b     Spare buffers in the output ring, default 128\n");
+    fprintf(stderr, " --iq, -i           Output complex samples at half the rate (fs/4 mix)\n");
+    fprintf(stderr, " --decimate, -D     Half-band decimation 1/2/4/.../64, default 1\n");
+    fprintf(stderr, " --format, -F       Output sample format s16/s12/s8/f32/cf32, default s16\n");
+    fprintf(stderr, "                    (s12 packs two samples in 3 bytes, cf32 implies -i)\n");
+    fprintf(stderr, " --shift, -H        Right shift of samples for s8, 0-15, default 8\n");
+    fprintf(stderr, " --output, -O       Output -, file:PATH, tcp:HOST:PORT, tcp::PORT,\n");
+    fprintf(stderr, "                    udp:ADDR:PORT[:LEN[:TTL]], shm:NAME[:MB],\n");
+    fprintf(stderr, "                    rice:PATH[:THREADS] (lossless compressed s16),\n");
+    fprintf(stderr, "                    default - (stdout)\n");
+    fprintf(stderr, " --record, -R       Record to a file with O_DIRECT/io_uring\n");
+    fprintf(stderr, " --capture, -G BASE SigMF capture to BASE.sigmf-data with BASE.sigmf-meta\n");
+    fprintf(stderr, "                    and a seek index BASE.sigmf-idx, instead of -O/-R\n");
+    fprintf(stderr, " --trigger, -x SPEC Triggered capture: keep the last seconds in memory and\n");
+    fprintf(stderr, "                    write events to SPEC (a sink, %%E is the event\n");
+    fprintf(stderr, "                    number) on SIGUSR2, a control trigger or -z, instead\n");
+    fprintf(stderr, "                    of -O/-R\n");
+    fprintf(stderr, " --threshold, -z    Also trigger on a transfer's mean power of N dBFS\n");
+    fprintf(stderr, " --window, -w       Seconds PRE[:POST] around a trigger, default 5:5\n");
+    fprintf(stderr, " --rotate-size, -S  Start a new recording file every N MB\n");
+    fprintf(stderr, " --rotate-time, -T  Start a new recording file every N seconds\n");
+    fprintf(stderr, " --duration, -n     Stop after N seconds, default run until stopped\n");
+    fprintf(stderr, " --fill, -Z         Write zero or marker (-32768) samples in place of lost\n");
+    fprintf(stderr, "                    ones, default none; markers stay so without -i and -D\n");
+    fprintf(stderr, " --stats, -P        Report throughput every N seconds, default on SIGUSR1 only\n");
+    fprintf(stderr, " --stats-json, -J   Also write reports as JSON lines to a file\n");
+    fprintf(stderr, " --event-thread, -E Handle USB events on a dedicated thread\n");
+    fprintf(stderr, " --event-cpus, -C   CPUs for the event thread, e.g. 2 or 2-3 (implies -E)\n");
+    fprintf(stderr, " --event-prio, -Q   SCHED_FIFO priority 1-99 for the event thread (implies -E)\n");
+    fprintf(stderr, " --writer-cpus, -W  CPUs for the writer thread\n");
+    fprintf(stderr, " --worker-cpus, -X  CPUs for the channelizer threads, one thread per CPU\n");
+    fprintf(stderr, " --mlock, -L        Lock all memory to avoid page faults\n");
+    fprintf(stderr, " --meta, -M         Write sample index/time/gap records as JSON lines to a sink\n");
+    fprintf(stderr, " --meta-interval, -I Milliseconds between time records, default 1000\n");
+    fprintf(stderr, " --low-latency, -l  One packet per transfer, 32 in flight, unless -p/-q say\n");
+    fprintf(stderr, "                    otherwise; see the latency line of --stats\n");
+    fprintf(stderr, " --autotune, -A     Tune queue depth and request size at runtime within N MB\n");
+    fprintf(stderr, "                    of buffers including the ring, starting from -q/-p\n");
+    fprintf(stderr, " --channels, -c     Split the complex output into N channels\n");
+    fprintf(stderr, " --channel-out, -o  Channel output, %%d is the channel, default channel%%02d.raw\n");
+    fprintf(stderr, " --channel-threads, -j Channelizer or spectrum threads, default one per CPU\n");
+    fprintf(stderr, " --spectrum, -N     Output averaged power spectra of N-point FFTs instead\n");
+    fprintf(stderr, "                    of samples, 50%% overlap, Hann window\n");
+    fprintf(stderr, " --average, -Y      FFTs averaged per spectrum frame, default 64\n");
+    fprintf(stderr, " --device, -U       Device by USB path BUS-PORT[.PORT...] or sn:SERIAL, or all;\n");
+    fprintf(stderr, "                    repeat for several, default the first found. Outputs\n");
+    fprintf(stderr, "                    then need %%D, which becomes the device number\n");
+    fprintf(stderr, " --control, -K      Take commands on stdin (-) or a Unix socket path while\n");
+    fprintf(stderr, "                    streaming: gain N, gainmode high|low, att N, dither,\n");
+    fprintf(stderr, "                    bias-hf, bias-vhf on|off, gpio N, each optionally\n");
+    fprintf(stderr, "                    followed by a device number; trigger [DEVICE]; status\n");
+    fprintf(stderr, " --simd, -k         SIMD kernels scalar/avx2/avx512/neon, default best\n");
+    fprintf(stderr, " --selftest, -t     Check all SIMD kernels against scalar and the rice\n");
+    fprintf(stderr, "                    coder against itself, and exit\n");
+    fprintf(stderr, " --decode, -y PATH  Decode a rice: recording to -O and exit\n");
+    fprintf(stderr, " --simulate, -e SRC Simulated device instead of hardware, repeatable:\n");
+    fprintf(stderr, "                    tone[:HZ], noise or a raw s16 file to replay\n");
+    fprintf(stderr, " --unpaced, -u      Simulate as fast as the pipeline goes, not at -s\n");
     fprintf(stderr, " --help, -h         Print this help\n");
 }
 int main(int argc, char **argv) {
 
-    unsigned int samplerate = 32000000;
-    unsigned int gain = 0x83;
-    unsigned int att = 0;
+    const char *simd = NULL;
+    const char *selects[MAX_DEVICES];
+    unsigned int nselect = 0;
+    bool queuedepth_set = false, reqsize_set = false;
     int c;
     while (1) {
         static struct option long_options[] = {
@@ -157,12 +1751,52 @@ int main(int argc, char **argv) {
             {"att", required_argument, 0, 'a'},
             {"queuedepth", required_argument, 0, 'q'},
             {"reqsize", required_argument, 0, 'p'},
+            {"ringsize", required_argument, 0, 'b'},
+            {"iq", no_argument, 0, 'i'},
+            {"decimate", required_argument, 0, 'D'},
+            {"format", required_argument, 0, 'F'},
+            {"shift", required_argument, 0, 'H'},
+            {"output", required_argument, 0, 'O'},
+            {"record", required_argument, 0, 'R'},
+            {"rotate-size", required_argument, 0, 'S'},
+            {"rotate-time", required_argument, 0, 'T'},
+            {"duration", required_argument, 0, 'n'},
+            {"capture", required_argument, 0, 'G'},
+            {"trigger", required_argument, 0, 'x'},
+            {"threshold", required_argument, 0, 'z'},
+            {"window", required_argument, 0, 'w'},
+            {"fill", required_argument, 0, 'Z'},
+            {"stats", required_argument, 0, 'P'},
+            {"stats-json", required_argument, 0, 'J'},
+            {"event-thread", no_argument, 0, 'E'},
+            {"event-cpus", required_argument, 0, 'C'},
+            {"event-prio", required_argument, 0, 'Q'},
+            {"writer-cpus", required_argument, 0, 'W'},
+            {"worker-cpus", required_argument, 0, 'X'},
+            {"mlock", no_argument, 0, 'L'},
+            {"meta", required_argument, 0, 'M'},
+            {"meta-interval", required_argument, 0, 'I'},
+            {"low-latency", no_argument, 0, 'l'},
+            {"autotune", required_argument, 0, 'A'},
+            {"channels", required_argument, 0, 'c'},
+            {"channel-out", required_argument, 0, 'o'},
+            {"channel-threads", required_argument, 0, 'j'},
+            {"spectrum", required_argument, 0, 'N'},
+            {"average", required_argument, 0, 'Y'},
+            {"device", required_argument, 0, 'U'},
+            {"verify", no_argument, 0, 'V'},
+            {"control", required_argument, 0, 'K'},
+            {"simd", required_argument, 0, 'k'},
+            {"selftest", no_argument, 0, 't'},
+            {"decode", required_argument, 0, 'y'},
+            {"simulate", required_argument, 0, 'e'},
+            {"unpaced", no_argument, 0, 'u'},
             {"help", no_argument, 0, 'h'},
             {0, 0, 0, 0}};
 
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "f:drs:hm:g:a:q:p:", long_options,
+        c = getopt_long(argc, argv, "f:drs:hm:g:a:q:p:b:iD:F:O:R:S:T:P:J:EC:Q:W:X:M:I:LlA:c:o:j:U:VK:k:tH:N:Y:e:un:G:x:z:w:Z:y:", long_options,
                         &option_index);
 
         if (c == -1)
@@ -236,6 +1870,7 @@ int main(int argc, char **argv) {
             }
             break;
         case 'q':
+            queuedepth_set = true;
             queuedepth = strtol(optarg, NULL, 10);
             if (queuedepth < 1 || queuedepth > 64) {
                 fprintf(stderr, "Invalid queue depth %d\n", queuedepth);
@@ -244,6 +1879,7 @@ int main(int argc, char **argv) {
             }
             break;
         case 'p':
+            reqsize_set = true;
             reqsize = strtol(optarg, NULL, 10);
             if (reqsize < 1 || reqsize > 64) {
                 fprintf(stderr, "Invalid request size %d\n", reqsize);
@@ -251,6 +1887,227 @@ int main(int argc, char **argv) {
                 return 0;
             }
             break;
+        case 'b':
+            ringsize = strtol(optarg, NULL, 10);
+            if (ringsize < 2 || ringsize > 65536) {
+                fprintf(stderr, "Invalid ring size %d\n", ringsize);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'D':
+            decimate = strtol(optarg, NULL, 10);
+            if (decimate < 1 || decimate > DECIMATE_MAX ||
+                (decimate & (decimate - 1)) != 0) {
+                fprintf(stderr, "Invalid decimation %d\n", decimate);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'i':
+            iq = 1;
+            break;
+        case 'F':
+            // Complex float is f32 of the complex stream
+            if (strcmp(optarg, "cf32") == 0) {
+                format = FORMAT_F32;
+                iq = 1;
+            } else if (format_parse(optarg, &format) != 0) {
+                fprintf(stderr, "Invalid format %s\n", optarg);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'H':
+            shift = strtol(optarg, NULL, 10);
+            if (shift > 15) {
+                fprintf(stderr, "Invalid shift %u\n", shift);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'O':
+            output_spec = optarg;
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'S':
+            rotate_mb = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            rotate_sec = strtol(optarg, NULL, 10);
+            break;
+        case 'G':
+            capture_base = optarg;
+            break;
+        case 'x':
+            trigger_spec = optarg;
+            break;
+        case 'z':
+            // Relative to a full scale square wave, whose mean power is
+            // 32768^2
+            trigger_power = true;
+            trigger_level = 32768.0 * 32768.0 * pow(10, atof(optarg) / 10);
+            break;
+        case 'w': {
+            char *end;
+
+            trigger_pre = trigger_post = strtod(optarg, &end);
+            if (*end == ':')
+                trigger_post = strtod(end + 1, &end);
+            if (*end != '\0' || trigger_pre < 0 || trigger_post <= 0) {
+                fprintf(stderr, "Invalid window %s\n", optarg);
+                printhelp();
+                return 0;
+            }
+            break;
+        }
+        case 'n':
+            duration = strtol(optarg, NULL, 10);
+            break;
+        case 'Z':
+            if (strcmp(optarg, "zero") == 0) {
+                fill = FILL_ZERO;
+            } else if (strcmp(optarg, "marker") == 0) {
+                fill = FILL_MARKER;
+            } else if (strcmp(optarg, "none") != 0) {
+                fprintf(stderr, "Invalid fill %s\n", optarg);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'P':
+            stats_interval = strtol(optarg, NULL, 10);
+            break;
+        case 'J':
+            stats_json = optarg;
+            break;
+        case 'E':
+            event_thread_on = true;
+            break;
+        case 'C':
+        case 'W':
+        case 'X':
+            if (rt_parse_cpus(optarg, c == 'C'   ? &event_cpus
+                                      : c == 'W' ? &writer_cpus
+                                                 : &worker_cpus) != 0) {
+                fprintf(stderr, "Invalid CPU list %s\n", optarg);
+                printhelp();
+                return 0;
+            }
+            if (c == 'C')
+                event_thread_on = true;
+            break;
+        case 'Q':
+            event_prio = strtol(optarg, NULL, 10);
+            if (event_prio < 1 || event_prio > 99) {
+                fprintf(stderr, "Invalid priority %d\n", event_prio);
+                printhelp();
+                return 0;
+            }
+            event_thread_on = true;
+            break;
+        case 'L':
+            lock_memory = true;
+            break;
+        case 'M':
+            meta_spec = optarg;
+            break;
+        case 'I':
+            meta_interval = strtol(optarg, NULL, 10);
+            if (meta_interval < 1) {
+                fprintf(stderr, "Invalid metadata interval %d\n",
+                        meta_interval);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'l':
+            low_latency = true;
+            break;
+        case 'A':
+            autotune_mb = strtol(optarg, NULL, 10);
+            if (autotune_mb < 1) {
+                fprintf(stderr, "Invalid autotune budget %d\n", autotune_mb);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'c':
+            channels = strtol(optarg, NULL, 10);
+            if (channels < 2 || channels > 4096 ||
+                (channels & (channels - 1)) != 0) {
+                fprintf(stderr, "Invalid channel count %d\n", channels);
+                printhelp();
+                return 0;
+            }
+            // The channelizer works on the complex stream
+            iq = 1;
+            break;
+        case 'o':
+            channel_out = optarg;
+            break;
+        case 'N':
+            spectrum = strtol(optarg, NULL, 10);
+            if (spectrum < 16 || spectrum > 65536 ||
+                (spectrum & (spectrum - 1)) != 0) {
+                fprintf(stderr, "Invalid spectrum size %d\n", spectrum);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'Y':
+            spectrum_avg = strtol(optarg, NULL, 10);
+            if (spectrum_avg < 1 || spectrum_avg > 1000000) {
+                fprintf(stderr, "Invalid average count %d\n", spectrum_avg);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'j':
+            channel_threads = strtol(optarg, NULL, 10);
+            if (channel_threads < 1 || channel_threads > 256) {
+                fprintf(stderr, "Invalid thread count %d\n", channel_threads);
+                printhelp();
+                return 0;
+            }
+            break;
+        case 'U':
+            if (nselect == MAX_DEVICES) {
+                fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                printhelp();
+                return 0;
+            }
+            selects[nselect++] = optarg;
+            break;
+        case 'V':
+            ezusb_verify = 1;
+            break;
+        case 'K':
+            control_spec = optarg;
+            break;
+        case 'k':
+            simd = optarg;
+            break;
+        case 't':
+            // All of them run, for every failure to be reported
+            return (convert_selftest() != 0) | (dsp_selftest() != 0) |
+                   (pipeline_selftest() != 0) | (rice_selftest() != 0);
+        case 'y':
+            decode_path = optarg;
+            break;
+        case 'e':
+            if (nsims == MAX_DEVICES) {
+                fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                printhelp();
+                return 0;
+            }
+            sim_sources[nsims++] = optarg;
+            break;
+        case 'u':
+            sim_unpaced = true;
+            break;
         case 'h':
         case '?':
             /* getopt_long already printed an error message. */
@@ -261,25 +2118,102 @@ int main(int argc, char **argv) {
         }
     }
 
-    fprintf(stderr, "Firmware: %s\n", firmware);
+    if (decode_path != NULL) {
+        int fd = open(decode_path, O_RDONLY);
+        struct sink *out;
+        int ret;
+
+        if (fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", decode_path,
+                    strerror(errno));
+            return 1;
+        }
+        out = sink_open(output_spec);
+        if (out == NULL) {
+            close(fd);
+            return 1;
+        }
+        ret = rice_decode(fd, out);
+        sink_close(out);
+        close(fd);
+        return ret == 0 ? 0 : 1;
+    }
+    if (channels > 0 && spectrum > 0) {
+        fprintf(stderr, "Channels and spectrum cannot be combined\n");
+        printhelp();
+        return 0;
+    }
+    if (capture_base != NULL &&
+        (record_path != NULL || channels > 0 || spectrum > 0 ||
+         capture_datatype(format, iq) == NULL)) {
+        fprintf(stderr, "A capture takes s16, s8 or f32 samples, and no "
+                        "--record, channels or spectrum\n");
+        printhelp();
+        return 0;
+    }
+    if ((trigger_spec != NULL &&
+         (capture_base != NULL || record_path != NULL || channels > 0 ||
+          spectrum > 0)) ||
+        (trigger_power && trigger_spec == NULL)) {
+        fprintf(stderr, "A triggered capture (--trigger) cannot be combined "
+                        "with --capture, --record, channels or spectrum, and "
+                        "--threshold needs one\n");
+        printhelp();
+        return 0;
+    }
+    if (channels > 0 && format != FORMAT_S16 && format != FORMAT_F32) {
+        fprintf(stderr, "Channels are written as s16 or f32 only\n");
+        printhelp();
+        return 0;
+    }
+
+    kernels = convert_select(simd);
+    if (kernels == NULL) {
+        fprintf(stderr, "SIMD variant %s is not available on this CPU\n", simd);
+        printhelp();
+        return 0;
+    }
+
+    // Latency is about one transfer's worth of samples, so make them as
+    // small as the endpoint allows and keep many queued to cover for it
+    if (low_latency) {
+        if (!reqsize_set)
+            reqsize = 1;
+        if (!queuedepth_set)
+            queuedepth = 32;
+        if (record_path != NULL)
+            fprintf(stderr, "Recording buffers 4 MB chunks, latency will be "
+                            "high\n");
+    }
+
+    size_t builtin_size;
+    if (firmware != NULL)
+        fprintf(stderr, "Firmware: %s\n", firmware);
+    else if (fx3_embedded_image(&builtin_size) != NULL)
+        fprintf(stderr, "Firmware: built in, %zu bytes\n", builtin_size);
+    else
+        fprintf(stderr, "Firmware: none\n");
     fprintf(stderr, "Sample Rate: %u\n", samplerate);
-    fprintf(stderr, "Output Randomizer %s, Dither: %s\n",
-            randomizer ? "On" : "Off", dither ? "On" : "Off");
+    fprintf(stderr, "Output Randomizer %s, Dither: %s, Kernels: %s\n",
+            randomizer ? "On" : "Off", dither ? "On" : "Off", kernels->name);
     fprintf(stderr, "Gain Mode: %s, Gain: %u, Att: %u\n",
             (gain & 0x80) ? "High" : "Low", gain & 0x7f, att);
-    /* code */
-    struct libusb_device_descriptor desc;
-    struct libusb_device *dev;
-    struct libusb_endpoint_descriptor const *endpointDesc;
-    struct libusb_ss_endpoint_companion_descriptor *ep_comp;
-    struct libusb_config_descriptor *config;
-    struct libusb_interface_descriptor const *interfaceDesc;
-    int ret;
-    int rStatus;
-
-    uint16_t vendor_id;  //= 0x04b4;
-    uint16_t product_id; // = 0x00f1;
-
+    fprintf(stderr, "Output: %s %s, Decimation: %u, Output Rate: %u\n",
+            iq ? "complex" : "real", format_name(format), decimate,
+            samplerate / (iq ? 2 : 1) / decimate);
+    if ((channels > 0 || spectrum > 0) && channel_threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        channel_threads = ncpu > 0 ? ncpu : 1;
+    }
+    if (channels > 0)
+        fprintf(stderr, "Channels: %u of %u Hz to %s, %u threads\n", channels,
+                samplerate / 2 / decimate / channels, channel_out,
+                channel_threads);
+    if (spectrum > 0)
+        fprintf(stderr, "Spectrum: %u points, %.1f Hz bins, %u averaged, "
+                        "%u threads\n",
+                spectrum, (double)samplerate / (iq ? 2 : 1) / decimate / spectrum,
+                spectrum_avg, channel_threads);
     struct sigaction sigact;
 
     sigact.sa_handler = sig_stop;
@@ -287,180 +2221,275 @@ int main(int argc, char **argv) {
     sigact.sa_flags = 0;
     (void)sigaction(SIGINT, &sigact, NULL);
     (void)sigaction(SIGTERM, &sigact, NULL);
+    if (trigger_spec != NULL) {
+        sigact.sa_handler = sig_trigger;
+        (void)sigaction(SIGUSR2, &sigact, NULL);
+    }
 
-    struct libusb_transfer **transfers = NULL; // List of transfer structures.
-    unsigned char **databuffers = NULL;        // List of data buffers.
-
-    ret = libusb_init(NULL);
+    int ret = libusb_init(&usb_ctx);
     if (ret != 0) {
         fprintf(stderr, "Error initializing libusb: %s\n",
                 libusb_error_name(ret));
         exit(1);
     }
 
-    if (firmware) { // there is argument with image file
-        vendor_id = 0x04b4;
-        product_id = 0x00f3;
-        // no firmware. upload the firmware
-        dev_handle =
-            libusb_open_device_with_vid_pid(NULL, vendor_id, product_id);
-        if (!dev_handle) {
-            goto has_firmware;
-        }
-
-        dev = libusb_get_device(dev_handle);
+    // The image is parsed and checked once, whatever the number of devices,
+    // then uploaded to all of them before waiting for the re-enumeration
+    struct fx3_image image;
+    size_t embedded_size;
+    const unsigned char *embedded = fx3_embedded_image(&embedded_size);
+    int image_ret = -1;
+    // Simulated devices stand in for the hardware, which is not looked for
+    if (nsims == 0 && firmware)
+        image_ret = fx3_image_open(&image, firmware);
+    else if (nsims == 0 && embedded != NULL)
+        image_ret = fx3_image_parse(&image, embedded, embedded_size);
+    if (image_ret == 0) {
+        unsigned int before = count_devices();
+        unsigned int updated = upload_firmware(&image, selects, nselect);
+        if (updated > 0)
+            wait_for_devices(before + updated);
+    } else if (firmware && nsims == 0) {
+        fprintf(stderr, "Could not load firmware %s\n", firmware);
+    }
 
-        if (ezusb_load_ram(dev_handle, firmware, FX_TYPE_FX3, IMG_TYPE_IMG,
-                           1) == 0) {
-            fprintf(stderr, "Firmware updated\n");
-        } else {
-            fprintf(stderr,
-                    "Firmware upload failed for "
-                    "device %d.%d (logical).\n",
-                    libusb_get_bus_number(dev), libusb_get_device_address(dev));
+    bool missing = false;
+    if (nsims > 0) {
+        if (open_sims() == 0)
+            goto close;
+    } else if (nselect == 0) {
+        open_devices(NULL);
+    }
+    for (unsigned int s = 0; s < nselect && nsims == 0; s++) {
+        if (open_devices(selects[s]) == 0) {
+            fprintf(stderr, "Device %s not found\n", selects[s]);
+            missing = true;
         }
-
-        sleep(2);
     }
-
-has_firmware:
-
-    vendor_id = 0x04b4;
-    product_id = 0x00f1;
-    dev_handle = libusb_open_device_with_vid_pid(NULL, vendor_id, product_id);
-    if (!dev_handle) {
+    if (ndevices == 0 || missing) {
         fprintf(stderr,
                 "Error or device could not be found, try loading firmware\n");
         goto close;
     }
+    for (unsigned int i = 0; i < ndevices; i++)
+        fprintf(stderr, "Device %u: %s\n", i, devices[i].path);
+
+    // Every device needs an output of its own
+    if (ndevices > 1 &&
+        (strstr(capture_base != NULL   ? capture_base
+                 : trigger_spec != NULL ? trigger_spec
+                 : record_path != NULL  ? record_path
+                                        : output_spec,
+                "%D") == NULL ||
+         (meta_spec != NULL && strstr(meta_spec, "%D") == NULL) ||
+         (channels > 0 && strstr(channel_out, "%D") == NULL))) {
+        fprintf(stderr, "With several devices, --output/--record/--capture/"
+                        "--trigger, --meta and --channel-out need %%D for "
+                        "the device number\n");
+        goto close;
+    }
 
-    ret = libusb_kernel_driver_active(dev_handle, 0);
-    if (ret != 0) {
-        fprintf(stderr,
-                "Kernel driver active. Trying to detach kernel driver\n");
-        ret = libusb_detach_kernel_driver(dev_handle, 0);
-        if (ret != 0) {
-            fprintf(stderr,
-                    "Could not detach kernel driver from an interface\n");
+    unsigned int maxpkt = 0;
+    for (unsigned int i = 0; i < ndevices; i++) {
+        if (device_claim(&devices[i]) != 0)
             goto close;
-        }
+        if (devices[i].pktsize > maxpkt)
+            maxpkt = devices[i].pktsize;
     }
 
-    dev = libusb_get_device(dev_handle);
-
-    libusb_get_config_descriptor(dev, 0, &config);
-
-    ret = libusb_claim_interface(dev_handle, interface_number);
-    if (ret != 0) {
-        fprintf(stderr, "Error claiming interface\n");
-        goto end;
+    // With autotune, buffers are allocated for the largest configuration
+    // that fits the budget and the tuner starts from -q/-p
+    unsigned int start_depth = queuedepth, start_size = reqsize;
+    if (autotune_mb > 0) {
+        uint64_t budget = (uint64_t)autotune_mb * 1024 * 1024;
+        unsigned int depth_max = 64, size_max = 64;
+        while ((uint64_t)(depth_max + ringsize) * size_max * maxpkt > budget &&
+               size_max > start_size)
+            size_max /= 2;
+        while ((uint64_t)(depth_max + ringsize) * size_max * maxpkt > budget &&
+               depth_max > start_depth)
+            depth_max /= 2;
+        if (size_max < start_size)
+            size_max = start_size;
+        if (depth_max < start_depth)
+            depth_max = start_depth;
+        queuedepth = depth_max;
+        reqsize = size_max;
+        fprintf(stderr, "Autotune: up to depth %u, %u packets per transfer\n",
+                depth_max, size_max);
     }
 
-    fprintf(stderr, "Successfully claimed interface\n");
-
-    interfaceDesc = &(config->interface[0].altsetting[0]);
-
-    endpointDesc = &interfaceDesc->endpoint[0];
-
-    libusb_get_device_descriptor(dev, &desc);
-
-    libusb_get_ss_endpoint_companion_descriptor(NULL, endpointDesc, &ep_comp);
-
-    pktsize = endpointDesc->wMaxPacketSize * (ep_comp->bMaxBurst + 1);
-
-    libusb_free_ss_endpoint_companion_descriptor(ep_comp);
-
-    bool allocfail = false;
-    databuffers = (u_char **)calloc(queuedepth, sizeof(u_char *));
+    fprintf(stderr, "Queue depth: %d, Request size: %d\n", queuedepth,
+            reqsize * maxpkt);
 
-    transfers = (struct libusb_transfer **)calloc(
-        queuedepth, sizeof(struct libusb_transfer *));
+    for (unsigned int i = 0; i < ndevices; i++) {
+        if (device_setup(&devices[i], start_depth, start_size) != 0)
+            goto close;
+    }
 
-    fprintf(stderr, "Queue depth: %d, Request size: %d\n", queuedepth, reqsize * pktsize);
+    // A simulated device completes transfers from a thread of its own,
+    // which stands in for the event thread
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct sim *s = devices[i].sim;
 
-    if ((databuffers != NULL) && (transfers != NULL)) {
-        for (unsigned int i = 0; i < queuedepth; i++) {
-            databuffers[i] = (u_char *)malloc(reqsize * pktsize);
-            transfers[i] = libusb_alloc_transfer(0);
-            if ((databuffers[i] == NULL) || (transfers[i] == NULL)) {
-                allocfail = true;
-                break;
-            }
+        if (s == NULL)
+            continue;
+        if (sim_start(s) != 0) {
+            fprintf(stderr, "Could not start %s\n", devices[i].path);
+            goto close;
         }
-
-    } else {
-        allocfail = true;
+        rt_pin(s->thread, &event_cpus, -1);
+        if (event_prio > 0)
+            rt_fifo(s->thread, event_prio);
     }
 
-    if (allocfail) {
-        fprintf(stderr, "Failed to allocate buffers and transfers\n");
-        free_transfer_buffers(databuffers, transfers);
+    FILE *json = NULL;
+    if (stats_json != NULL) {
+        json = fopen(stats_json, "w");
+        if (json == NULL)
+            fprintf(stderr, "Could not open %s: %s\n", stats_json,
+                    strerror(errno));
     }
-
-    for (unsigned int i = 0; i < queuedepth; i++) {
-        libusb_fill_bulk_transfer(transfers[i], dev_handle, ep, databuffers[i],
-                                  reqsize * pktsize, transfer_callback,
-                                  (void *)&pktsize, 0);
-        rStatus = libusb_submit_transfer(transfers[i]);
-        if (rStatus == 0)
-            xfers_in_progress++;
+    if (stats_start(device_stats, ndevices, stats_interval, json) != 0)
+        fprintf(stderr, "Failed to start stats thread\n");
+
+    // Locked after the buffer pools are allocated; MCL_FUTURE covers the
+    // rest
+    if (lock_memory)
+        rt_mlock();
+
+    pthread_t events;
+    if (event_thread_on) {
+        if (pthread_create(&events, NULL, event_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to start event thread, using main\n");
+            event_thread_on = false;
+        } else {
+            rt_pin(events, &event_cpus, -1);
+            if (event_prio > 0)
+                rt_fifo(events, event_prio);
+        }
     }
 
+    for (unsigned int i = 0; i < ndevices; i++)
+        device_submit(&devices[i]);
+
     /******/
-    uint32_t gpio = 0;
-    if (dither) {
-        gpio |= DITH;
-    }
-    if (randomizer) {
-        gpio |= RANDO;
-    }
-
-    usleep(5000);
-    command_send(dev_handle, GPIOFX3, gpio);
-    usleep(5000);
-    argument_send(dev_handle, DAT31_ATT, att);
-    usleep(5000);
-    argument_send(dev_handle, AD8340_VGA, gain);
-    usleep(5000);
-    command_send(dev_handle, STARTADC, samplerate);
-    usleep(5000);
-    command_send(dev_handle, STARTFX3, 0);
-    usleep(5000);
-    command_send(dev_handle, TUNERSTDBY, 0);
+    // Configure every device, then start their streams back to back so
+    // they begin within a few control transfers of each other
+    struct command_batch batch;
+    struct command commands[MAX_DEVICES];
+    batch_begin(&batch);
+    for (unsigned int i = 0; i < ndevices; i++)
+        device_configure(&devices[i], &batch, &commands[i]);
+    if (batch_wait(&batch) > 0)
+        fprintf(stderr, "Some devices did not take their settings\n");
+    usleep(ADC_SETTLE_US);
+    batch_begin(&batch);
+    for (unsigned int i = 0; i < ndevices; i++)
+        device_start(&devices[i], &batch, &commands[i]);
+    batch_wait(&batch);
     /*******/
 
+    if (control_spec != NULL && control_start(control_spec, control_command) != 0)
+        fprintf(stderr, "Running without a control channel\n");
+
+    libusb_hotplug_callback_handle hotplug;
+    if (nsims == 0 && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+        libusb_hotplug_register_callback(
+            usb_ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS, 0x04b4, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
+            &hotplug) == 0)
+        hotplug_on = true;
+
+    uint64_t stop_ns = stats_now_ns() + duration * 1000000000ULL;
+    struct timeval tv = {0, 100000};
     do {
-        libusb_handle_events(NULL);
+        if (event_thread_on)
+            usleep(100000);
+        else
+            libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+        pthread_mutex_lock(&control_lock);
+        recover_devices(image_ret == 0 ? &image : NULL);
+        pthread_mutex_unlock(&control_lock);
+        if (duration > 0 && stats_now_ns() >= stop_ns)
+            stop_transfers = true;
 
     } while (stop_transfers != true);
 
     fprintf(stderr, "Test complete. Stopping transfers\n");
     stop_transfers = true;
+    control_stop();
 
-    while (xfers_in_progress != 0) {
-        fprintf(stderr, "%d transfers are pending\n", xfers_in_progress);
-        libusb_handle_events(NULL);
+    while (transfers_in_progress() != 0) {
+        fprintf(stderr, "%d transfers are pending\n", transfers_in_progress());
+        if (!event_thread_on)
+            libusb_handle_events(usb_ctx);
         usleep(100000);
     }
+    if (hotplug_on)
+        libusb_hotplug_deregister_callback(usb_ctx, hotplug);
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct sim *s = devices[i].sim;
+        double secs;
+
+        if (s == NULL || !s->started)
+            continue;
+        sim_stop(s);
+        secs = (s->end_ns - s->start_ns) / 1e9;
+        fprintf(stderr, "Simulated %s: %llu samples in %.2f s, %.1f Msps\n",
+                devices[i].path, (unsigned long long)s->samples, secs,
+                secs > 0 ? s->samples / secs / 1e6 : 0.0);
+    }
+    if (event_thread_on) {
+        atomic_store(&event_stop, true);
+        pthread_join(events, NULL);
+    }
 
     fprintf(stderr, "Transfers completed\n");
-    free_transfer_buffers(databuffers, transfers);
-
-    command_send(dev_handle, STOPFX3, 0);
-
-end:
-    if (dev_handle) {
-        libusb_release_interface(dev_handle, interface_number);
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+        if (autotune_mb > 0)
+            fprintf(stderr,
+                    "Autotune %s: settled on depth %u, %u packets per "
+                    "transfer (%u bytes), %.2f ms in flight, %u changes, "
+                    "worst gap %.2f ms\n",
+                    d->path, d->tuner.depth, d->tuner.size,
+                    d->tuner.size * d->pktsize,
+                    tune_inflight_ns(&d->tuner) / 1e6, d->tuner.changes,
+                    d->tuner.worst_gap_run / 1e6);
+        atomic_store(&d->writer_stop, true);
+        ring_wake(&d->ring);
     }
-
-    if (config) {
-        libusb_free_config_descriptor(config);
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+        pthread_join(d->writer, NULL);
+        d->writer_running = false;
     }
-close:
-    if (dev_handle) {
-        libusb_close(dev_handle);
+    stats_stop();
+    if (json != NULL)
+        fclose(json);
+    for (unsigned int i = 0; i < ndevices; i++) {
+        struct device *d = &devices[i];
+        fprintf(stderr,
+                "Output ring %s high-water mark: %u/%u slots, dropped: %llu\n",
+                d->path, d->ring.high_water, d->ring.size,
+                (unsigned long long)d->ring.drops);
+        if (d->recoveries > 0)
+            fprintf(stderr, "Device %s recovered %u times\n", d->path,
+                    d->recoveries);
+        if (d->handle != NULL)
+            command_send(d->handle, STOPFX3, 0);
     }
-    libusb_exit(NULL);
+
+close:
+    for (unsigned int i = 0; i < ndevices; i++)
+        device_close(&devices[i]);
+    if (image_ret == 0)
+        fx3_image_close(&image);
+    libusb_exit(usb_ctx);
 
     return 0;
 }
@@ -0,0 +1,226 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_PATTERN (1u << 20) // samples in a synthetic pattern
+
+static uint64_t sim_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Roughly Gaussian noise of unit variance: the sum of four uniforms
+static double noise(uint64_t *state) {
+    double sum = 0.0;
+
+    for (int i = 0; i < 4; i++) {
+        // xorshift64*
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        sum += (double)((*state * 0x2545f4914f6cdd1dULL) >> 11) / (1ULL << 53);
+    }
+    return (sum - 2.0) * sqrt(3.0);
+}
+
+static int synth_open(struct sim *s, const char *source,
+                      unsigned int samplerate) {
+    double hz = samplerate / 8.0, amp = 16384.0, sigma = 64.0;
+    uint64_t state = 0x2208;
+    int16_t *p;
+    double k;
+
+    if (strcmp(source, "noise") == 0) {
+        amp = 0.0;
+        sigma = 2048.0;
+    } else if (strncmp(source, "tone:", 5) == 0) {
+        char *end;
+        hz = strtod(source + 5, &end);
+        if (*end != '\0' || hz < 0 || hz >= samplerate / 2.0) {
+            fprintf(stderr, "Simulated tone must be below fs / 2\n");
+            return -1;
+        }
+    } else if (strcmp(source, "tone") != 0) {
+        return 1;
+    }
+
+    p = malloc(SIM_PATTERN * sizeof(int16_t));
+    if (p == NULL)
+        return -1;
+    // A whole number of periods in the pattern, so that it loops cleanly
+    k = round(hz / samplerate * SIM_PATTERN);
+    for (unsigned int i = 0; i < SIM_PATTERN; i++) {
+        double v = amp * cos(2.0 * M_PI * k * i / SIM_PATTERN) +
+                   sigma * noise(&state);
+        p[i] = (int16_t)lrint(fmax(-32768.0, fmin(32767.0, v)));
+    }
+    s->pattern = (const unsigned char *)p;
+    s->pattern_len = SIM_PATTERN * sizeof(int16_t);
+    return 0;
+}
+
+static int file_open(struct sim *s, const char *path) {
+    struct stat st;
+    void *p;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size < 2) {
+        fprintf(stderr, "%s has no samples to replay\n", path);
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    s->pattern = p;
+    s->pattern_len = st.st_size & ~(off_t)1;
+    s->mapped = true;
+    return 0;
+}
+
+int sim_open(struct sim *s, const char *source, double rate, int randomize,
+             const struct convert_impl *kernels, unsigned int samplerate) {
+    int ret;
+
+    memset(s, 0, sizeof(*s));
+    s->source = source;
+    s->rate = rate;
+    s->derand = kernels->derand;
+
+    ret = synth_open(s, source, samplerate);
+    if (ret < 0)
+        return -1;
+    if (ret > 0) {
+        if (file_open(s, source) != 0)
+            return -1;
+        // Encoded as it goes out, the file stays read-only
+        s->encode = randomize;
+    } else if (randomize) {
+        s->derand((uint16_t *)s->pattern, s->pattern_len / sizeof(int16_t));
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    return 0;
+}
+
+void sim_close(struct sim *s) {
+    if (s->pattern == NULL)
+        return;
+    sim_stop(s);
+    if (s->mapped)
+        munmap((void *)s->pattern, s->pattern_len);
+    else
+        free((void *)s->pattern);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    memset(s, 0, sizeof(*s));
+}
+
+int sim_submit(struct sim *s, struct libusb_transfer *transfer) {
+    int ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->count == SIM_QUEUE) {
+        ret = LIBUSB_ERROR_BUSY;
+    } else {
+        s->queue[(s->head + s->count++) % SIM_QUEUE] = transfer;
+        pthread_cond_signal(&s->wake);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+// Copies the next len bytes of the stream into buf
+static void sim_fill(struct sim *s, unsigned char *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t n = s->pattern_len - s->pattern_pos;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, s->pattern + s->pattern_pos, n);
+        done += n;
+        s->pattern_pos = (s->pattern_pos + n) % s->pattern_len;
+    }
+    if (s->encode)
+        s->derand((uint16_t *)buf, len / sizeof(int16_t));
+}
+
+static void *sim_thread(void *arg) {
+    struct sim *s = arg;
+
+    while (1) {
+        struct libusb_transfer *t;
+
+        pthread_mutex_lock(&s->lock);
+        while (s->count == 0 && !atomic_load(&s->stop))
+            pthread_cond_wait(&s->wake, &s->lock);
+        if (s->count == 0) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        t = s->queue[s->head];
+        s->head = (s->head + 1) % SIM_QUEUE;
+        s->count--;
+        pthread_mutex_unlock(&s->lock);
+
+        // The stream starts with the first transfer, not with the thread
+        if (s->samples == 0)
+            s->start_ns = sim_now_ns();
+        sim_fill(s, t->buffer, t->length);
+        s->samples += t->length / sizeof(int16_t);
+        // A transfer completes when the ADC would have filled it; running
+        // late is caught up on without sleeping, as a real stream bursts
+        if (s->rate > 0) {
+            uint64_t due = s->start_ns + (uint64_t)(s->samples * 1e9 / s->rate);
+            struct timespec ts = {due / 1000000000ULL, due % 1000000000ULL};
+            if (due > sim_now_ns())
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        t->actual_length = t->length;
+        t->status = LIBUSB_TRANSFER_COMPLETED;
+        t->callback(t);
+        s->end_ns = sim_now_ns();
+    }
+    return NULL;
+}
+
+int sim_start(struct sim *s) {
+    if (pthread_create(&s->thread, NULL, sim_thread, s) != 0)
+        return -1;
+    s->started = true;
+    return 0;
+}
+
+void sim_stop(struct sim *s) {
+    if (!s->started)
+        return;
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stop, true);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    s->started = false;
+}
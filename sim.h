@@ -0,0 +1,72 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+/*
+ * Simulated RX888, for benchmarking and testing the streaming path without
+ * hardware. Bulk transfers submitted to it are filled on its own thread,
+ * which stands in for libusb event handling, and completed through their
+ * callback just as libusb would, so everything downstream runs unchanged.
+ *
+ * A source is one of
+ *   "tone[:HZ]"  a tone (default fs / 8) over a little noise
+ *   "noise"      noise only
+ *   PATH         raw 16-bit samples, replayed in a loop
+ * Synthetic sources repeat a precomputed pattern with a whole number of
+ * tone periods, so generating them costs no more than a memcpy.
+ *
+ * Samples come out at rate per second, or as fast as they are consumed
+ * when rate is 0. With randomize set they are encoded the way the ADC
+ * randomizer does, for the pipeline to undo.
+ */
+
+#define SIM_PKTSIZE 16384 // a SuperSpeed burst, as the real endpoint
+#define SIM_QUEUE 64      // transfers in flight at most
+
+struct sim {
+    const char *source;
+    const unsigned char *pattern; // repeated for the stream
+    size_t pattern_len;           // bytes, even
+    size_t pattern_pos;
+    bool mapped;                  // pattern is a file mapping
+    bool encode;                  // randomize pattern data on the way out
+    derand_fn derand;             // the encoding is its own inverse
+    double rate;
+
+    struct libusb_transfer *queue[SIM_QUEUE];
+    unsigned int head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool started;
+    atomic_bool stop;
+
+    uint64_t samples; // produced
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+// Returns 0 on success, -1 on failure (reported on stderr).
+int sim_open(struct sim *s, const char *source, double rate, int randomize,
+             const struct convert_impl *kernels, unsigned int samplerate);
+void sim_close(struct sim *s);
+
+// Queues a bulk transfer as libusb_submit_transfer would. Returns 0, or
+// LIBUSB_ERROR_BUSY if too many are queued.
+int sim_submit(struct sim *s, struct libusb_transfer *transfer);
+
+// Starts completing transfers. Returns 0 on success.
+int sim_start(struct sim *s);
+// Stops the thread once the transfers still queued are completed. Call
+// when nothing is being resubmitted any more.
+void sim_stop(struct sim *s);
+
+#endif
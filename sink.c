@@ -0,0 +1,110 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int fd_write(struct sink *s, const void *buf, size_t len,
+                    const struct block_info *info) {
+    (void)info;
+    return write_all(s->fd, buf, len);
+}
+
+static void fd_close(struct sink *s) {
+    if (s->fd > 2)
+        close(s->fd);
+}
+
+static const struct sink_ops fd_ops = {
+    .name = "file",
+    .write = fd_write,
+    .close = fd_close,
+};
+
+struct sink *sink_alloc(const struct sink_ops *ops, size_t size) {
+    struct sink *s = calloc(1, size);
+
+    if (s != NULL) {
+        s->ops = ops;
+        s->fd = -1;
+    }
+    return s;
+}
+
+static struct sink *file_open(const char *path) {
+    struct sink *s;
+    int fd;
+
+    if (strcmp(path, "-") == 0) {
+        fd = 1;
+    } else {
+        // Opening a FIFO blocks here until its reader shows up
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+    }
+    s = sink_alloc(&fd_ops, sizeof(*s));
+    if (s == NULL) {
+        if (fd > 2)
+            close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+    return s;
+}
+
+struct sink *sink_open(const char *spec) {
+    if (strncmp(spec, "file:", 5) == 0)
+        return file_open(spec + 5);
+    if (strncmp(spec, "tcp:", 4) == 0)
+        return tcp_sink_open(spec + 4);
+    if (strncmp(spec, "udp:", 4) == 0)
+        return udp_sink_open(spec + 4);
+    if (strncmp(spec, "record:", 7) == 0)
+        return record_sink_open(spec + 7, 0, 0);
+    if (strncmp(spec, "shm:", 4) == 0)
+        return shm_sink_open(spec + 4);
+    if (strncmp(spec, "rice:", 5) == 0)
+        return rice_sink_open(spec + 5);
+    return file_open(spec);
+}
+
+int sink_write(struct sink *s, const void *buf, size_t len,
+               const struct block_info *info) {
+    if (len == 0)
+        return 0;
+    if (s->ops->write(s, buf, len, info) < 0) {
+        s->errors++;
+        return -1;
+    }
+    s->bytes += len;
+    return 0;
+}
+
+void sink_close(struct sink *s) {
+    if (s == NULL)
+        return;
+    s->ops->close(s);
+    free(s);
+}
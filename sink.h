@@ -0,0 +1,207 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Output sinks. A sink is opened from a spec string and takes a stream of
+ * bytes; each kind of sink provides its own ops.
+ *
+ *   "-"                   standard output
+ *   "file:PATH"           file or FIFO, also any spec without a known prefix
+ *   "tcp:HOST:PORT"       connect to HOST and stream over TCP
+ *   "tcp::PORT"           listen on PORT and stream to the first client
+ *   "udp:ADDR:PORT[:LEN[:TTL]]"
+ *                         datagrams of LEN payload bytes (default 1024)
+ *                         with a sink_udp_header, ADDR may be multicast
+ *                         (TTL default 1)
+ *   "record:PATH"         O_DIRECT recording, see record_sink_open
+ *   "shm:NAME[:MB]"       ring of MB megabytes (default 64) in the POSIX
+ *                         shared memory object /NAME, see sink_shm_header
+ *   "rice:PATH[:THREADS]" lossless compressed recording, encoded by
+ *                         THREADS workers (default 4), see sink_rice_header
+ */
+
+// Describes the block of samples a write belongs to
+struct block_info {
+    uint64_t timestamp_ns; // CLOCK_REALTIME when the transfer completed
+    uint64_t sample_index; // ADC sample counter at the start of the block
+    uint64_t lost;         // samples lost just before the block
+    int lost_usb;          // some of them in failed transfers
+    int lost_rate;         // some only missing from the sample rate
+    int restarted;         // the device was reset, lost is an estimate
+};
+
+struct sink;
+
+struct sink_ops {
+    const char *name;
+    int (*write)(struct sink *s, const void *buf, size_t len,
+                 const struct block_info *info);
+    void (*close)(struct sink *s);
+};
+
+struct sink {
+    const struct sink_ops *ops;
+    int fd;
+    uint64_t bytes;  // bytes accepted
+    uint64_t errors; // failed writes
+};
+
+// Prepended to every datagram of a udp: sink. All fields little endian.
+#define SINK_UDP_MAGIC 0x38385852 // "RX88"
+struct sink_udp_header {
+    uint32_t magic;
+    uint16_t version;      // 1
+    uint16_t header_len;   // sizeof(struct sink_udp_header)
+    uint64_t seq;          // datagram number, from 0
+    uint64_t offset;       // byte offset of the payload in the stream
+    uint64_t timestamp_ns; // block_info.timestamp_ns of the payload
+};
+
+// Starts the POSIX shared memory object of a shm: sink, followed at
+// header_len by size bytes of ring; stream offset p is at data[p % size].
+// Fields are native endian. The writer never waits for readers, which map
+// the object read-only and each keep their own cursor:
+//
+//   - Start at write_pos, or anywhere back to write_pos - size.
+//   - While cursor == write_pos, take seq; if it is even and cursor is
+//     still write_pos, FUTEX_WAIT (not private) on seq with that value.
+//     The writer bumps seq to odd before a write and back to even after,
+//     waking all waiters.
+//   - Use the data from cursor up to write_pos, then check claim_pos: if
+//     claim_pos - cursor > size the writer has overwritten part of it, and
+//     the reader has been overrun. Resynchronise at write_pos.
+//   - Stop once closed is set and cursor == write_pos.
+//
+// block_pos, sample_index and timestamp_ns describe the last block written
+// and are consistent when seq is even and the same before and after
+// reading them.
+#define SINK_SHM_MAGIC 0x4d535852 // "RXSM"
+struct sink_shm_header {
+    uint32_t magic;
+    uint32_t version;    // 1
+    uint64_t header_len; // offset of the ring, a page
+    uint64_t size;       // ring bytes, a power of two
+    _Atomic uint64_t claim_pos; // end of the data being written
+    _Atomic uint64_t write_pos; // end of the data written
+    _Atomic uint32_t seq;
+    _Atomic uint32_t closed;
+    _Atomic uint64_t block_pos; // stream offset of the last block
+    _Atomic uint64_t sample_index;
+    _Atomic uint64_t timestamp_ns;
+};
+
+// A rice: recording is a sink_rice_header, blocks, then an index. All
+// fields little endian. Each block is a sink_rice_block followed by
+// coded_len bytes that decode to raw_len bytes of the stream on their own.
+// Blocks hold whole writes with no samples lost between them, so
+// sample_index and timestamp_ns are those of the first sample. Once the
+// recording is closed, it ends with a sink_rice_index entry per block and
+// a sink_rice_trailer. A recording that was cut short has no index, and
+// its blocks can be found by walking the chain from the file header.
+//
+// The coded data is a bit stream, least significant bit first, in
+// partitions of SINK_RICE_PARTITION int16 samples (the last may be
+// shorter). Each partition starts with 7 bits: the order p (2 bits) and
+// the Rice parameter k (5 bits). Orders 0-2 code the residual
+//   r = x[n]                        (p = 0)
+//   r = x[n] - x[n-1]               (p = 1)
+//   r = x[n] - 2 x[n-1] + x[n-2]    (p = 2)
+// of every sample, where samples before the block count as 0. Each
+// residual is zigzagged, u = r >= 0 ? 2r : -2r - 1. It is then coded as
+// q = u >> k one bits, a zero bit and the low k bits of u. Once q reaches
+// SINK_RICE_ESCAPE, it is coded as that many ones followed by all 18 bits
+// of u. Order 3 stores the partition verbatim, 16 bits per sample. An odd
+// trailing byte of raw data follows the bit stream, byte aligned.
+#define SINK_RICE_MAGIC 0x43525852       // "RXRC"
+#define SINK_RICE_BLOCK_MAGIC 0x42525852 // "RXRB"
+#define SINK_RICE_INDEX_MAGIC 0x49525852 // "RXRI"
+#define SINK_RICE_PARTITION 4096
+#define SINK_RICE_ESCAPE 24
+struct sink_rice_header {
+    uint32_t magic;
+    uint16_t version;    // 1
+    uint16_t header_len; // sizeof(struct sink_rice_header), blocks follow
+};
+
+struct sink_rice_block {
+    uint32_t magic;     // SINK_RICE_BLOCK_MAGIC
+    uint32_t coded_len; // bytes following this header
+    uint32_t raw_len;   // bytes decoded
+    uint32_t flags;     // 0
+    uint64_t offset;    // of the decoded data in the stream
+    uint64_t sample_index;
+    uint64_t timestamp_ns;
+    uint64_t lost;      // samples lost just before the block
+};
+
+struct sink_rice_index {
+    uint64_t file_offset; // of the sink_rice_block
+    uint64_t offset;
+    uint64_t sample_index;
+    uint64_t timestamp_ns;
+};
+
+struct sink_rice_trailer {
+    uint32_t magic;        // SINK_RICE_INDEX_MAGIC
+    uint32_t reserved;
+    uint64_t blocks;       // index entries
+    uint64_t index_offset; // file offset of the first entry
+};
+
+// Returns NULL and reports on stderr if the sink cannot be opened.
+struct sink *sink_open(const char *spec);
+// Returns 0 on success, -1 on error (counted in s->errors). info may be
+// NULL when there is no block behind the data.
+int sink_write(struct sink *s, const void *buf, size_t len,
+               const struct block_info *info);
+void sink_close(struct sink *s);
+
+// Writes all of buf to fd, retrying short writes and EINTR.
+int write_all(int fd, const void *buf, size_t len);
+
+// For the sink implementations: allocates size bytes (at least a struct
+// sink, which must come first) with ops set and no fd.
+struct sink *sink_alloc(const struct sink_ops *ops, size_t size);
+struct sink *tcp_sink_open(const char *spec);
+struct sink *udp_sink_open(const char *spec);
+struct sink *shm_sink_open(const char *spec);
+struct sink *rice_sink_open(const char *spec);
+
+// Decodes the rice: recording on fd to out, a write per block with its
+// sample_index, timestamp_ns and lost. The index is not needed, so a
+// recording that was cut short decodes up to where it stops. Returns 0, or
+// -1 on a corrupt block or a failed write, reported on stderr.
+int rice_decode(int fd, struct sink *out);
+// Codes a test stream, decodes it and compares; 0 if equal.
+int rice_selftest(void);
+
+// Records to PATH with O_DIRECT writes through io_uring. With a size
+// (bytes) or time (seconds) limit, starts a new file PATH.0000, PATH.0001,
+// ... whenever one is reached; 0 means no limit.
+struct sink *record_sink_open(const char *path, uint64_t rotate_bytes,
+                              unsigned int rotate_sec);
+
+// Keeps the last pre_bytes of the stream in memory and writes nothing
+// until trigger_sink_fire. The event then goes to the sink spec pattern,
+// with %E replaced by its number (0000, 0001, ...): the pre_bytes before
+// the trigger and the stream after it, until post_bytes have passed
+// without another trigger.
+struct sink *trigger_sink_open(const char *pattern, uint64_t pre_bytes,
+                               uint64_t post_bytes);
+
+struct trigger_event {
+    unsigned int number;
+    uint64_t offset;       // stream offset of its first byte
+    uint64_t sample_index; // of the block it starts with
+    uint64_t timestamp_ns;
+};
+
+// Triggers s, from the writing thread. Returns 1 if that started event ev,
+// 0 if it extended the event in progress (ev->number is set).
+int trigger_sink_fire(struct sink *s, struct trigger_event *ev);
+
+#endif
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include "sink.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#define NET_SNDBUF (4 * 1024 * 1024)
+#define UDP_PAYLOAD_DEFAULT 1024
+#define UDP_MSGS_PER_CALL 64 // messages per sendmmsg
+#define UDP_GSO_SEGMENTS 64  // kernel limit on segments per GSO send
+#define UDP_GSO_BYTES 65000  // stay under the 64 KB UDP length limit
+
+// Splits "HOST:PORT[:REST]" (HOST may be empty or a [bracketed] IPv6
+// address). Returns 0 on success.
+static int split_hostport(const char *spec, char *host, size_t hostlen,
+                          char *port, size_t portlen, const char **rest) {
+    const char *p = spec, *end;
+    size_t n;
+
+    if (*p == '[') {
+        end = strchr(p, ']');
+        if (end == NULL || end[1] != ':')
+            return -1;
+        n = end - p - 1;
+        p++;
+        end++;
+    } else {
+        end = strchr(p, ':');
+        if (end == NULL)
+            return -1;
+        n = end - p;
+    }
+    if (n >= hostlen)
+        return -1;
+    memcpy(host, p, n);
+    host[n] = '\0';
+
+    p = end + 1;
+    end = strchr(p, ':');
+    n = end != NULL ? (size_t)(end - p) : strlen(p);
+    if (n == 0 || n >= portlen)
+        return -1;
+    memcpy(port, p, n);
+    port[n] = '\0';
+    *rest = end != NULL ? end + 1 : NULL;
+    return 0;
+}
+
+static void set_sndbuf(int fd) {
+    int size = NET_SNDBUF;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/*
+ * TCP
+ */
+
+static int tcp_write(struct sink *s, const void *buf, size_t len,
+                     const struct block_info *info) {
+    const unsigned char *p = buf;
+
+    (void)info;
+    while (len > 0) {
+        // A vanished client shows up as an error, not a SIGPIPE
+        ssize_t ret = send(s->fd, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void net_close(struct sink *s) {
+    if (s->fd >= 0)
+        close(s->fd);
+}
+
+static const struct sink_ops tcp_ops = {
+    .name = "tcp",
+    .write = tcp_write,
+    .close = net_close,
+};
+
+static int tcp_listen_accept(const char *port) {
+    struct addrinfo hints = {0}, *res, *ai;
+    int lfd = -1, fd, one = 1, ret;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(NULL, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "tcp: %s: %s\n", port, gai_strerror(ret));
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        lfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (lfd < 0)
+            continue;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(lfd, 1) == 0)
+            break;
+        close(lfd);
+        lfd = -1;
+    }
+    freeaddrinfo(res);
+    if (lfd < 0) {
+        fprintf(stderr, "tcp: could not listen on port %s\n", port);
+        return -1;
+    }
+
+    fprintf(stderr, "Waiting for TCP client on port %s\n", port);
+    do {
+        fd = accept(lfd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        fprintf(stderr, "tcp: accept: %s\n", strerror(errno));
+    close(lfd);
+    return fd;
+}
+
+static int tcp_connect(const char *host, const char *port) {
+    struct addrinfo hints = {0}, *res, *ai;
+    int fd = -1, ret;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "tcp: %s:%s: %s\n", host, port, gai_strerror(ret));
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        fprintf(stderr, "tcp: could not connect to %s:%s\n", host, port);
+    return fd;
+}
+
+struct sink *tcp_sink_open(const char *spec) {
+    char host[256], port[32];
+    const char *rest;
+    struct sink *s;
+    int fd, one = 1;
+
+    if (split_hostport(spec, host, sizeof(host), port, sizeof(port), &rest) !=
+            0 ||
+        rest != NULL) {
+        fprintf(stderr, "tcp: expected HOST:PORT or :PORT, got %s\n", spec);
+        return NULL;
+    }
+    fd = host[0] == '\0' ? tcp_listen_accept(port) : tcp_connect(host, port);
+    if (fd < 0)
+        return NULL;
+    set_sndbuf(fd);
+    // Blocks are written whole, so Nagle would only delay the tail of each
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    s = sink_alloc(&tcp_ops, sizeof(*s));
+    if (s == NULL) {
+        close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+    return s;
+}
+
+/*
+ * UDP
+ *
+ * Each write is cut into datagrams of `payload` bytes, each with its own
+ * header, and handed to the kernel in as few syscalls as possible: with
+ * UDP_SEGMENT (GSO) one message carries up to UDP_GSO_SEGMENTS datagrams
+ * back to back and the kernel or NIC splits them, and sendmmsg submits up
+ * to UDP_MSGS_PER_CALL messages at once.
+ */
+
+struct udp_sink {
+    struct sink base;
+    size_t payload;
+    unsigned int segments; // datagrams per message, 1 without GSO
+    uint64_t seq;
+    uint64_t offset;
+    size_t max_dgrams;
+    struct sink_udp_header *hdrs; // one per datagram of a batch
+    struct iovec *iov;            // header and payload per datagram
+    struct mmsghdr *msgs;
+};
+
+static int udp_write(struct sink *s, const void *buf, size_t len,
+                     const struct block_info *info) {
+    struct udp_sink *u = (struct udp_sink *)s;
+    const unsigned char *p = buf;
+    uint64_t ts = info != NULL ? info->timestamp_ns : 0;
+
+    while (len > 0) {
+        size_t nd = 0, nmsg = 0, sent = 0;
+
+        for (; len > 0 && nd < u->max_dgrams; nd++) {
+            size_t seg = len < u->payload ? len : u->payload;
+            struct sink_udp_header *h = &u->hdrs[nd];
+
+            h->magic = htole32(SINK_UDP_MAGIC);
+            h->version = htole16(1);
+            h->header_len = htole16(sizeof(*h));
+            h->seq = htole64(u->seq++);
+            h->offset = htole64(u->offset);
+            h->timestamp_ns = htole64(ts);
+            u->iov[2 * nd].iov_base = h;
+            u->iov[2 * nd].iov_len = sizeof(*h);
+            u->iov[2 * nd + 1].iov_base = (void *)p;
+            u->iov[2 * nd + 1].iov_len = seg;
+
+            // Only the last segment of a GSO message may be short, and a
+            // short one is always the end of the buffer
+            if (nd % u->segments == 0) {
+                memset(&u->msgs[nmsg], 0, sizeof(u->msgs[nmsg]));
+                u->msgs[nmsg].msg_hdr.msg_iov = &u->iov[2 * nd];
+                nmsg++;
+            }
+            u->msgs[nmsg - 1].msg_hdr.msg_iovlen += 2;
+
+            u->offset += seg;
+            p += seg;
+            len -= seg;
+        }
+
+        while (sent < nmsg) {
+            int ret = sendmmsg(s->fd, u->msgs + sent, nmsg - sent, 0);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                // The rest of this write is lost; the receiver sees the
+                // hole in seq and offset
+                return -1;
+            }
+            sent += ret;
+        }
+    }
+    return 0;
+}
+
+static void udp_close(struct sink *s) {
+    struct udp_sink *u = (struct udp_sink *)s;
+
+    net_close(s);
+    free(u->hdrs);
+    free(u->iov);
+    free(u->msgs);
+}
+
+static const struct sink_ops udp_ops = {
+    .name = "udp",
+    .write = udp_write,
+    .close = udp_close,
+};
+
+static void set_multicast(int fd, const struct addrinfo *ai, int ttl) {
+    if (ai->ai_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ai->ai_addr;
+        if (IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    } else if (ai->ai_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 =
+            (const struct sockaddr_in6 *)ai->ai_addr;
+        if (IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+            setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl,
+                       sizeof(ttl));
+    }
+}
+
+struct sink *udp_sink_open(const char *spec) {
+    char host[256], port[32];
+    const char *rest;
+    struct addrinfo hints = {0}, *res, *ai;
+    struct udp_sink *u;
+    long payload = UDP_PAYLOAD_DEFAULT, ttl = 1;
+    int fd = -1, ret, gso;
+
+    if (split_hostport(spec, host, sizeof(host), port, sizeof(port), &rest) !=
+            0 ||
+        host[0] == '\0') {
+        fprintf(stderr, "udp: expected ADDR:PORT[:LEN[:TTL]], got %s\n", spec);
+        return NULL;
+    }
+    if (rest != NULL) {
+        char *end;
+        payload = strtol(rest, &end, 10);
+        if (*end == ':')
+            ttl = strtol(end + 1, &end, 10);
+        if (*end != '\0' || payload < 16 ||
+            payload > (long)(UDP_GSO_BYTES - sizeof(struct sink_udp_header)) ||
+            payload % 4 != 0 || ttl < 0 || ttl > 255) {
+            fprintf(stderr,
+                    "udp: LEN must be a multiple of 4 from 16 to %zu, TTL "
+                    "0-255\n",
+                    UDP_GSO_BYTES - sizeof(struct sink_udp_header));
+            return NULL;
+        }
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "udp: %s:%s: %s\n", host, port, gai_strerror(ret));
+        return NULL;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        set_multicast(fd, ai, (int)ttl);
+        // Connected, so no destination is needed per message
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "udp: could not open %s:%s\n", host, port);
+        return NULL;
+    }
+    set_sndbuf(fd);
+
+    u = (struct udp_sink *)sink_alloc(&udp_ops, sizeof(*u));
+    if (u == NULL) {
+        close(fd);
+        return NULL;
+    }
+    u->base.fd = fd;
+    u->payload = payload;
+
+    gso = (int)(sizeof(struct sink_udp_header) + payload);
+    u->segments = UDP_GSO_BYTES / gso;
+    if (u->segments > UDP_GSO_SEGMENTS)
+        u->segments = UDP_GSO_SEGMENTS;
+    if (u->segments < 2 ||
+        setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso)) != 0)
+        u->segments = 1;
+    fprintf(stderr, "udp: %s:%s, %ld byte payload, GSO %s\n", host, port,
+            payload, u->segments > 1 ? "on" : "off");
+
+    u->max_dgrams = (size_t)UDP_MSGS_PER_CALL * u->segments;
+    u->hdrs = calloc(u->max_dgrams, sizeof(*u->hdrs));
+    u->iov = calloc(2 * u->max_dgrams, sizeof(*u->iov));
+    u->msgs = calloc(UDP_MSGS_PER_CALL, sizeof(*u->msgs));
+    if (u->hdrs == NULL || u->iov == NULL || u->msgs == NULL) {
+        sink_close(&u->base);
+        return NULL;
+    }
+    return &u->base;
+}
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Recording sink. Data is gathered into large aligned chunks that are
+ * written with O_DIRECT, so a long capture neither fills the page cache
+ * nor stalls when writeback kicks in. Chunks go through io_uring so that
+ * several are in flight while the next one fills; without io_uring (old
+ * kernel, seccomp) they are written synchronously with pwrite.
+ *
+ * Files are preallocated ahead of the write position with fallocate and
+ * trimmed to the data written on close. The last, partial chunk of a
+ * file is written padded to the alignment and then truncated away.
+ */
+
+#define RECORD_ALIGN 4096              // covers any logical block size
+#define RECORD_CHUNK (4 * 1024 * 1024) // bytes per write
+#define RECORD_CHUNKS 8                // chunks in flight plus filling
+#define RECORD_PREALLOC (256ULL * 1024 * 1024)
+
+struct uring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct record_chunk {
+    unsigned char *buf;
+    size_t fill;
+    int busy; // write submitted, not completed
+    struct iovec iov;
+};
+
+struct record_sink {
+    struct sink base;
+    char *path;
+    uint64_t rotate_bytes; // 0 for no size limit
+    unsigned int rotate_sec; // 0 for no time limit
+    unsigned int index;     // of the current file, when rotating
+    uint64_t file_bytes;    // data bytes in the current file
+    uint64_t write_off;     // file offset of the current chunk
+    uint64_t allocated;     // bytes preallocated
+    struct timespec opened;
+    int direct;
+    int can_fallocate;
+    int failed; // an asynchronous write failed
+    int use_uring;
+    struct uring ring;
+    unsigned int inflight;
+    unsigned int cur;
+    struct record_chunk chunk[RECORD_CHUNKS];
+};
+
+static int uring_init(struct uring *u, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+        u->sqes == MAP_FAILED) {
+        if (u->sq_ptr != MAP_FAILED)
+            munmap(u->sq_ptr, u->sq_len);
+        if (u->cq_ptr != MAP_FAILED)
+            munmap(u->cq_ptr, u->cq_len);
+        if (u->sqes != MAP_FAILED)
+            munmap(u->sqes, u->sqes_len);
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head = (unsigned int *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned int *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)((char *)u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned int *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_free(struct uring *u) {
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->cq_ptr, u->cq_len);
+    munmap(u->sq_ptr, u->sq_len);
+    close(u->fd);
+}
+
+// Queues and submits one writev. The ring has an entry per chunk, so the
+// submission queue is never full.
+static int uring_writev(struct uring *u, int fd, const struct iovec *iov,
+                        uint64_t offset, uint64_t user_data) {
+    unsigned int tail = *u->sq_tail;
+    unsigned int idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    int ret;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        ret = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+// Waits for at least one completion and retires all available ones.
+static void record_reap(struct record_sink *r) {
+    struct uring *u = &r->ring;
+    unsigned int head, tail;
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, u->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct record_chunk *c = &r->chunk[cqe->user_data];
+
+        // O_DIRECT writes are all or nothing short of a full disk
+        if (cqe->res != (int)c->iov.iov_len) {
+            fprintf(stderr, "record: write failed: %s\n",
+                    cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            r->failed = 1;
+        }
+        c->busy = 0;
+        c->fill = 0;
+        r->inflight--;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void record_drain(struct record_sink *r) {
+    while (r->inflight > 0)
+        record_reap(r);
+}
+
+static void record_prealloc(struct record_sink *r, uint64_t end) {
+    uint64_t len;
+
+    if (!r->can_fallocate || end <= r->allocated)
+        return;
+    len = RECORD_PREALLOC;
+    if (r->rotate_bytes > r->allocated && r->rotate_bytes - r->allocated < len)
+        len = r->rotate_bytes - r->allocated;
+    if (len < end - r->allocated)
+        len = end - r->allocated;
+    // KEEP_SIZE so the file only appears as large as what was written
+    if (fallocate(r->base.fd, FALLOC_FL_KEEP_SIZE, r->allocated, len) != 0) {
+        r->can_fallocate = 0;
+        return;
+    }
+    r->allocated += len;
+}
+
+// Writes the current chunk, padded to the alignment when it is the last
+// one of the file.
+static int record_flush(struct record_sink *r) {
+    struct record_chunk *c = &r->chunk[r->cur];
+    size_t len = (c->fill + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+    uint64_t off = r->write_off;
+
+    if (c->fill == 0)
+        return 0;
+    memset(c->buf + c->fill, 0, len - c->fill);
+    record_prealloc(r, off + len);
+    r->write_off += len;
+    c->iov.iov_base = c->buf;
+    c->iov.iov_len = len;
+
+    if (r->use_uring) {
+        c->busy = 1;
+        r->inflight++;
+        if (uring_writev(&r->ring, r->base.fd, &c->iov, off, r->cur) != 0) {
+            c->busy = 0;
+            c->fill = 0;
+            r->inflight--;
+            return -1;
+        }
+        r->cur = (r->cur + 1) % RECORD_CHUNKS;
+        // Wait for the next chunk to come back before filling it
+        while (r->chunk[r->cur].busy)
+            record_reap(r);
+        return 0;
+    }
+
+    c->fill = 0;
+    while (len > 0) {
+        ssize_t ret = pwrite(r->base.fd, c->buf, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static int record_open_file(struct record_sink *r) {
+    char name[4096];
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd;
+
+    if (r->rotate_bytes > 0 || r->rotate_sec > 0)
+        snprintf(name, sizeof(name), "%s.%04u", r->path, r->index);
+    else
+        snprintf(name, sizeof(name), "%s", r->path);
+
+    fd = open(name, flags | O_DIRECT, 0644);
+    r->direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs; still aligned and large, just through the page cache
+        fd = open(name, flags, 0644);
+        if (fd >= 0 && r->index == 0)
+            fprintf(stderr, "record: O_DIRECT not supported for %s\n", name);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    r->base.fd = fd;
+    r->file_bytes = 0;
+    r->write_off = 0;
+    r->allocated = 0;
+    r->can_fallocate = 1;
+    clock_gettime(CLOCK_MONOTONIC, &r->opened);
+    record_prealloc(r, RECORD_CHUNK);
+    return 0;
+}
+
+static int record_close_file(struct record_sink *r) {
+    int ret = record_flush(r);
+
+    if (r->use_uring)
+        record_drain(r);
+    if (ftruncate(r->base.fd, r->file_bytes) != 0)
+        ret = -1;
+    close(r->base.fd);
+    r->base.fd = -1;
+    return ret;
+}
+
+static int record_rotate_due(struct record_sink *r) {
+    struct timespec now;
+
+    if (r->rotate_bytes > 0 && r->file_bytes >= r->rotate_bytes)
+        return 1;
+    if (r->rotate_sec == 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - r->opened.tv_sec >= (time_t)r->rotate_sec;
+}
+
+static int record_write(struct sink *s, const void *buf, size_t len,
+                        const struct block_info *info) {
+    struct record_sink *r = (struct record_sink *)s;
+    const unsigned char *p = buf;
+
+    (void)info;
+    while (len > 0) {
+        struct record_chunk *c;
+        size_t n;
+
+        if (record_rotate_due(r)) {
+            int ret = record_close_file(r);
+            r->index++;
+            if (record_open_file(r) != 0 || ret != 0)
+                return -1;
+        }
+
+        c = &r->chunk[r->cur];
+        n = RECORD_CHUNK - c->fill;
+        if (n > len)
+            n = len;
+        if (r->rotate_bytes > 0 && n > r->rotate_bytes - r->file_bytes)
+            n = r->rotate_bytes - r->file_bytes;
+        memcpy(c->buf + c->fill, p, n);
+        c->fill += n;
+        r->file_bytes += n;
+        p += n;
+        len -= n;
+        if (c->fill == RECORD_CHUNK && record_flush(r) != 0)
+            return -1;
+    }
+
+    if (r->failed) {
+        r->failed = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void record_close(struct sink *s) {
+    struct record_sink *r = (struct record_sink *)s;
+
+    if (s->fd >= 0)
+        record_close_file(r);
+    if (r->use_uring)
+        uring_free(&r->ring);
+    for (unsigned int i = 0; i < RECORD_CHUNKS; i++)
+        free(r->chunk[i].buf);
+    free(r->path);
+}
+
+static const struct sink_ops record_ops = {
+    .name = "record",
+    .write = record_write,
+    .close = record_close,
+};
+
+struct sink *record_sink_open(const char *path, uint64_t rotate_bytes,
+                              unsigned int rotate_sec) {
+    struct record_sink *r;
+
+    r = (struct record_sink *)sink_alloc(&record_ops, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->path = strdup(path);
+    // Keeps every file whole samples and a whole number of blocks
+    r->rotate_bytes = (rotate_bytes + RECORD_ALIGN - 1) &
+                      ~(uint64_t)(RECORD_ALIGN - 1);
+    r->rotate_sec = rotate_sec;
+    for (unsigned int i = 0; i < RECORD_CHUNKS; i++) {
+        if (posix_memalign((void **)&r->chunk[i].buf, RECORD_ALIGN,
+                           RECORD_CHUNK) != 0)
+            r->chunk[i].buf = NULL;
+        if (r->chunk[i].buf == NULL || r->path == NULL) {
+            fprintf(stderr, "record: out of memory\n");
+            sink_close(&r->base);
+            return NULL;
+        }
+    }
+    r->use_uring = uring_init(&r->ring, RECORD_CHUNKS) == 0;
+    if (record_open_file(r) != 0) {
+        sink_close(&r->base);
+        return NULL;
+    }
+    fprintf(stderr, "Recording to %s%s (%s, %s)\n", path,
+            r->rotate_bytes > 0 || r->rotate_sec > 0 ? ".NNNN" : "",
+            r->direct ? "O_DIRECT" : "buffered",
+            r->use_uring ? "io_uring" : "pwrite");
+    return &r->base;
+}
@@ -0,0 +1,780 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Compressed recording sink, see sink_rice_header for the format. Writes
+ * are gathered into blocks, which worker threads encode while the next
+ * ones fill; the writer thread puts finished blocks on disk in order and
+ * keeps the index. Each partition takes the fixed predictor with the
+ * smallest residuals and the Rice parameter that codes them in the fewest
+ * bits, or is stored verbatim when that is smaller, so a block is never
+ * much larger than its input.
+ */
+
+#define RICE_BLOCK (4 * 1024 * 1024) // raw bytes per block, at least
+#define RICE_DEFAULT_THREADS 4
+#define RICE_MAX_THREADS 64
+#define RICE_RAW_BITS 18 // of an escaped residual, enough for order 2
+#define RICE_VERBATIM 3
+
+struct rice_slot {
+    unsigned char *raw;
+    size_t raw_len;
+    size_t raw_size;
+    unsigned char *coded;
+    size_t coded_len;
+    struct sink_rice_block header;
+    int done; // encoded, ready to be written
+};
+
+struct rice_sink {
+    struct sink s;
+    unsigned int nthreads;
+    pthread_t threads[RICE_MAX_THREADS];
+    unsigned int running;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a block was submitted, or stop
+    pthread_cond_t done; // a block was encoded
+    int stop;
+
+    // Slots are used in turn: submitted - retired of them are in the
+    // workers' hands, the one at submitted is filling
+    unsigned int nslots;
+    struct rice_slot *slots;
+    uint64_t submitted, taken, retired;
+
+    uint64_t offset;      // stream bytes so far
+    uint64_t file_offset; // bytes written to the file so far
+    struct sink_rice_index *index;
+    size_t nindex, index_size;
+    int failed;
+};
+
+struct bitwriter {
+    unsigned char *p;
+    uint64_t acc;
+    unsigned int n; // bits in acc, below 32 between calls
+};
+
+// Appends the low bits (at most 32) of v
+static inline void put_bits(struct bitwriter *w, uint64_t v, unsigned int bits) {
+    w->acc |= v << w->n;
+    w->n += bits;
+    if (w->n >= 32) {
+        uint32_t word = (uint32_t)w->acc;
+        memcpy(w->p, &word, sizeof(word));
+        w->p += 4;
+        w->acc >>= 32;
+        w->n -= 32;
+    }
+}
+
+static inline void flush_bits(struct bitwriter *w) {
+    while (w->n > 0) {
+        *w->p++ = (unsigned char)w->acc;
+        w->acc >>= 8;
+        w->n = w->n > 8 ? w->n - 8 : 0;
+    }
+}
+
+// Bits taken by the residuals u[0..n) with parameter k
+static uint64_t rice_cost(const uint32_t *u, size_t n, unsigned int k) {
+    uint64_t bits = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t q = u[i] >> k;
+        bits += q < SINK_RICE_ESCAPE ? q + 1 + k
+                                     : SINK_RICE_ESCAPE + RICE_RAW_BITS;
+    }
+    return bits;
+}
+
+// Codes one partition of x, with prev[0] = x[-1] and prev[1] = x[-2]
+static void rice_partition(struct bitwriter *w, const int16_t *x, size_t n,
+                           const int32_t prev[2], uint32_t *u) {
+    uint64_t sum[3] = {0, 0, 0};
+    int32_t x1 = prev[0], x2 = prev[1];
+    unsigned int order = 0, best_k = 0, k0 = 0;
+    uint64_t best, mean;
+
+    for (size_t i = 0; i < n; i++) {
+        int32_t d1 = x[i] - x1, d2 = d1 - (x1 - x2);
+
+        sum[0] += abs(x[i]);
+        sum[1] += abs(d1);
+        sum[2] += abs(d2);
+        x2 = x1;
+        x1 = x[i];
+    }
+    if (sum[1] < sum[order])
+        order = 1;
+    if (sum[2] < sum[order])
+        order = 2;
+
+    x1 = prev[0];
+    x2 = prev[1];
+    for (size_t i = 0; i < n; i++) {
+        int32_t r = order == 0 ? x[i]
+                    : order == 1 ? x[i] - x1
+                                 : x[i] - 2 * x1 + x2;
+        u[i] = r >= 0 ? 2 * (uint32_t)r : 2 * (uint32_t)-r - 1;
+        x2 = x1;
+        x1 = x[i];
+    }
+
+    // The best k is within one of log2 of the mean of u, about twice the
+    // mean residual, so only those are costed
+    mean = 2 * sum[order] / n;
+    while (k0 < RICE_RAW_BITS - 1 && mean >> (k0 + 1) != 0)
+        k0++;
+    best = 16 * (uint64_t)n;
+    for (unsigned int k = k0 > 0 ? k0 - 1 : 0;
+         k <= k0 + 1 && k < RICE_RAW_BITS; k++) {
+        uint64_t bits = rice_cost(u, n, k);
+
+        if (bits < best) {
+            best = bits;
+            best_k = k;
+        }
+    }
+    if (best == 16 * (uint64_t)n) {
+        put_bits(w, RICE_VERBATIM, 7);
+        for (size_t i = 0; i < n; i++)
+            put_bits(w, (uint16_t)x[i], 16);
+        return;
+    }
+
+    put_bits(w, order | best_k << 2, 7);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t q = u[i] >> best_k;
+
+        if (q >= SINK_RICE_ESCAPE) {
+            put_bits(w, (1u << SINK_RICE_ESCAPE) - 1, SINK_RICE_ESCAPE);
+            put_bits(w, u[i], RICE_RAW_BITS);
+        } else if (q + 1 + best_k <= 32) {
+            put_bits(w, ((1ull << q) - 1) |
+                            (uint64_t)(u[i] & ((1u << best_k) - 1)) << (q + 1),
+                     q + 1 + best_k);
+        } else {
+            put_bits(w, (1ull << q) - 1, q + 1);
+            put_bits(w, u[i] & ((1u << best_k) - 1), best_k);
+        }
+    }
+}
+
+static void rice_encode(struct rice_slot *slot) {
+    struct bitwriter w = {slot->coded, 0, 0};
+    size_t count = slot->raw_len / sizeof(int16_t);
+    uint32_t u[SINK_RICE_PARTITION];
+    int32_t prev[2] = {0, 0};
+    int16_t x[SINK_RICE_PARTITION];
+
+    for (size_t i = 0; i < count; i += SINK_RICE_PARTITION) {
+        size_t n = count - i < SINK_RICE_PARTITION ? count - i
+                                                   : SINK_RICE_PARTITION;
+
+        // The raw buffer has no alignment to speak of
+        memcpy(x, slot->raw + i * sizeof(int16_t), n * sizeof(int16_t));
+        rice_partition(&w, x, n, prev, u);
+        prev[1] = n > 1 ? x[n - 2] : prev[0];
+        prev[0] = x[n - 1];
+    }
+    flush_bits(&w);
+    if (slot->raw_len & 1)
+        *w.p++ = slot->raw[slot->raw_len - 1];
+    slot->coded_len = w.p - slot->coded;
+}
+
+static void *rice_worker(void *arg) {
+    struct rice_sink *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+    while (1) {
+        struct rice_slot *slot;
+
+        while (r->taken == r->submitted && !r->stop)
+            pthread_cond_wait(&r->work, &r->lock);
+        if (r->taken == r->submitted)
+            break;
+        slot = &r->slots[r->taken++ % r->nslots];
+        pthread_mutex_unlock(&r->lock);
+
+        rice_encode(slot);
+
+        pthread_mutex_lock(&r->lock);
+        slot->done = 1;
+        pthread_cond_broadcast(&r->done);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Writes the oldest submitted block once it is encoded, waiting for it if
+// wait is set. Returns 1 if a block was written, 0 if not.
+static int rice_retire(struct rice_sink *r, int wait) {
+    struct rice_slot *slot = &r->slots[r->retired % r->nslots];
+    struct sink_rice_index *e;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->retired < r->submitted && !slot->done && wait)
+        pthread_cond_wait(&r->done, &r->lock);
+    if (r->retired == r->submitted || !slot->done) {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    if (r->nindex == r->index_size) {
+        size_t size = r->index_size > 0 ? 2 * r->index_size : 1024;
+        e = realloc(r->index, size * sizeof(*e));
+        if (e == NULL) {
+            r->failed = 1;
+        } else {
+            r->index = e;
+            r->index_size = size;
+        }
+    }
+    if (r->nindex < r->index_size) {
+        e = &r->index[r->nindex++];
+        e->file_offset = r->file_offset;
+        e->offset = slot->header.offset;
+        e->sample_index = slot->header.sample_index;
+        e->timestamp_ns = slot->header.timestamp_ns;
+    }
+
+    slot->header.coded_len = slot->coded_len;
+    if (write_all(r->s.fd, &slot->header, sizeof(slot->header)) != 0 ||
+        write_all(r->s.fd, slot->coded, slot->coded_len) != 0)
+        r->failed = 1;
+    r->file_offset += sizeof(slot->header) + slot->coded_len;
+
+    pthread_mutex_lock(&r->lock);
+    slot->done = 0;
+    slot->raw_len = 0;
+    r->retired++;
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+static void rice_submit(struct rice_sink *r) {
+    struct rice_slot *slot = &r->slots[r->submitted % r->nslots];
+
+    if (slot->raw_len == 0)
+        return;
+    pthread_mutex_lock(&r->lock);
+    r->submitted++;
+    pthread_cond_signal(&r->work);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Makes room in the filling slot for len more bytes
+static int rice_reserve(struct rice_slot *slot, size_t len) {
+    size_t size = slot->raw_len + len;
+    unsigned char *raw, *coded;
+
+    if (size <= slot->raw_size)
+        return 0;
+    if (size < RICE_BLOCK)
+        size = RICE_BLOCK;
+    // Partitions can come out a byte longer than verbatim, plus the tail
+    raw = realloc(slot->raw, size);
+    if (raw != NULL)
+        slot->raw = raw;
+    coded = realloc(slot->coded, size + size / SINK_RICE_PARTITION + 16);
+    if (coded != NULL)
+        slot->coded = coded;
+    if (raw == NULL || coded == NULL)
+        return -1;
+    slot->raw_size = size;
+    return 0;
+}
+
+static int rice_write(struct sink *s, const void *buf, size_t len,
+                      const struct block_info *info) {
+    struct rice_sink *r = (struct rice_sink *)s;
+    struct rice_slot *slot = &r->slots[r->submitted % r->nslots];
+
+    // A gap or a full block starts the next one
+    if (slot->raw_len > 0 &&
+        ((info != NULL && info->lost > 0) ||
+         slot->raw_len + len > RICE_BLOCK)) {
+        rice_submit(r);
+        slot = &r->slots[r->submitted % r->nslots];
+    }
+    while (rice_retire(r, r->submitted - r->retired == r->nslots))
+        ;
+    if (slot->raw_len == 0) {
+        slot->header.magic = SINK_RICE_BLOCK_MAGIC;
+        slot->header.flags = 0;
+        slot->header.offset = r->offset;
+        slot->header.sample_index = info != NULL ? info->sample_index : 0;
+        slot->header.timestamp_ns = info != NULL ? info->timestamp_ns : 0;
+        slot->header.lost = info != NULL ? info->lost : 0;
+    }
+    if (rice_reserve(slot, len) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(slot->raw + slot->raw_len, buf, len);
+    slot->raw_len += len;
+    slot->header.raw_len = slot->raw_len;
+    r->offset += len;
+
+    if (r->failed) {
+        r->failed = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void rice_close(struct rice_sink *r) {
+    if (r->slots != NULL && r->s.fd >= 0) {
+        struct sink_rice_trailer t = {
+            .magic = SINK_RICE_INDEX_MAGIC,
+            .blocks = r->nindex,
+            .index_offset = 0,
+        };
+
+        rice_submit(r);
+        while (rice_retire(r, 1))
+            ;
+        t.blocks = r->nindex;
+        t.index_offset = r->file_offset;
+        if (write_all(r->s.fd, r->index, r->nindex * sizeof(*r->index)) != 0 ||
+            write_all(r->s.fd, &t, sizeof(t)) != 0)
+            fprintf(stderr, "rice: could not write the index: %s\n",
+                    strerror(errno));
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->work);
+    pthread_mutex_unlock(&r->lock);
+    for (unsigned int i = 0; i < r->running; i++)
+        pthread_join(r->threads[i], NULL);
+    pthread_cond_destroy(&r->done);
+    pthread_cond_destroy(&r->work);
+    pthread_mutex_destroy(&r->lock);
+
+    if (r->slots != NULL && r->offset > 0)
+        fprintf(stderr, "rice: %llu bytes in %llu, %.2f:1\n",
+                (unsigned long long)r->offset,
+                (unsigned long long)r->file_offset,
+                (double)r->offset / r->file_offset);
+    for (unsigned int i = 0; r->slots != NULL && i < r->nslots; i++) {
+        free(r->slots[i].raw);
+        free(r->slots[i].coded);
+    }
+    free(r->slots);
+    free(r->index);
+    if (r->s.fd >= 0)
+        close(r->s.fd);
+}
+
+static void rice_sink_close(struct sink *s) {
+    rice_close((struct rice_sink *)s);
+}
+
+static const struct sink_ops rice_ops = {
+    .name = "rice",
+    .write = rice_write,
+    .close = rice_sink_close,
+};
+
+struct sink *rice_sink_open(const char *spec) {
+    struct sink_rice_header h = {
+        .magic = SINK_RICE_MAGIC,
+        .version = 1,
+        .header_len = sizeof(h),
+    };
+    unsigned int nthreads = RICE_DEFAULT_THREADS;
+    const char *colon = strrchr(spec, ':');
+    size_t pathlen = strlen(spec);
+    struct rice_sink *r;
+    char *path;
+
+    // A trailing :N is the thread count, any other colon part of the path
+    if (colon != NULL && colon[1] != '\0' &&
+        strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+        nthreads = strtoul(colon + 1, NULL, 10);
+        pathlen = colon - spec;
+        if (nthreads < 1 || nthreads > RICE_MAX_THREADS) {
+            fprintf(stderr, "rice: THREADS must be 1-%d, got %s\n",
+                    RICE_MAX_THREADS, colon + 1);
+            return NULL;
+        }
+    }
+    if (pathlen == 0) {
+        fprintf(stderr, "rice: expected PATH[:THREADS], got %s\n", spec);
+        return NULL;
+    }
+
+    r = (struct rice_sink *)sink_alloc(&rice_ops, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->work, NULL);
+    pthread_cond_init(&r->done, NULL);
+    r->nthreads = nthreads;
+    // Every worker busy, as many encoded waiting for the disk, one filling
+    r->nslots = 2 * nthreads + 1;
+    r->slots = calloc(r->nslots, sizeof(*r->slots));
+    path = strndup(spec, pathlen);
+    if (r->slots == NULL || path == NULL) {
+        fprintf(stderr, "rice: out of memory\n");
+        goto fail;
+    }
+    for (unsigned int i = 0; i < r->nslots; i++) {
+        if (rice_reserve(&r->slots[i], RICE_BLOCK) != 0) {
+            fprintf(stderr, "rice: out of memory\n");
+            goto fail;
+        }
+    }
+    r->s.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (r->s.fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (write_all(r->s.fd, &h, sizeof(h)) != 0) {
+        fprintf(stderr, "rice: %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    r->file_offset = sizeof(h);
+    for (; r->running < nthreads; r->running++) {
+        if (pthread_create(&r->threads[r->running], NULL, rice_worker, r) !=
+            0) {
+            fprintf(stderr, "rice: could not start the workers\n");
+            goto fail;
+        }
+    }
+    fprintf(stderr, "Compressing to %s with %u threads\n", path, nthreads);
+    free(path);
+    return &r->s;
+
+fail:
+    free(path);
+    rice_close(r);
+    free(r);
+    return NULL;
+}
+
+struct bitreader {
+    const unsigned char *p, *end;
+    uint64_t acc;
+    unsigned int n; // bits in acc
+    int overrun;    // read past the end
+};
+
+static inline void fill_bits(struct bitreader *r) {
+    while (r->n <= 56 && r->p < r->end) {
+        r->acc |= (uint64_t)*r->p++ << r->n;
+        r->n += 8;
+    }
+}
+
+// Takes the next bits (at most 32)
+static inline uint32_t get_bits(struct bitreader *r, unsigned int bits) {
+    uint32_t v;
+
+    if (bits == 0)
+        return 0;
+    if (r->n < bits)
+        fill_bits(r);
+    if (r->n < bits) {
+        r->overrun = 1;
+        r->n = bits;
+    }
+    v = (uint32_t)(r->acc & ((1ull << bits) - 1));
+    r->acc >>= bits;
+    r->n -= bits;
+    return v;
+}
+
+// Counts up to max one bits and takes the zero after them, if any
+static inline unsigned int get_unary(struct bitreader *r, unsigned int max) {
+    unsigned int q = 0;
+
+    while (q < max && get_bits(r, 1))
+        q++;
+    return q;
+}
+
+// What the selftest wants to see covered
+struct rice_counts {
+    uint64_t blocks;
+    uint64_t partitions[4]; // by order, RICE_VERBATIM included
+    uint64_t escapes;
+    uint64_t odd_tails;
+};
+
+// Decodes one block's coded data into raw_len bytes at raw
+static int rice_decode_block(const unsigned char *coded, size_t coded_len,
+                             unsigned char *raw, size_t raw_len,
+                             struct rice_counts *counts) {
+    size_t count = raw_len / sizeof(int16_t);
+    struct bitreader r = {coded, coded + coded_len - (raw_len & 1), 0, 0, 0};
+    int32_t x1 = 0, x2 = 0;
+
+    if (coded_len < (raw_len & 1))
+        return -1;
+    for (size_t i = 0; i < count; i += SINK_RICE_PARTITION) {
+        size_t n = count - i < SINK_RICE_PARTITION ? count - i
+                                                   : SINK_RICE_PARTITION;
+        uint32_t head = get_bits(&r, 7);
+        unsigned int order = head & 3, k = head >> 2;
+
+        counts->partitions[order]++;
+        if (k >= RICE_RAW_BITS)
+            return -1;
+        for (size_t j = 0; j < n; j++) {
+            int32_t x;
+
+            if (order == RICE_VERBATIM) {
+                x = (int16_t)get_bits(&r, 16);
+            } else {
+                uint32_t q = get_unary(&r, SINK_RICE_ESCAPE), u;
+                int32_t res;
+
+                if (q == SINK_RICE_ESCAPE) {
+                    u = get_bits(&r, RICE_RAW_BITS);
+                    counts->escapes++;
+                } else {
+                    u = q << k | get_bits(&r, k);
+                }
+                res = u & 1 ? -(int32_t)(u >> 1) - 1 : (int32_t)(u >> 1);
+                x = order == 0   ? res
+                    : order == 1 ? res + x1
+                                 : res + 2 * x1 - x2;
+                if (x < -32768 || x > 32767)
+                    return -1;
+            }
+            int16_t v = (int16_t)x;
+            memcpy(raw + (i + j) * sizeof(int16_t), &v, sizeof(v));
+            x2 = x1;
+            x1 = x;
+        }
+        if (r.overrun)
+            return -1;
+    }
+    if (raw_len & 1) {
+        raw[raw_len - 1] = coded[coded_len - 1];
+        counts->odd_tails++;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int rice_decode_counted(int fd, struct sink *out,
+                               struct rice_counts *counts) {
+    struct sink_rice_header h;
+    struct sink_rice_trailer t;
+    struct sink_rice_block b;
+    unsigned char *raw = NULL, *coded = NULL;
+    size_t raw_size = 0, coded_size = 0;
+    uint64_t end, pos, offset = 0;
+    struct stat st;
+    int ret = -1;
+
+    if (fstat(fd, &st) != 0 || read_all(fd, &h, sizeof(h)) != 0 ||
+        h.magic != SINK_RICE_MAGIC || h.version != 1 ||
+        h.header_len < sizeof(h)) {
+        fprintf(stderr, "rice: not a rice recording\n");
+        return -1;
+    }
+    // Blocks end at the index of a closed recording, or wherever a cut
+    // short one stops
+    end = st.st_size;
+    if (st.st_size >= (off_t)(h.header_len + sizeof(t)) &&
+        pread(fd, &t, sizeof(t), st.st_size - sizeof(t)) == sizeof(t) &&
+        t.magic == SINK_RICE_INDEX_MAGIC &&
+        t.index_offset + t.blocks * sizeof(struct sink_rice_index) +
+                sizeof(t) == (uint64_t)st.st_size)
+        end = t.index_offset;
+
+    for (pos = h.header_len; pos + sizeof(b) <= end;
+         pos += sizeof(b) + b.coded_len) {
+        struct block_info info;
+
+        if (pread(fd, &b, sizeof(b), pos) != sizeof(b) ||
+            b.magic != SINK_RICE_BLOCK_MAGIC ||
+            pos + sizeof(b) + b.coded_len > end)
+            break;
+        if (b.raw_len > raw_size || b.coded_len > coded_size) {
+            unsigned char *r = realloc(raw, b.raw_len);
+            unsigned char *c = realloc(coded, b.coded_len);
+
+            if (r != NULL)
+                raw = r;
+            if (c != NULL)
+                coded = c;
+            if (r == NULL || c == NULL) {
+                fprintf(stderr, "rice: out of memory\n");
+                goto out;
+            }
+            raw_size = b.raw_len;
+            coded_size = b.coded_len;
+        }
+        if (pread(fd, coded, b.coded_len, pos + sizeof(b)) !=
+                (ssize_t)b.coded_len ||
+            rice_decode_block(coded, b.coded_len, raw, b.raw_len, counts) !=
+                0 ||
+            b.offset != offset) {
+            fprintf(stderr, "rice: block at %llu is corrupt\n",
+                    (unsigned long long)pos);
+            goto out;
+        }
+        info = (struct block_info){
+            .timestamp_ns = b.timestamp_ns,
+            .sample_index = b.sample_index,
+            .lost = b.lost,
+        };
+        if (sink_write(out, raw, b.raw_len, &info) != 0) {
+            fprintf(stderr, "rice: write failed: %s\n", strerror(errno));
+            goto out;
+        }
+        offset += b.raw_len;
+        counts->blocks++;
+    }
+    if (pos != end)
+        fprintf(stderr, "rice: recording cut short at %llu\n",
+                (unsigned long long)pos);
+    ret = 0;
+out:
+    free(raw);
+    free(coded);
+    return ret;
+}
+
+int rice_decode(int fd, struct sink *out) {
+    struct rice_counts counts = {0};
+
+    return rice_decode_counted(fd, out, &counts);
+}
+
+// Collects the decoded stream for the selftest
+struct rice_check {
+    struct sink s;
+    unsigned char *buf;
+    size_t len, size;
+    uint64_t gaps; // blocks that say samples were lost before them
+};
+
+static int rice_check_write(struct sink *s, const void *buf, size_t len,
+                            const struct block_info *info) {
+    struct rice_check *c = (struct rice_check *)s;
+
+    if (c->len + len > c->size)
+        return -1;
+    memcpy(c->buf + c->len, buf, len);
+    c->len += len;
+    if (info != NULL && info->lost > 0)
+        c->gaps++;
+    return 0;
+}
+
+static void rice_check_close(struct sink *s) {
+    (void)s;
+}
+
+static const struct sink_ops rice_check_ops = {
+    .name = "rice-check",
+    .write = rice_check_write,
+    .close = rice_check_close,
+};
+
+// Records a stream that exercises every kind of partition and block
+// boundary, decodes it and compares. The stream is a slow tone, which
+// predicts well, with spikes in it that need escapes, then full scale
+// noise, which is stored verbatim. It is written in odd-sized pieces, with
+// a gap in the middle and more than a block in all, and ends on an odd
+// byte.
+int rice_selftest(void) {
+    const size_t len = RICE_BLOCK + RICE_BLOCK / 2 + 4097;
+    const size_t pieces[] = {1, 4096, 12289, 65536, 999, 262144};
+    char path[] = "/tmp/rx888_rice_XXXXXX";
+    unsigned char *data = malloc(len);
+    struct rice_check *c =
+        (struct rice_check *)sink_alloc(&rice_check_ops, sizeof(*c));
+    struct rice_counts counts = {0};
+    struct sink *s = NULL;
+    char spec[64];
+    int fd, ok = 0;
+
+    fd = mkstemp(path);
+    if (data == NULL || c == NULL || fd < 0) {
+        fprintf(stderr, "selftest: rice could not set up\n");
+        goto out;
+    }
+    c->buf = malloc(len);
+    c->size = len;
+    srand(0x2208);
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        size_t n = i / 2;
+        int16_t v = n < len / 4 ? (int16_t)(2000 * sin(n * 0.01)) +
+                                      (n % 5000 == 0 ? 30000 : 0)
+                                : (int16_t)rand();
+
+        memcpy(data + i, &v, sizeof(v));
+    }
+    data[len - 1] = 0x5a;
+
+    snprintf(spec, sizeof(spec), "%s:2", path);
+    s = rice_sink_open(spec);
+    if (s == NULL || c->buf == NULL)
+        goto out;
+    for (size_t off = 0, p = 0; off < len; p++) {
+        size_t n = pieces[p % (sizeof(pieces) / sizeof(pieces[0]))];
+        struct block_info info = {
+            .sample_index = off / 2,
+            .lost = p == 7 ? 1000 : 0,
+        };
+
+        if (n > len - off)
+            n = len - off;
+        if (sink_write(s, data + off, n, &info) != 0)
+            goto out;
+        off += n;
+    }
+    sink_close(s);
+    s = NULL;
+
+    ok = rice_decode_counted(fd, &c->s, &counts) == 0 && c->len == len &&
+         memcmp(c->buf, data, len) == 0 && c->gaps == 1 &&
+         counts.blocks > 2 && counts.escapes > 0 &&
+         counts.partitions[RICE_VERBATIM] > 0 && counts.odd_tails == 1;
+out:
+    fprintf(stderr, "selftest: %-8s %s\n", "rice", ok ? "ok" : "MISMATCH");
+    sink_close(s);
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    if (c != NULL)
+        free(c->buf);
+    sink_close(c != NULL ? &c->s : NULL);
+    free(data);
+    return !ok;
+}
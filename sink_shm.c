@@ -0,0 +1,165 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Shared memory sink. Every byte is copied into the ring once, however many
+ * readers there are, and readers that fall behind are overrun instead of
+ * holding up the stream; see struct sink_shm_header for the protocol.
+ *
+ * The ring is mapped twice, back to back, so that a write across the end
+ * is a single memcpy. Readers can do the same.
+ */
+
+#define SHM_DEFAULT_MB 64
+
+struct shm_sink {
+    struct sink s;
+    char name[256];
+    struct sink_shm_header *h;
+    size_t header_len;
+    unsigned char *data; // size bytes, mapped twice
+    uint64_t size;
+    uint64_t pos; // write_pos
+};
+
+static void shm_wake(struct shm_sink *u) {
+    syscall(SYS_futex, &u->h->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int shm_write(struct sink *s, const void *buf, size_t len,
+                     const struct block_info *info) {
+    struct shm_sink *u = (struct shm_sink *)s;
+    struct sink_shm_header *h = u->h;
+
+    if (len > u->size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Claim the space before overwriting it, so that readers checking
+    // claim_pos after using their data notice
+    atomic_fetch_add_explicit(&h->seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&h->claim_pos, u->pos + len, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(u->data + (u->pos & (u->size - 1)), buf, len);
+    atomic_store_explicit(&h->block_pos, u->pos, memory_order_relaxed);
+    if (info != NULL) {
+        atomic_store_explicit(&h->sample_index, info->sample_index,
+                              memory_order_relaxed);
+        atomic_store_explicit(&h->timestamp_ns, info->timestamp_ns,
+                              memory_order_relaxed);
+    }
+    u->pos += len;
+    atomic_store_explicit(&h->write_pos, u->pos, memory_order_release);
+    atomic_fetch_add_explicit(&h->seq, 1, memory_order_release);
+    shm_wake(u);
+    return 0;
+}
+
+static void shm_close(struct sink *s) {
+    struct shm_sink *u = (struct shm_sink *)s;
+
+    if (u->h != NULL) {
+        atomic_store_explicit(&u->h->closed, 1, memory_order_release);
+        atomic_fetch_add_explicit(&u->h->seq, 2, memory_order_release);
+        shm_wake(u);
+        munmap(u->h, u->header_len);
+    }
+    if (u->data != NULL)
+        munmap(u->data, 2 * u->size);
+    // Readers still attached keep their mapping
+    shm_unlink(u->name);
+}
+
+static const struct sink_ops shm_ops = {
+    .name = "shm",
+    .write = shm_write,
+    .close = shm_close,
+};
+
+struct sink *shm_sink_open(const char *spec) {
+    struct shm_sink *u;
+    const char *colon = strchr(spec, ':');
+    size_t namelen = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+    long mb = SHM_DEFAULT_MB;
+    long page = sysconf(_SC_PAGESIZE);
+    void *base;
+    int fd;
+
+    if (colon != NULL) {
+        char *end;
+        mb = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || mb < 1 || mb > 65536) {
+            fprintf(stderr, "shm: MB must be 1-65536, got %s\n", colon + 1);
+            return NULL;
+        }
+    }
+    if (namelen == 0 || namelen > 250 || memchr(spec, '/', namelen) != NULL) {
+        fprintf(stderr, "shm: expected NAME[:MB] without /, got %s\n", spec);
+        return NULL;
+    }
+
+    u = (struct shm_sink *)sink_alloc(&shm_ops, sizeof(*u));
+    if (u == NULL)
+        return NULL;
+    snprintf(u->name, sizeof(u->name), "/%.*s", (int)namelen, spec);
+    u->size = 1;
+    while (u->size < (uint64_t)mb << 20)
+        u->size <<= 1;
+    u->header_len = (size_t)page > sizeof(*u->h) ? (size_t)page : sizeof(*u->h);
+
+    // Start from a fresh object; readers of an old one see it closed
+    shm_unlink(u->name);
+    fd = shm_open(u->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "shm: could not create %s: %s\n", u->name,
+                strerror(errno));
+        free(u);
+        return NULL;
+    }
+    if (ftruncate(fd, u->header_len + u->size) != 0)
+        goto fail;
+    u->h = mmap(NULL, u->header_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (u->h == MAP_FAILED) {
+        u->h = NULL;
+        goto fail;
+    }
+    base = mmap(NULL, 2 * u->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                0);
+    if (base == MAP_FAILED)
+        goto fail;
+    u->data = base;
+    if (mmap(base, u->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+             u->header_len) == MAP_FAILED ||
+        mmap((unsigned char *)base + u->size, u->size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, u->header_len) == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    // Fault the ring in now rather than at the stream rate
+    memset(u->data, 0, u->size);
+    u->h->version = 1;
+    u->h->header_len = u->header_len;
+    u->h->size = u->size;
+    atomic_thread_fence(memory_order_release);
+    u->h->magic = SINK_SHM_MAGIC;
+    return &u->s;
+
+fail:
+    fprintf(stderr, "shm: could not map %s: %s\n", u->name, strerror(errno));
+    close(fd);
+    shm_close(&u->s);
+    free(u);
+    return NULL;
+}
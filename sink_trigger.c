@@ -0,0 +1,409 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Triggered capture. Writes go into a byte ring in memory, with a
+ * descriptor per write, and are forgotten once they are more than the
+ * pre-trigger window old. A trigger opens an event: its dump thread opens
+ * a sink of its own and writes the blocks from the start of the window
+ * on, then follows the stream until post_bytes have gone by since the
+ * last trigger. Only the dump thread touches the disk, so a slow event
+ * sink eats into the ring's margin instead of holding up the writer; if
+ * the margin runs out, writes are left out of the event, and the next
+ * block kept says the samples are lost, as a gap upstream would.
+ *
+ * The descriptors are numbered; tail..head are in the ring and
+ * dump_seq..dump_end still have to be written to the event sink.
+ */
+
+#define TRIGGER_MARGIN (16u << 20) // ring beyond the window, at least
+#define TRIGGER_OPEN UINT64_MAX    // dump_end while the event takes writes
+
+struct trigger_block {
+    uint64_t pos; // in the ring, before the modulo
+    size_t len;
+    uint64_t offset; // in the stream
+    struct block_info info;
+};
+
+struct trigger_sink {
+    struct sink base;
+    char *pattern;
+    unsigned char *data;
+    uint64_t size;
+    uint64_t pre_bytes, post_bytes;
+    struct trigger_block *blocks;
+    size_t nblocks; // descriptors allocated, a power of two
+    uint64_t pos;   // ring position of the next write
+
+    // Shared with the dump thread
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t tail, head;
+    int active; // an event is open or being written
+    uint64_t dump_seq, dump_end;
+    uint64_t post_left; // bytes until the event stops taking writes
+    unsigned int events;
+    int stop;
+    pthread_t thread;
+
+    // Writer side only
+    uint64_t dropped, dropped_samples; // writes left out of the ring
+    int drop_pending;       // the next block kept carries the gap
+    struct block_info drop; // of the first write left out
+};
+
+static struct trigger_block *trigger_desc(struct trigger_sink *t, uint64_t seq) {
+    return &t->blocks[seq & (t->nblocks - 1)];
+}
+
+// Copies spans in and out of the ring, which may wrap around its end
+static void trigger_put(struct trigger_sink *t, uint64_t pos,
+                        const unsigned char *buf, size_t len) {
+    size_t at = pos % t->size;
+    size_t first = len < t->size - at ? len : t->size - at;
+
+    memcpy(t->data + at, buf, first);
+    memcpy(t->data, buf + first, len - first);
+}
+
+static void trigger_get(struct trigger_sink *t, uint64_t pos,
+                        unsigned char *buf, size_t len) {
+    size_t at = pos % t->size;
+    size_t first = len < t->size - at ? len : t->size - at;
+
+    memcpy(buf, t->data + at, first);
+    memcpy(buf + first, t->data, len - first);
+}
+
+// The event's sink spec, with %E as its number
+static char *trigger_spec(const char *pattern, unsigned int event) {
+    size_t len = strlen(pattern) + 1;
+    char *out, *p;
+
+    for (const char *s = strstr(pattern, "%E"); s != NULL; s = strstr(s + 2, "%E"))
+        len += 8;
+    out = malloc(len);
+    if (out == NULL)
+        return NULL;
+    p = out;
+    while (*pattern != '\0') {
+        if (pattern[0] == '%' && pattern[1] == 'E') {
+            p += sprintf(p, "%04u", event);
+            pattern += 2;
+        } else {
+            *p++ = *pattern++;
+        }
+    }
+    *p = '\0';
+    return out;
+}
+
+// Writes out one event at a time. A block is copied out under the lock
+// and written without it; dump_seq keeps the writer off its bytes in the
+// meantime.
+static void *trigger_thread(void *arg) {
+    struct trigger_sink *t = arg;
+    struct sink *out = NULL;
+    unsigned char *buf = NULL;
+    size_t buf_len = 0;
+    unsigned int event = 0;
+
+    pthread_mutex_lock(&t->lock);
+    while (1) {
+        if (!t->active) {
+            if (t->stop)
+                break;
+            pthread_cond_wait(&t->cond, &t->lock);
+            continue;
+        }
+        if (out == NULL && event != t->events) {
+            char *spec = trigger_spec(t->pattern, t->events - 1);
+
+            event = t->events;
+            pthread_mutex_unlock(&t->lock);
+            out = spec != NULL ? sink_open(spec) : NULL;
+            if (out == NULL)
+                fprintf(stderr, "Trigger: could not open event %u\n",
+                        event - 1);
+            free(spec);
+            pthread_mutex_lock(&t->lock);
+            continue;
+        }
+        if (t->dump_seq < t->head && t->dump_seq < t->dump_end) {
+            struct trigger_block b = *trigger_desc(t, t->dump_seq);
+
+            if (b.len > buf_len) {
+                unsigned char *p = realloc(buf, b.len);
+                if (p == NULL) {
+                    t->dump_seq++;
+                    continue;
+                }
+                buf = p;
+                buf_len = b.len;
+            }
+            pthread_mutex_unlock(&t->lock);
+            trigger_get(t, b.pos, buf, b.len);
+            if (out != NULL && sink_write(out, buf, b.len, &b.info) != 0)
+                fprintf(stderr, "Trigger: error writing event %u: %s\n",
+                        event - 1, strerror(errno));
+            pthread_mutex_lock(&t->lock);
+            t->dump_seq++;
+            continue;
+        }
+        if (t->dump_seq == t->dump_end) {
+            // A trigger now is a new event
+            t->active = 0;
+            pthread_mutex_unlock(&t->lock);
+            if (out != NULL)
+                fprintf(stderr, "Trigger: event %u done, %llu bytes\n",
+                        event - 1, (unsigned long long)out->bytes);
+            sink_close(out);
+            out = NULL;
+            pthread_mutex_lock(&t->lock);
+            continue;
+        }
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    free(buf);
+    return NULL;
+}
+
+// Doubles the descriptors, keeping every one at its number
+static int trigger_grow(struct trigger_sink *t) {
+    size_t n = 2 * t->nblocks;
+    struct trigger_block *blocks = malloc(n * sizeof(*blocks));
+
+    if (blocks == NULL)
+        return -1;
+    for (uint64_t seq = t->tail; seq < t->head; seq++)
+        blocks[seq & (n - 1)] = *trigger_desc(t, seq);
+    free(t->blocks);
+    t->blocks = blocks;
+    t->nblocks = n;
+    return 0;
+}
+
+// Remembers a write left out of the ring until the next one is kept
+static void trigger_drop(struct trigger_sink *t,
+                         const struct block_info *info) {
+    t->dropped++;
+    if (info == NULL)
+        return;
+    if (!t->drop_pending) {
+        t->drop = *info;
+        t->drop_pending = 1;
+    } else {
+        t->drop.lost_usb |= info->lost_usb;
+        t->drop.lost_rate |= info->lost_rate;
+        t->drop.restarted |= info->restarted;
+    }
+}
+
+// Books the writes left out since the last kept block as lost before b,
+// from the first sample missing to the first one that is there
+static void trigger_mark(struct trigger_sink *t, struct block_info *b) {
+    if (!t->drop_pending)
+        return;
+    if (b->sample_index < t->drop.sample_index + b->lost) {
+        // The count went back, as after a reset: there is a gap, of
+        // unknown size
+        b->lost = b->lost > 0 ? b->lost : 1;
+        b->restarted = 1;
+    } else {
+        t->dropped_samples +=
+            b->sample_index - t->drop.sample_index - b->lost;
+        b->lost = b->sample_index - t->drop.sample_index + t->drop.lost;
+    }
+    b->lost_usb |= t->drop.lost_usb;
+    b->lost_rate |= t->drop.lost_rate;
+    b->restarted |= t->drop.restarted;
+    t->drop_pending = 0;
+}
+
+static int trigger_write(struct sink *s, const void *buf, size_t len,
+                         const struct block_info *info) {
+    struct trigger_sink *t = (struct trigger_sink *)s;
+    struct trigger_block *b;
+    int wake = 0;
+
+    if (len > t->size) {
+        trigger_drop(t, info);
+        return 0;
+    }
+    pthread_mutex_lock(&t->lock);
+    // Make room, but never take blocks the dump thread has yet to write
+    while (t->tail < t->head) {
+        const struct trigger_block *old = trigger_desc(t, t->tail);
+
+        if (t->pos + len - old->pos <= t->size &&
+            t->pos - (old->pos + old->len) < t->pre_bytes)
+            break;
+        if (t->active && t->tail >= t->dump_seq)
+            break;
+        t->tail++;
+    }
+    if ((t->tail < t->head &&
+         t->pos + len - trigger_desc(t, t->tail)->pos > t->size) ||
+        (t->head - t->tail == t->nblocks && trigger_grow(t) != 0)) {
+        // Behind on dumping: the write is missing from the event, and the
+        // blocks already in the ring stay intact
+        pthread_mutex_unlock(&t->lock);
+        trigger_drop(t, info);
+        return 0;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    // Outside the lock: the dump thread only reads blocks before head
+    trigger_put(t, t->pos, buf, len);
+
+    pthread_mutex_lock(&t->lock);
+    b = trigger_desc(t, t->head);
+    b->pos = t->pos;
+    b->len = len;
+    b->offset = s->bytes;
+    if (info != NULL) {
+        b->info = *info;
+        trigger_mark(t, &b->info);
+    } else {
+        memset(&b->info, 0, sizeof(b->info));
+    }
+    t->pos += len;
+    t->head++;
+    if (t->active && t->dump_end == TRIGGER_OPEN) {
+        if (t->post_left <= len) {
+            t->post_left = 0;
+            t->dump_end = t->head;
+        } else {
+            t->post_left -= len;
+        }
+        wake = 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (wake)
+        pthread_cond_signal(&t->cond);
+    return 0;
+}
+
+int trigger_sink_fire(struct sink *s, struct trigger_event *ev) {
+    struct trigger_sink *t = (struct trigger_sink *)s;
+    int started = 0;
+    uint64_t seq;
+
+    pthread_mutex_lock(&t->lock);
+    if (!t->active) {
+        // The newest block that reaches back a whole window
+        seq = t->head;
+        while (seq > t->tail &&
+               t->pos - trigger_desc(t, seq - 1)->pos <= t->pre_bytes)
+            seq--;
+        if (seq > t->tail)
+            seq--;
+        t->dump_seq = seq;
+        t->active = 1;
+        t->events++;
+        started = 1;
+    } else {
+        seq = t->dump_seq;
+    }
+    // Retriggering, also while the end is still being written, makes the
+    // event go on
+    t->dump_end = TRIGGER_OPEN;
+    t->post_left = t->post_bytes;
+    ev->number = t->events - 1;
+    if (started && seq < t->head) {
+        const struct trigger_block *b = trigger_desc(t, seq);
+
+        ev->offset = b->offset;
+        ev->sample_index = b->info.sample_index;
+        ev->timestamp_ns = b->info.timestamp_ns;
+    } else if (started) {
+        ev->offset = s->bytes;
+        ev->sample_index = 0;
+        ev->timestamp_ns = 0;
+    }
+    pthread_mutex_unlock(&t->lock);
+    pthread_cond_signal(&t->cond);
+    return started;
+}
+
+static void trigger_close(struct sink *s) {
+    struct trigger_sink *t = (struct trigger_sink *)s;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->active && t->dump_end == TRIGGER_OPEN)
+        t->dump_end = t->head;
+    t->stop = 1;
+    pthread_mutex_unlock(&t->lock);
+    pthread_cond_signal(&t->cond);
+    pthread_join(t->thread, NULL);
+
+    fprintf(stderr, "Trigger: %u events", t->events);
+    if (t->dropped > 0)
+        fprintf(stderr, ", %llu writes (%llu samples) dropped",
+                (unsigned long long)t->dropped,
+                (unsigned long long)t->dropped_samples);
+    fprintf(stderr, "\n");
+    munmap(t->data, t->size);
+    free(t->blocks);
+    free(t->pattern);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+}
+
+static const struct sink_ops trigger_ops = {
+    .name = "trigger",
+    .write = trigger_write,
+    .close = trigger_close,
+};
+
+struct sink *trigger_sink_open(const char *pattern, uint64_t pre_bytes,
+                               uint64_t post_bytes) {
+    struct trigger_sink *t;
+    uint64_t margin = pre_bytes / 4 > TRIGGER_MARGIN ? pre_bytes / 4
+                                                     : TRIGGER_MARGIN;
+
+    t = (struct trigger_sink *)sink_alloc(&trigger_ops, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+    t->pre_bytes = pre_bytes;
+    t->post_bytes = post_bytes;
+    t->size = pre_bytes + margin;
+    t->nblocks = 1024;
+    t->pattern = strdup(pattern);
+    t->blocks = malloc(t->nblocks * sizeof(*t->blocks));
+    // Faulted in now rather than on the first pass at the stream rate
+    t->data = mmap(NULL, t->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (t->data == MAP_FAILED || t->pattern == NULL || t->blocks == NULL) {
+        fprintf(stderr, "Trigger: could not allocate a %llu MB ring: %s\n",
+                (unsigned long long)(t->size >> 20), strerror(errno));
+        if (t->data != MAP_FAILED)
+            munmap(t->data, t->size);
+        free(t->pattern);
+        free(t->blocks);
+        free(t);
+        return NULL;
+    }
+    madvise(t->data, t->size, MADV_HUGEPAGE);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, trigger_thread, t) != 0) {
+        fprintf(stderr, "Trigger: could not start the dump thread\n");
+        munmap(t->data, t->size);
+        free(t->pattern);
+        free(t->blocks);
+        free(t);
+        return NULL;
+    }
+    fprintf(stderr, "Trigger: %llu MB ring, events to %s\n",
+            (unsigned long long)(t->size >> 20), pattern);
+    return &t->base;
+}
@@ -0,0 +1,282 @@
+#include "spectrum.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void spectrum_work(struct spectrum_worker *w) {
+    struct spectrum *s = w->s;
+    size_t per = (s->count + s->nthreads - 1) / s->nthreads;
+    size_t first = s->first + w->id * per;
+    size_t last = s->first + s->count;
+    unsigned int stride = s->complex_in ? 2 : 1;
+
+    if (first + per < last)
+        last = first + per;
+    for (size_t t = first; t < last; t++) {
+        const float *x = s->in + t * s->hop * stride;
+        float complex *v = w->scratch;
+
+        if (s->complex_in) {
+            for (unsigned int j = 0; j < s->size; j++)
+                v[j] = s->window[j] * (x[2 * j] + x[2 * j + 1] * I);
+            fft_forward(&s->fft, v);
+            for (unsigned int k = 0; k < s->size; k++)
+                w->acc[k] += crealf(v[k]) * crealf(v[k]) +
+                             cimagf(v[k]) * cimagf(v[k]);
+            continue;
+        }
+
+        // Even samples as real and odd as imaginary parts, then split the
+        // half-size transform Z into the even and odd sample spectra:
+        //   E[k] = (Z[k] + Z*[h - k]) / 2, O[k] = (Z[k] - Z*[h - k]) / 2j
+        //   X[k] = E[k] + exp(-2*pi*i*k/size) * O[k]
+        unsigned int h = s->size / 2;
+        for (unsigned int j = 0; j < h; j++)
+            v[j] = s->window[2 * j] * x[2 * j] +
+                   s->window[2 * j + 1] * x[2 * j + 1] * I;
+        fft_forward(&s->fft, v);
+        for (unsigned int k = 0; k < h; k++) {
+            float complex z = v[k];
+            float complex zc = conjf(v[(h - k) & (h - 1)]);
+            float complex xk = 0.5f * (z + zc) - 0.5f * I * s->post[k] * (z - zc);
+            w->acc[k] += crealf(xk) * crealf(xk) + cimagf(xk) * cimagf(xk);
+        }
+    }
+}
+
+static void *spectrum_thread(void *arg) {
+    struct spectrum_worker *w = arg;
+    struct spectrum *s = w->s;
+    unsigned int seen = 0;
+
+    while (1) {
+        int stop;
+
+        pthread_mutex_lock(&s->lock);
+        while (s->gen == seen && !s->stop)
+            pthread_cond_wait(&s->wake, &s->lock);
+        seen = s->gen;
+        stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
+
+        spectrum_work(w);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->running == 0)
+            pthread_cond_signal(&s->idle);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+static size_t frame_bytes(const struct spectrum *s) {
+    return sizeof(struct spectrum_header) + s->bins * sizeof(float);
+}
+
+// Adds up the worker accumulators into a frame at dst and clears them
+static void spectrum_emit(struct spectrum *s, const struct block_info *info,
+                          unsigned char *dst) {
+    struct spectrum_header *h = (struct spectrum_header *)dst;
+    float *p = (float *)(dst + sizeof(*h));
+    double wsum = 0.0, scale;
+
+    memset(h, 0, sizeof(*h));
+    h->magic = SPECTRUM_MAGIC;
+    h->version = 1;
+    h->header_len = sizeof(*h);
+    h->bins = s->bins;
+    h->frames = s->avg;
+    h->flags = s->complex_in ? SPECTRUM_COMPLEX : 0;
+    if (info != NULL) {
+        h->sample_index = info->sample_index;
+        h->timestamp_ns = info->timestamp_ns;
+    }
+
+    // A full-scale tone then reads 0 dB; a real one has half its power in
+    // the negative frequencies that are not output
+    for (unsigned int j = 0; j < s->size; j++)
+        wsum += s->window[j];
+    scale = 1.0 / ((double)s->avg * (wsum * 32768.0) * (wsum * 32768.0));
+    if (!s->complex_in)
+        scale *= 4.0;
+
+    for (unsigned int k = 0; k < s->bins; k++) {
+        // Complex spectra start at -fs / 2
+        unsigned int b = s->complex_in ? (k + s->bins / 2) & (s->bins - 1) : k;
+        double sum = 0.0;
+
+        for (unsigned int t = 0; t < s->nthreads; t++) {
+            sum += s->workers[t].acc[b];
+            s->workers[t].acc[b] = 0.0f;
+        }
+        p[k] = (float)(10.0 * log10(sum * scale + 1e-30));
+    }
+}
+
+int spectrum_init(struct spectrum *s, unsigned int size, unsigned int avg,
+                  int complex_in, unsigned int nthreads, size_t max_in,
+                  const struct rt_cpus *cpus, struct arena *arena) {
+    unsigned int stride = complex_in ? 2 : 1;
+
+    memset(s, 0, sizeof(*s));
+    if (nthreads < 1)
+        nthreads = 1;
+    if (avg < 1)
+        avg = 1;
+    if (size < 16 || fft_init(&s->fft, complex_in ? size : size / 2) != 0) {
+        fprintf(stderr, "Spectrum size must be a power of two of at least 16\n");
+        return -1;
+    }
+
+    s->size = size;
+    s->bins = complex_in ? size : size / 2;
+    s->hop = size / 2;
+    s->avg = avg;
+    s->complex_in = complex_in;
+    s->nthreads = nthreads;
+    s->arena = arena;
+    s->cap = size + max_in;
+    s->max_frames = (max_in / s->hop + 1) / avg + 1;
+    s->window = malloc(size * sizeof(float));
+    s->in = arena_alloc(arena, s->cap * stride * sizeof(float));
+    s->obuf = arena_alloc(arena, s->max_frames * frame_bytes(s));
+    s->workers = calloc(nthreads, sizeof(struct spectrum_worker));
+    s->nworkers = nthreads;
+    if (s->window == NULL || s->in == NULL || s->obuf == NULL ||
+        s->workers == NULL)
+        goto fail;
+    if (!complex_in) {
+        s->post = malloc(size / 2 * sizeof(float complex));
+        if (s->post == NULL)
+            goto fail;
+        for (unsigned int k = 0; k < size / 2; k++) {
+            double a = -2.0 * M_PI * k / size;
+            s->post[k] = (float)cos(a) + (float)sin(a) * I;
+        }
+    }
+
+    // Periodic Hann, which sums to a constant at half overlap
+    for (unsigned int j = 0; j < size; j++)
+        s->window[j] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * j / size));
+
+    for (unsigned int t = 0; t < nthreads; t++) {
+        s->workers[t].s = s;
+        s->workers[t].id = t;
+        s->workers[t].scratch =
+            arena_alloc(arena, s->bins * sizeof(float complex));
+        s->workers[t].acc = arena_alloc(arena, s->bins * sizeof(float));
+        if (s->workers[t].scratch == NULL || s->workers[t].acc == NULL)
+            goto fail;
+    }
+
+    // The calling thread does the share of worker 0
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    s->started = 1;
+    for (unsigned int t = 1; t < nthreads; t++) {
+        if (pthread_create(&s->workers[t].thread, NULL, spectrum_thread,
+                           &s->workers[t]) != 0) {
+            fprintf(stderr, "Could only start %u spectrum threads\n", t);
+            break;
+        }
+        if (cpus != NULL)
+            rt_pin(s->workers[t].thread, cpus, t - 1);
+        s->started++;
+    }
+    // Work is only shared out between the threads that are running
+    s->nthreads = s->started;
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to set up spectrum\n");
+    spectrum_free(s);
+    return -1;
+}
+
+void spectrum_free(struct spectrum *s) {
+    if (s->started) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        for (unsigned int t = 1; t < s->started; t++)
+            pthread_join(s->workers[t].thread, NULL);
+        pthread_cond_destroy(&s->idle);
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+    }
+    if (s->workers != NULL) {
+        for (unsigned int t = 0; t < s->nworkers; t++) {
+            arena_free(s->arena, s->workers[t].scratch);
+            arena_free(s->arena, s->workers[t].acc);
+        }
+        free(s->workers);
+    }
+    free(s->window);
+    free(s->post);
+    arena_free(s->arena, s->in);
+    arena_free(s->arena, s->obuf);
+    fft_free(&s->fft);
+    memset(s, 0, sizeof(*s));
+}
+
+size_t spectrum_process(struct spectrum *s, const float *i, const float *q,
+                        size_t n, const struct block_info *info,
+                        const unsigned char **out) {
+    unsigned int stride = s->complex_in ? 2 : 1;
+    float *dst = s->in + s->avail * stride;
+    size_t total, used, len = 0;
+
+    if (q != NULL) {
+        for (size_t k = 0; k < n; k++) {
+            dst[2 * k] = i[k];
+            dst[2 * k + 1] = q[k];
+        }
+    } else {
+        memcpy(dst, i, n * sizeof(float));
+    }
+    s->avail += n;
+    *out = s->obuf;
+    if (s->avail < s->size)
+        return 0;
+
+    // Batches end where a frame does, so each one's accumulators can be
+    // emitted before the next starts
+    total = (s->avail - s->size) / s->hop + 1;
+    for (s->first = 0; s->first < total; s->first += s->count) {
+        s->count = total - s->first;
+        if (s->count > s->avg - s->done)
+            s->count = s->avg - s->done;
+
+        pthread_mutex_lock(&s->lock);
+        s->running = s->nthreads - 1;
+        s->gen++;
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+
+        spectrum_work(&s->workers[0]);
+
+        pthread_mutex_lock(&s->lock);
+        while (s->running > 0)
+            pthread_cond_wait(&s->idle, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+
+        s->done += s->count;
+        if (s->done == s->avg) {
+            spectrum_emit(s, info, s->obuf + len);
+            len += frame_bytes(s);
+            s->done = 0;
+        }
+    }
+
+    // Keep the samples the next transforms still need
+    used = total * s->hop;
+    s->avail -= used;
+    memmove(s->in, s->in + used * stride, s->avail * stride * sizeof(float));
+    return len;
+}
@@ -0,0 +1,103 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <complex.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "fft.h"
+#include "rt.h"
+#include "sink.h"
+
+/*
+ * Averaged power spectrum. The stream is cut into Hann-windowed transforms
+ * of size samples overlapping by half, and every avg of them are averaged
+ * into one frame. Real input uses a half-size complex FFT and gives size / 2
+ * bins from DC up to just below fs / 2. Complex input gives size bins,
+ * ordered from -fs / 2 up to just below fs / 2.
+ *
+ * The transforms of a block are shared out between a pool of threads, each
+ * summing into its own accumulator; the calling thread adds those up when
+ * a frame is complete.
+ */
+
+// Starts every frame, followed by bins float32 values: the mean power of
+// each bin in dB relative to a full-scale (32768) tone. All fields little
+// endian.
+#define SPECTRUM_MAGIC 0x50535852 // "RXSP"
+#define SPECTRUM_COMPLEX 1
+struct spectrum_header {
+    uint32_t magic;
+    uint16_t version;      // 1
+    uint16_t header_len;   // sizeof(struct spectrum_header)
+    uint32_t bins;
+    uint32_t frames;       // transforms averaged
+    uint32_t flags;        // SPECTRUM_COMPLEX
+    uint32_t reserved;
+    uint64_t sample_index; // block_info of the block that ended the frame
+    uint64_t timestamp_ns;
+};
+
+struct spectrum;
+
+struct spectrum_worker {
+    struct spectrum *s;
+    unsigned int id;
+    pthread_t thread;
+    float complex *scratch; // one transform
+    float *acc;             // power summed over this worker's transforms
+};
+
+struct spectrum {
+    unsigned int size;
+    unsigned int bins;
+    unsigned int hop;
+    unsigned int avg;
+    int complex_in;
+    unsigned int nthreads;
+    float *window;
+    float complex *post; // exp(-2*pi*i*k/size), real input only
+
+    float *in; // unconsumed input, interleaved I and Q for complex
+    size_t avail;
+    size_t cap;
+
+    size_t first;   // transforms being processed
+    size_t count;
+    unsigned int done; // transforms in the frame so far
+
+    unsigned char *obuf; // frames completed by one block
+    size_t max_frames;
+
+    struct fft fft;
+    struct spectrum_worker *workers;
+    unsigned int nworkers; // allocated, nthreads of them are running
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a new batch (gen) or stop
+    pthread_cond_t idle; // all helper threads finished the batch
+    unsigned int gen;
+    unsigned int running;
+    int stop;
+    unsigned int started;
+    struct arena *arena;
+};
+
+// size must be a power of two of at least 16. Blocks passed in are at most
+// max_in samples. Worker threads are spread one per CPU over cpus, if
+// given. Block buffers come from arena, which may be NULL. Returns 0 on
+// success, -1 on failure (reported on stderr).
+int spectrum_init(struct spectrum *s, unsigned int size, unsigned int avg,
+                  int complex_in, unsigned int nthreads, size_t max_in,
+                  const struct rt_cpus *cpus, struct arena *arena);
+void spectrum_free(struct spectrum *s);
+
+// Adds n samples, given as separate I and Q arrays for complex input (q is
+// NULL for real input). Sets *out to the frames completed, valid until the
+// next call, and returns their length in bytes, 0 if there are none.
+size_t spectrum_process(struct spectrum *s, const float *i, const float *q,
+                        size_t n, const struct block_info *info,
+                        const unsigned char **out);
+
+#endif
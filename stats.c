@@ -0,0 +1,392 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *status_names[STATS_STATUS_MAX] = {
+    "completed", "error", "timed_out", "cancelled",
+    "stall",     "no_device", "overflow", "other",
+};
+
+#define RELAXED memory_order_relaxed
+
+uint64_t stats_hist_bound(unsigned int bucket) {
+    unsigned int o, q;
+
+    if (bucket == 0)
+        return 1024;
+    o = (bucket - 1) / 4;
+    q = (bucket - 1) % 4;
+    return (uint64_t)(5 + q) << (o + 8);
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t ns) {
+    unsigned int b = 0;
+
+    if (ns >= 1024) {
+        unsigned int log2 = 63 - __builtin_clzll(ns);
+        b = 1 + 4 * (log2 - 10) + ((ns >> (log2 - 2)) & 3);
+        if (b >= STATS_HIST_BUCKETS)
+            b = STATS_HIST_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&h->bucket[b], 1, RELAXED);
+    // Single writer per histogram, so no compare-and-swap loop needed
+    if (ns > atomic_load_explicit(&h->max_ns, RELAXED))
+        atomic_store_explicit(&h->max_ns, ns, RELAXED);
+}
+
+void stats_transfer(struct stats *s, int status, size_t bytes) {
+    if (status == 0) {
+        atomic_fetch_add_explicit(&s->transfers, 1, RELAXED);
+        atomic_fetch_add_explicit(&s->bytes, bytes, RELAXED);
+        return;
+    }
+    if (status < 0 || status >= STATS_STATUS_MAX)
+        status = STATS_STATUS_MAX - 1;
+    atomic_fetch_add_explicit(&s->failed[status], 1, RELAXED);
+}
+
+void stats_block(struct stats *s, size_t samples, bool lost) {
+    if (!lost) {
+        s->in_gap = false;
+        return;
+    }
+    if (!s->in_gap)
+        atomic_fetch_add_explicit(&s->gaps, 1, RELAXED);
+    s->in_gap = true;
+    atomic_fetch_add_explicit(&s->gap_samples, samples, RELAXED);
+}
+
+void stats_short(struct stats *s) {
+    atomic_fetch_add_explicit(&s->short_transfers, 1, RELAXED);
+}
+
+void stats_rate_gap(struct stats *s, uint64_t samples) {
+    atomic_fetch_add_explicit(&s->rate_gaps, 1, RELAXED);
+    atomic_fetch_add_explicit(&s->rate_samples, samples, RELAXED);
+}
+
+void stats_fill(struct stats *s, uint64_t samples) {
+    atomic_fetch_add_explicit(&s->filled, samples, RELAXED);
+}
+
+void stats_write(struct stats *s, size_t bytes, bool ok, uint64_t ns) {
+    if (ok)
+        atomic_fetch_add_explicit(&s->written, bytes, RELAXED);
+    else
+        atomic_fetch_add_explicit(&s->write_errors, 1, RELAXED);
+    stats_hist_add(&s->write, ns);
+}
+
+// The one reporting thread, over all devices
+static struct {
+    struct stats *devs;
+    unsigned int ndevs;
+    unsigned int interval; // seconds between reports, 0 for SIGUSR1 only
+    FILE *json;
+    sem_t sem;
+    pthread_t thread;
+    atomic_bool stop;
+    bool started;
+    struct stats_snapshot *start, *prev; // ndevs each
+} reporter;
+
+static uint64_t hist_max(struct stats_hist *h) {
+    return atomic_load_explicit(&h->max_ns, RELAXED);
+}
+
+static void snapshot(struct stats *s, struct stats_snapshot *snap) {
+    snap->time_ns = stats_now_ns();
+    snap->transfers = atomic_load_explicit(&s->transfers, RELAXED);
+    snap->bytes = atomic_load_explicit(&s->bytes, RELAXED);
+    for (unsigned int i = 0; i < STATS_STATUS_MAX; i++)
+        snap->failed[i] = atomic_load_explicit(&s->failed[i], RELAXED);
+    snap->gaps = atomic_load_explicit(&s->gaps, RELAXED);
+    snap->gap_samples = atomic_load_explicit(&s->gap_samples, RELAXED);
+    snap->short_transfers = atomic_load_explicit(&s->short_transfers, RELAXED);
+    snap->rate_gaps = atomic_load_explicit(&s->rate_gaps, RELAXED);
+    snap->rate_samples = atomic_load_explicit(&s->rate_samples, RELAXED);
+    snap->filled = atomic_load_explicit(&s->filled, RELAXED);
+    snap->written = atomic_load_explicit(&s->written, RELAXED);
+    snap->write_errors = atomic_load_explicit(&s->write_errors, RELAXED);
+    for (unsigned int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        snap->callback[b] =
+            atomic_load_explicit(&s->callback.bucket[b], RELAXED);
+        snap->write[b] = atomic_load_explicit(&s->write.bucket[b], RELAXED);
+        snap->latency[b] =
+            atomic_load_explicit(&s->latency.bucket[b], RELAXED);
+    }
+    snap->callback_max = hist_max(&s->callback);
+    snap->write_max = hist_max(&s->write);
+    snap->latency_max = hist_max(&s->latency);
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b) { return a > b ? a : b; }
+
+static void snapshot_add(struct stats_snapshot *sum,
+                         const struct stats_snapshot *s) {
+    sum->time_ns = s->time_ns;
+    sum->transfers += s->transfers;
+    sum->bytes += s->bytes;
+    for (unsigned int i = 0; i < STATS_STATUS_MAX; i++)
+        sum->failed[i] += s->failed[i];
+    sum->gaps += s->gaps;
+    sum->gap_samples += s->gap_samples;
+    sum->short_transfers += s->short_transfers;
+    sum->rate_gaps += s->rate_gaps;
+    sum->rate_samples += s->rate_samples;
+    sum->filled += s->filled;
+    sum->written += s->written;
+    sum->write_errors += s->write_errors;
+    for (unsigned int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        sum->callback[b] += s->callback[b];
+        sum->write[b] += s->write[b];
+        sum->latency[b] += s->latency[b];
+    }
+    sum->callback_max = max_u64(sum->callback_max, s->callback_max);
+    sum->write_max = max_u64(sum->write_max, s->write_max);
+    sum->latency_max = max_u64(sum->latency_max, s->latency_max);
+}
+
+static uint64_t total_failed(const struct stats_snapshot *s) {
+    uint64_t n = 0;
+
+    for (unsigned int i = 1; i < STATS_STATUS_MAX; i++)
+        n += s->failed[i];
+    return n;
+}
+
+// Upper bound in ns of the bucket holding the given fraction of the
+// samples between two snapshots of a histogram, capped at the maximum
+static uint64_t hist_percentile(const uint64_t *from, const uint64_t *to,
+                                uint64_t max, double frac) {
+    uint64_t count[STATS_HIST_BUCKETS], total = 0, seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        count[b] = to[b] - from[b];
+        total += count[b];
+    }
+    if (total == 0)
+        return 0;
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += count[b];
+        if (seen >= frac * total)
+            break;
+    }
+    if (b >= STATS_HIST_BUCKETS || stats_hist_bound(b) > max)
+        return max;
+    return stats_hist_bound(b);
+}
+
+static void json_hist(FILE *f, const char *name, const uint64_t *from,
+                      const uint64_t *to, uint64_t max) {
+    fprintf(f,
+            ",\"%s\":{\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+            "\"max_ns\":%llu,\"buckets\":[",
+            name, (unsigned long long)hist_percentile(from, to, max, 0.5),
+            (unsigned long long)hist_percentile(from, to, max, 0.99),
+            (unsigned long long)hist_percentile(from, to, max, 0.999),
+            (unsigned long long)max);
+    for (unsigned int b = 0; b < STATS_HIST_BUCKETS; b++)
+        fprintf(f, "%s%llu", b ? "," : "",
+                (unsigned long long)(to[b] - from[b]));
+    fprintf(f, "]}");
+}
+
+static void text_hist(const char *name, const uint64_t *from,
+                      const uint64_t *to, uint64_t max) {
+    fprintf(stderr, ", %s p50 <%.1fus p99 <%.1fus p99.9 <%.1fus max %.1fus",
+            name, hist_percentile(from, to, max, 0.5) / 1e3,
+            hist_percentile(from, to, max, 0.99) / 1e3,
+            hist_percentile(from, to, max, 0.999) / 1e3, max / 1e3);
+}
+
+// Reports the rates between two snapshots and the cumulative counters.
+// dev is the device number, or -1 for the aggregate.
+static void report(const struct stats_snapshot *from,
+                   const struct stats_snapshot *now, const char *what,
+                   int dev) {
+    double dt = (now->time_ns - from->time_ns) / 1e9;
+    char label[64];
+
+    if (dt <= 0)
+        dt = 1e-9;
+    if (dev >= 0)
+        snprintf(label, sizeof(label), "%s dev%d", what, dev);
+    else
+        snprintf(label, sizeof(label), "%s", what);
+
+    fprintf(stderr,
+            "%s: %.1f MB/s in, %.1f MB/s out, %.0f xfers/s, %llu failed, "
+            "%llu gaps (%llu samples)",
+            label, (now->bytes - from->bytes) / dt / 1e6,
+            (now->written - from->written) / dt / 1e6,
+            (now->transfers - from->transfers) / dt,
+            (unsigned long long)(total_failed(now) - total_failed(from)),
+            (unsigned long long)now->gaps,
+            (unsigned long long)now->gap_samples);
+    // Only once there is something to tell
+    if (now->short_transfers > 0 || now->rate_gaps > 0)
+        fprintf(stderr, ", %llu short, %llu rate gaps (%llu samples)",
+                (unsigned long long)now->short_transfers,
+                (unsigned long long)now->rate_gaps,
+                (unsigned long long)now->rate_samples);
+    if (now->filled > 0)
+        fprintf(stderr, ", %llu filled", (unsigned long long)now->filled);
+    text_hist("callback", from->callback, now->callback, now->callback_max);
+    text_hist("write", from->write, now->write, now->write_max);
+    text_hist("latency", from->latency, now->latency, now->latency_max);
+    fprintf(stderr, "\n");
+
+    if (reporter.json != NULL) {
+        FILE *f = reporter.json;
+        fprintf(f, "{\"type\":\"%s\",", what);
+        if (dev >= 0)
+            fprintf(f, "\"device\":%d,", dev);
+        fprintf(f,
+                "\"time_ns\":%llu,\"interval_s\":%.6f,"
+                "\"in_bytes_per_s\":%.0f,\"out_bytes_per_s\":%.0f,"
+                "\"transfers_per_s\":%.1f,\"transfers\":%llu,\"bytes\":%llu,"
+                "\"written\":%llu,\"write_errors\":%llu,\"gaps\":%llu,"
+                "\"gap_samples\":%llu,\"short_transfers\":%llu,"
+                "\"rate_gaps\":%llu,\"rate_samples\":%llu,\"filled\":%llu,"
+                "\"failed\":{",
+                (unsigned long long)now->time_ns, dt,
+                (now->bytes - from->bytes) / dt,
+                (now->written - from->written) / dt,
+                (now->transfers - from->transfers) / dt,
+                (unsigned long long)now->transfers,
+                (unsigned long long)now->bytes,
+                (unsigned long long)now->written,
+                (unsigned long long)now->write_errors,
+                (unsigned long long)now->gaps,
+                (unsigned long long)now->gap_samples,
+                (unsigned long long)now->short_transfers,
+                (unsigned long long)now->rate_gaps,
+                (unsigned long long)now->rate_samples,
+                (unsigned long long)now->filled);
+        for (unsigned int i = 1; i < STATS_STATUS_MAX; i++)
+            fprintf(f, "%s\"%s\":%llu", i > 1 ? "," : "", status_names[i],
+                    (unsigned long long)now->failed[i]);
+        fprintf(f, "}");
+        json_hist(f, "callback", from->callback, now->callback,
+                  now->callback_max);
+        json_hist(f, "write", from->write, now->write, now->write_max);
+        json_hist(f, "latency", from->latency, now->latency,
+                  now->latency_max);
+        fprintf(f, "}\n");
+        fflush(f);
+    }
+}
+
+// Reports every device since from[], then all of them together
+static void report_all(const struct stats_snapshot *from, const char *what) {
+    struct stats_snapshot now, sum = {0}, sum_from = {0};
+
+    for (unsigned int d = 0; d < reporter.ndevs; d++) {
+        snapshot(&reporter.devs[d], &now);
+        if (reporter.ndevs > 1)
+            report(&from[d], &now, what, d);
+        snapshot_add(&sum, &now);
+        snapshot_add(&sum_from, &from[d]);
+        reporter.prev[d] = now;
+    }
+    report(&sum_from, &sum, what, -1);
+}
+
+static void *stats_thread(void *arg) {
+    (void)arg;
+    while (!atomic_load(&reporter.stop)) {
+        int ret;
+
+        if (reporter.interval > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += reporter.interval;
+            ret = sem_timedwait(&reporter.sem, &ts);
+        } else {
+            ret = sem_wait(&reporter.sem);
+        }
+        if (ret != 0 && errno == EINTR)
+            continue;
+        if (atomic_load(&reporter.stop))
+            break;
+        report_all(reporter.prev, "stats");
+    }
+    return NULL;
+}
+
+static void sigusr1(int sig) {
+    (void)sig;
+    if (reporter.started)
+        sem_post(&reporter.sem);
+}
+
+int stats_start(struct stats *devs, unsigned int ndevs, unsigned int interval,
+                FILE *json) {
+    struct sigaction sa;
+
+    reporter.devs = devs;
+    reporter.ndevs = ndevs;
+    reporter.interval = interval;
+    reporter.json = json;
+    reporter.start = calloc(ndevs, sizeof(struct stats_snapshot));
+    reporter.prev = calloc(ndevs, sizeof(struct stats_snapshot));
+    if (reporter.start == NULL || reporter.prev == NULL)
+        goto fail;
+    for (unsigned int d = 0; d < ndevs; d++) {
+        snapshot(&devs[d], &reporter.start[d]);
+        reporter.prev[d] = reporter.start[d];
+    }
+    if (sem_init(&reporter.sem, 0, 0) != 0)
+        goto fail;
+    if (pthread_create(&reporter.thread, NULL, stats_thread, NULL) != 0) {
+        sem_destroy(&reporter.sem);
+        goto fail;
+    }
+    reporter.started = true;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    return 0;
+
+fail:
+    free(reporter.start);
+    free(reporter.prev);
+    reporter.start = reporter.prev = NULL;
+    return -1;
+}
+
+void stats_stop(void) {
+    struct stats_snapshot sum = {0};
+
+    if (!reporter.started)
+        return;
+    signal(SIGUSR1, SIG_IGN);
+    atomic_store(&reporter.stop, true);
+    sem_post(&reporter.sem);
+    pthread_join(reporter.thread, NULL);
+    sem_destroy(&reporter.sem);
+    reporter.started = false;
+
+    report_all(reporter.start, "total");
+    for (unsigned int d = 0; d < reporter.ndevs; d++)
+        snapshot_add(&sum, &reporter.prev[d]);
+    for (unsigned int i = 1; i < STATS_STATUS_MAX; i++) {
+        if (sum.failed[i] > 0)
+            fprintf(stderr, "  %llu transfers failed with %s\n",
+                    (unsigned long long)sum.failed[i], status_names[i]);
+    }
+    free(reporter.start);
+    free(reporter.prev);
+    reporter.start = reporter.prev = NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Streaming telemetry. The libusb event thread and the writer threads bump
+ * relaxed atomic counters; a reporting thread turns them into per-interval
+ * rates once per interval and whenever SIGUSR1 arrives, as one line of
+ * text on stderr and optionally one JSON object per line to a file.
+ *
+ * Latencies go into histograms with four buckets per power of two, so
+ * percentiles are good to 25%: bucket 0 is below 1024 ns, and bucket
+ * 1 + 4 * o + q covers [(4 + q) << (o + 8), (5 + q) << (o + 8)) ns. The
+ * last bucket takes everything above. Percentiles are per interval,
+ * maxima for the whole run.
+ */
+
+#define STATS_HIST_OCTAVES 24
+#define STATS_HIST_BUCKETS (1 + 4 * STATS_HIST_OCTAVES)
+#define STATS_STATUS_MAX 8 // libusb_transfer_status values
+
+struct stats_hist {
+    _Atomic uint64_t bucket[STATS_HIST_BUCKETS];
+    _Atomic uint64_t max_ns;
+};
+
+// Counter values at one point in time, for computing rates. Snapshots of
+// several devices add up to the aggregate.
+struct stats_snapshot {
+    uint64_t time_ns;
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t failed[STATS_STATUS_MAX];
+    uint64_t gaps;
+    uint64_t gap_samples;
+    uint64_t short_transfers;
+    uint64_t rate_gaps, rate_samples;
+    uint64_t filled;
+    uint64_t written;
+    uint64_t write_errors;
+    uint64_t callback[STATS_HIST_BUCKETS], callback_max;
+    uint64_t write[STATS_HIST_BUCKETS], write_max;
+    uint64_t latency[STATS_HIST_BUCKETS], latency_max;
+};
+
+// Counters of one device
+struct stats {
+    // Event thread
+    _Atomic uint64_t transfers; // completed successfully
+    _Atomic uint64_t bytes;     // received in completed transfers
+    _Atomic uint64_t failed[STATS_STATUS_MAX];
+    _Atomic uint64_t gaps;        // runs of consecutive lost blocks
+    _Atomic uint64_t gap_samples; // samples in those runs
+    _Atomic uint64_t short_transfers; // completed with less than asked for
+    _Atomic uint64_t rate_gaps;    // gaps found only from the sample rate
+    _Atomic uint64_t rate_samples; // samples in them, part of gap_samples
+    struct stats_hist callback;   // time spent in transfer_callback
+    bool in_gap;
+
+    // Writer thread
+    _Atomic uint64_t written; // bytes accepted by the output sink
+    _Atomic uint64_t write_errors;
+    _Atomic uint64_t filled;   // samples written in place of lost ones
+    struct stats_hist write;   // time per block in the writer
+    struct stats_hist latency; // transfer completion to output written
+};
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The same on CLOCK_MONOTONIC_RAW, which NTP does not slew, for measuring
+// latency from transfer completion to output
+static inline uint64_t stats_raw_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t ns);
+
+// Upper bound in ns of a histogram bucket
+uint64_t stats_hist_bound(unsigned int bucket);
+
+// Accounts one finished transfer with its libusb status and length.
+void stats_transfer(struct stats *s, int status, size_t bytes);
+
+// Accounts a block of samples reaching the output ring, or lost on the
+// way (failed transfer, ring full).
+void stats_block(struct stats *s, size_t samples, bool lost);
+
+// Accounts a transfer that completed short of its length.
+void stats_short(struct stats *s);
+
+// Accounts samples found missing by the sample rate, but not by a failed
+// transfer. They are also passed to stats_block as lost.
+void stats_rate_gap(struct stats *s, uint64_t samples);
+
+// Accounts lost samples filled in on the output.
+void stats_fill(struct stats *s, uint64_t samples);
+
+// Accounts one block handed to the output sink.
+void stats_write(struct stats *s, size_t bytes, bool ok, uint64_t ns);
+
+// Starts the reporting thread for an array of ndevs devices and installs
+// the SIGUSR1 handler. With more than one device every report has a line
+// per device and one for all of them together. json may be NULL. Returns
+// 0 on success.
+int stats_start(struct stats *devs, unsigned int ndevs, unsigned int interval,
+                FILE *json);
+
+// Stops the reporting thread and prints totals for the whole run.
+void stats_stop(void);
+
+#endif
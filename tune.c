@@ -0,0 +1,92 @@
+#include "tune.h"
+
+void tune_init(struct tune *t, unsigned int depth, unsigned int depth_max,
+               unsigned int size, unsigned int size_max, unsigned int pktsize,
+               double byte_rate) {
+    *t = (struct tune){
+        .depth = depth < depth_max ? depth : depth_max,
+        .depth_max = depth_max,
+        .size = size < size_max ? size : size_max,
+        .size_max = size_max,
+        .pktsize = pktsize,
+        .byte_rate = byte_rate,
+    };
+    if (t->depth < TUNE_MIN_DEPTH && depth_max >= TUNE_MIN_DEPTH)
+        t->depth = TUNE_MIN_DEPTH;
+}
+
+uint64_t tune_inflight_ns(const struct tune *t) {
+    return (uint64_t)((double)t->depth * t->size * t->pktsize /
+                      t->byte_rate * 1e9);
+}
+
+static bool tune_grow(struct tune *t) {
+    if (t->depth < t->depth_max) {
+        t->depth = t->depth * 2 < t->depth_max ? t->depth * 2 : t->depth_max;
+        return true;
+    }
+    if (t->size < t->size_max) {
+        t->size = t->size * 2 < t->size_max ? t->size * 2 : t->size_max;
+        return true;
+    }
+    return false;
+}
+
+static bool tune_shrink(struct tune *t) {
+    struct tune next = *t;
+
+    if (next.size > 1)
+        next.size /= 2;
+    else if (next.depth > TUNE_MIN_DEPTH)
+        next.depth--;
+    else
+        return false;
+    if (t->recent_gap >= tune_inflight_ns(&next) / 4)
+        return false;
+    t->size = next.size;
+    t->depth = next.depth;
+    return true;
+}
+
+bool tune_update(struct tune *t, uint64_t now, bool failed) {
+    uint64_t inflight;
+    bool changed = false;
+
+    if (t->window_start == 0) {
+        t->window_start = now;
+        t->last_arrival = now;
+        return false;
+    }
+    if (failed)
+        t->failures++;
+    else if (now - t->last_arrival > t->worst_gap)
+        t->worst_gap = now - t->last_arrival;
+    t->last_arrival = now;
+    if (now - t->window_start < TUNE_WINDOW_NS)
+        return false;
+
+    // The first window includes start-up and the device settling
+    if (t->warm) {
+        inflight = tune_inflight_ns(t);
+        if (t->worst_gap > t->worst_gap_run)
+            t->worst_gap_run = t->worst_gap;
+        t->recent_gap *= TUNE_DECAY;
+        if (t->worst_gap > t->recent_gap)
+            t->recent_gap = t->worst_gap;
+        if (t->failures > 0 || t->worst_gap > inflight / 2) {
+            t->calm = 0;
+            changed = tune_grow(t);
+        } else if (t->worst_gap < inflight / 8 &&
+                   ++t->calm >= TUNE_CALM_WINDOWS) {
+            t->calm = 0;
+            changed = tune_shrink(t);
+        }
+    }
+    t->warm = true;
+    t->window_start = now;
+    t->worst_gap = 0;
+    t->failures = 0;
+    if (changed)
+        t->changes++;
+    return changed;
+}
@@ -0,0 +1,58 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Runtime tuning of the number of transfers in flight (depth) and their
+ * size in packets, for the lowest latency that does not overrun.
+ *
+ * The data in flight covers depth * size * pktsize / rate seconds. The
+ * event thread has to come back for a completion before that runs out,
+ * so the measure of risk is the longest gap between consecutive
+ * completions in a window relative to it:
+ *
+ *  - a failed transfer, or a gap above half the time in flight (a near
+ *    miss), grows the depth, or the size once the depth is at its limit;
+ *  - a run of windows with every gap under an eighth of the time in
+ *    flight shrinks the size, which is what sets the latency, or the
+ *    depth once the size is down to one packet; but only if a slowly
+ *    decaying worst gap stays under a quarter of the smaller time in
+ *    flight, so rare hiccups are remembered across quiet windows.
+ */
+
+#define TUNE_WINDOW_NS 500000000ULL // measurement window
+#define TUNE_CALM_WINDOWS 8         // quiet windows before shrinking
+#define TUNE_MIN_DEPTH 2
+#define TUNE_DECAY 0.97 // per window, a half-life of about 10 s
+
+struct tune {
+    unsigned int depth, depth_max;
+    unsigned int size, size_max; // packets per transfer
+    unsigned int pktsize;
+    double byte_rate;
+
+    uint64_t window_start;
+    uint64_t last_arrival;
+    uint64_t worst_gap;     // in the current window
+    uint64_t worst_gap_run; // over the whole run
+    double recent_gap;      // decaying worst gap
+    unsigned int failures;  // in the current window
+    unsigned int calm;      // consecutive quiet windows
+    unsigned int changes;
+    bool warm;              // past the first window
+};
+
+void tune_init(struct tune *t, unsigned int depth, unsigned int depth_max,
+               unsigned int size, unsigned int size_max, unsigned int pktsize,
+               double byte_rate);
+
+// Accounts one completed (or failed) transfer at time now. Returns true
+// when depth or size changed at the end of a window.
+bool tune_update(struct tune *t, uint64_t now, bool failed);
+
+// Nanoseconds of data covered by the transfers in flight
+uint64_t tune_inflight_ns(const struct tune *t);
+
+#endif